@@ -0,0 +1,288 @@
+/*
+ * Microbenchmarks for the C kernels that dominate post-processing, and for
+ * the sched_get_hosts()/sched_free_hosts() round trip across the FFI.
+ *
+ *   bench/microbench [num_relays num_secs num_measurers]
+ *
+ * With no arguments a small and a large data set are used. Each benchmark is
+ * warmed up, run enough times per sample that a sample takes at least
+ * MIN_SAMPLE_NS, and sampled NUM_SAMPLES times. One JSON object per benchmark
+ * is printed to stdout, in the same format as the sched crate's benches:
+ *
+ *   {"lang":"c","bench":"calc_median","params":{"n":60},"iters":...,
+ *    "ns_per_op":{"median":...,"min":...,"max":...}}
+ *
+ * stderr is sent to /dev/null. The code being measured LOGs a lot, and how
+ * fast a terminal can scroll isn't what we want to measure.
+ *
+ * v3bw.c is included directly so its static functions can be called.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../v3bw.c"
+#include "sched.h"
+
+#define MIN_SAMPLE_NS 20*1000*1000
+#define NUM_SAMPLES 15
+#define NUM_WARMUP 3
+
+/* Keeps the compiler from optimizing away the work being measured */
+static volatile long sink;
+
+typedef void (*bench_fn)(void *arg, size_t iters);
+
+static double
+now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static double
+time_iters(bench_fn fn, void *arg, size_t iters) {
+    const double start = now_ns();
+    fn(arg, iters);
+    return now_ns() - start;
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+    const double aa = *(const double *)a, bb = *(const double *)b;
+    return (aa > bb) - (aa < bb);
+}
+
+/* Time fn and print the results as a line of JSON. params is the inside of
+ * a JSON object describing the data fn works on. */
+static void
+run_bench(const char *name, const char *params, bench_fn fn, void *arg) {
+    double samples[NUM_SAMPLES];
+    size_t iters = 1;
+    for (int i = 0; i < NUM_WARMUP; i++)
+        time_iters(fn, arg, 1);
+    // double the iterations until one sample is long enough to time well
+    while (time_iters(fn, arg, iters) < MIN_SAMPLE_NS)
+        iters *= 2;
+    for (int i = 0; i < NUM_SAMPLES; i++)
+        samples[i] = time_iters(fn, arg, iters) / iters;
+    qsort(samples, NUM_SAMPLES, sizeof(double), compare_doubles);
+    printf("{\"lang\":\"c\",\"bench\":\"%s\",\"params\":{%s},\"iters\":%lu,"
+        "\"ns_per_op\":{\"median\":%.1f,\"min\":%.1f,\"max\":%.1f}}\n",
+        name, params, iters,
+        samples[NUM_SAMPLES/2], samples[0], samples[NUM_SAMPLES-1]);
+    fflush(stdout);
+}
+
+/*
+ * Synthetic data
+ */
+
+static void
+make_fp(char *out, unsigned i) {
+    snprintf(out, 41, "%040X", i);
+}
+
+/* What the coordinator writes to msm_out_file for num_relays relays each
+ * measured for num_secs seconds by num_measurers measurers. Every line is
+ * valid. */
+static char *
+gen_msm_output(unsigned num_relays, unsigned num_secs, unsigned num_measurers, size_t *len_out) {
+    size_t cap = (size_t)num_relays * num_secs * num_measurers * 128 + 1;
+    char *buf = malloc(cap);
+    size_t len = 0;
+    char fp[41];
+    const long start = 1600000000;
+    for (unsigned r = 0; r < num_relays; r++) {
+        make_fp(fp, r);
+        for (unsigned s = 0; s < num_secs; s++) {
+            for (unsigned m = 0; m < num_measurers; m++) {
+                len += snprintf(buf + len, cap - len,
+                    "%ld.000000 %u %s m;10.0.0.%u:%u 650 SPEEDTESTING %ld %ld 0\n",
+                    start + s, r + 1, fp, m % 250, 9000 + m,
+                    start + s, 1000000 + (long)(rand() % 100000));
+            }
+        }
+    }
+    *len_out = len;
+    return buf;
+}
+
+/* A text schedule of num_msms measurements, each with num_hosts measurers
+ * (the last of which is bg). Returns the name of the temp file it's in. */
+static char *
+gen_sched_file(unsigned num_msms, unsigned num_hosts) {
+    char *fname = strdup("/tmp/ff-microbench-XXXXXX.txt");
+    int fd = mkstemps(fname, 4);
+    if (fd < 0) {
+        perror("Unable to make temp schedule file");
+        exit(1);
+    }
+    FILE *f = fdopen(fd, "w");
+    char fp[41];
+    for (unsigned i = 1; i <= num_msms; i++) {
+        make_fp(fp, i);
+        fprintf(f, "%u %s 30 ", i, fp);
+        for (unsigned h = 0; h < num_hosts; h++)
+            fprintf(f, "%s%s", h ? "," : "", h == num_hosts - 1 ? "bg" : "m");
+        fputc(' ', f);
+        for (unsigned h = 0; h < num_hosts; h++)
+            fprintf(f, "%s%u", h ? "," : "", h == num_hosts - 1 ? 125000 : 1000);
+        fputc(' ', f);
+        for (unsigned h = 0; h < num_hosts; h++)
+            fprintf(f, "%s%u", h ? "," : "", h == num_hosts - 1 ? 1 : 80);
+        fputs(" 0\n", f);
+    }
+    fclose(f);
+    return fname;
+}
+
+/*
+ * Benchmarks
+ */
+
+struct words {
+    const char **words;
+    size_t num;
+};
+
+static void
+bench_is_fp(void *arg, size_t iters) {
+    const struct words *w = arg;
+    long n = 0;
+    for (size_t i = 0; i < iters; i++)
+        n += is_fp(w->words[i % w->num]);
+    sink = n;
+}
+
+static void
+bench_as_nonnegative_long(void *arg, size_t iters) {
+    const struct words *w = arg;
+    long n = 0;
+    for (size_t i = 0; i < iters; i++)
+        n += as_nonnegative_long(w->words[i % w->num]);
+    sink = n;
+}
+
+struct longs {
+    long *vals;
+    size_t len;
+};
+
+static void
+bench_calc_median(void *arg, size_t iters) {
+    const struct longs *l = arg;
+    long n = 0;
+    for (size_t i = 0; i < iters; i++)
+        n += calc_median(l->vals, l->len);
+    sink = n;
+}
+
+struct msm_output {
+    char *buf;
+    size_t len;
+};
+
+static void
+bench_read_input_to_ht(void *arg, size_t iters) {
+    const struct msm_output *o = arg;
+    long n = 0;
+    for (size_t i = 0; i < iters; i++) {
+        FILE *in = fmemopen(o->buf, o->len, "r");
+        struct v3bw_read rd;
+        v3bw_read_init(&rd);
+        read_stream_to_ht(in, &rd);
+        v3bw_read_finish(&rd);
+        n += g_hash_table_size(rd.ht);
+        v3bw_read_free(&rd);
+        fclose(in);
+    }
+    sink = n;
+}
+
+struct sched_hosts {
+    unsigned num_msms;
+};
+
+static void
+bench_sched_hosts_round_trip(void *arg, size_t iters) {
+    const struct sched_hosts *s = arg;
+    long n = 0;
+    for (size_t i = 0; i < iters; i++) {
+        char **classes;
+        uint32_t *bws, *conns;
+        size_t num = sched_get_hosts(i % s->num_msms + 1, &classes, &bws, &conns);
+        n += num;
+        sched_free_hosts(classes, bws, conns, num);
+    }
+    sink = n;
+}
+
+static void
+run_all(unsigned num_relays, unsigned num_secs, unsigned num_measurers) {
+    char params[128];
+    // is_fp: valid, wrong length, and bad character (the slowest way to fail)
+    const char *fp_words[] = {
+        "0123456789ABCDEF0123456789ABCDEF01234567",
+        "0123456789ABCDEF",
+        "0123456789ABCDEF0123456789ABCDEF0123456x",
+    };
+    struct words fps = { fp_words, 3 };
+    run_bench("is_fp", "\"mix\":\"valid,short,bad_last\"", bench_is_fp, &fps);
+    const char *num_words[] = { "1600000000", "1048576", "0", "12ab" };
+    struct words nums = { num_words, 4 };
+    run_bench("as_nonnegative_long", "\"mix\":\"ts,bw,zero,bad\"", bench_as_nonnegative_long, &nums);
+    // calc_median sees at most NUM_MSMS_IN_MSM_INFO values. Also try
+    // num_secs if it's different.
+    size_t median_lens[] = { SECS_REQUIRED, NUM_MSMS_IN_MSM_INFO, num_secs };
+    for (size_t i = 0; i < 3; i++) {
+        if (i == 2 && (num_secs == SECS_REQUIRED || num_secs == NUM_MSMS_IN_MSM_INFO))
+            break;
+        struct longs l = { malloc(median_lens[i] * sizeof(long)), median_lens[i] };
+        for (size_t j = 0; j < l.len; j++)
+            l.vals[j] = 1000000 + rand() % 100000;
+        snprintf(params, sizeof(params), "\"n\":%lu", l.len);
+        run_bench("calc_median", params, bench_calc_median, &l);
+        free(l.vals);
+    }
+    struct msm_output o;
+    o.buf = gen_msm_output(num_relays, num_secs, num_measurers, &o.len);
+    snprintf(params, sizeof(params), "\"relays\":%u,\"secs\":%u,\"measurers\":%u,\"bytes\":%lu",
+        num_relays, num_secs, num_measurers, o.len);
+    run_bench("read_input_to_ht", params, bench_read_input_to_ht, &o);
+    free(o.buf);
+    char *sched_fname = gen_sched_file(num_relays, num_measurers);
+    sched_new(sched_fname);
+    while (sched_load_more());
+    struct sched_hosts s = { num_relays };
+    snprintf(params, sizeof(params), "\"msms\":%u,\"hosts\":%u", num_relays, num_measurers);
+    run_bench("sched_get_hosts+sched_free_hosts", params, bench_sched_hosts_round_trip, &s);
+    unlink(sched_fname);
+    free(sched_fname);
+}
+
+int
+main(int argc, const char *argv[]) {
+    if (argc != 1 && argc != 4) {
+        fprintf(stderr, "usage: %s [num_relays num_secs num_measurers]\n", argv[0]);
+        return 1;
+    }
+    if (!freopen("/dev/null", "w", stderr)) {
+        perror("Unable to silence stderr");
+        return 1;
+    }
+    srand(1);
+    if (argc == 4) {
+        unsigned r = atoi(argv[1]), s = atoi(argv[2]), m = atoi(argv[3]);
+        if (!r || !s || !m || s > NUM_MSMS_IN_MSM_INFO) {
+            printf("{\"error\":\"need positive sizes and at most %d secs\"}\n", NUM_MSMS_IN_MSM_INFO);
+            return 1;
+        }
+        run_all(r, s, m);
+    } else {
+        run_all(100, 30, 3);
+        run_all(1000, 60, 5);
+    }
+    return 0;
+}
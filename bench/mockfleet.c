@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+/*
+ * mockfleet: pretend to be a fleet of tor clients for benchmarking the
+ * coordinator without Shadow or real tor.
+ *
+ * Listens on num_ports consecutive loopback ports starting at base_port and
+ * speaks just enough of the control port dialect torclient.c uses:
+ *
+ *   AUTHENTICATE ...        -> 250 OK
+ *   TESTSPEED <fp> <n> [BG] -> 250 SPEEDTESTING
+ *   RESETCONF ...           -> 250 OK
+ *   TESTSPEED <dur>         -> one "650 SPEEDTESTING <ts> <bw> 0" per second
+ *                              for dur seconds, then "650 SPEEDTESTING END"
+ *
+ * Every reply is delayed by the latency plus or minus up to the jitter. Each
+ * second of a measurement takes 1/speedup real seconds, so a 30 second
+ * measurement can be run in 3.
+ *
+ * Prints READY once it is listening. On SIGINT or SIGTERM it prints how many
+ * measurements it saw and setup latency percentiles, then exits. Setup
+ * latency is the time from accepting a connection to receiving its
+ * "TESTSPEED <dur>", so it includes the latency we add ourselves.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LINE_LEN 512
+#define MAX_READY 1024
+
+enum action {
+    act_none = 0,
+    act_reply,
+    act_result,
+};
+
+struct conn {
+    int fd;
+    char buf[LINE_LEN];
+    size_t len;
+    double accepted;
+    // what to do next, and when
+    enum action action;
+    double due;
+    const char *reply;
+    // for act_result
+    unsigned secs_left;
+    long ts;
+};
+
+static volatile sig_atomic_t stop = 0;
+static double latency = 0.0, jitter = 0.0, speedup = 1.0;
+static struct conn **conns = NULL;
+static size_t max_conns = 0;
+static double *setup_lat = NULL;
+static size_t num_setup_lat = 0, cap_setup_lat = 0;
+static unsigned long num_accepted = 0, num_completed = 0, num_closed_early = 0;
+
+static void
+on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double
+now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double
+delay(void) {
+    double d = latency + jitter * (2.0 * rand() / RAND_MAX - 1.0);
+    return d > 0 ? d : 0;
+}
+
+static void
+conn_close(int epfd, struct conn *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    free(c);
+}
+
+static int
+conn_write(struct conn *c, const char *s) {
+    size_t len = strlen(s);
+    return send(c->fd, s, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static void
+record_setup(double secs) {
+    if (num_setup_lat == cap_setup_lat) {
+        cap_setup_lat = cap_setup_lat ? cap_setup_lat * 2 : 1024;
+        setup_lat = realloc(setup_lat, cap_setup_lat * sizeof(double));
+    }
+    setup_lat[num_setup_lat++] = secs;
+}
+
+/* Handle one command from the coordinator. Returns 0 if the connection
+ * should be closed. */
+static int
+handle_line(struct conn *c, const char *line) {
+    char fp[LINE_LEN];
+    unsigned n;
+    if (!strncmp(line, "AUTHENTICATE", 12) || !strncmp(line, "RESETCONF", 9)) {
+        c->reply = "250 OK\r\n";
+    } else if (sscanf(line, "TESTSPEED %s %u", fp, &n) == 2) {
+        c->reply = "250 SPEEDTESTING\r\n";
+    } else if (sscanf(line, "TESTSPEED %u", &n) == 1) {
+        record_setup(now() - c->accepted);
+        c->action = act_result;
+        c->secs_left = n;
+        c->ts = time(NULL);
+        c->due = now() + delay() + 1.0 / speedup;
+        return 1;
+    } else {
+        c->reply = "510 Unrecognized command\r\n";
+    }
+    c->action = act_reply;
+    c->due = now() + delay();
+    return 1;
+}
+
+static int
+conn_read(struct conn *c) {
+    ssize_t got = recv(c->fd, c->buf + c->len, LINE_LEN - 1 - c->len, 0);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if (got <= 0)
+        return 0;
+    c->len += got;
+    c->buf[c->len] = '\0';
+    char *start = c->buf, *end;
+    while ((end = strchr(start, '\n'))) {
+        *end = '\0';
+        if (end > start && end[-1] == '\r')
+            end[-1] = '\0';
+        if (!handle_line(c, start))
+            return 0;
+        start = end + 1;
+    }
+    c->len -= start - c->buf;
+    memmove(c->buf, start, c->len);
+    // a line longer than we'll ever get from the coordinator
+    return c->len < LINE_LEN - 1;
+}
+
+/* Do whatever c has due. Returns 0 if the connection should be closed. */
+static int
+conn_run(struct conn *c) {
+    char line[LINE_LEN];
+    switch (c->action) {
+    case act_reply:
+        c->action = act_none;
+        return conn_write(c, c->reply);
+    case act_result:
+        if (!c->secs_left) {
+            conn_write(c, "650 SPEEDTESTING END\r\n");
+            num_completed++;
+            return 0;
+        }
+        snprintf(line, LINE_LEN, "650 SPEEDTESTING %ld %d 0\r\n",
+            c->ts++, 1000000 + rand() % 50000);
+        c->secs_left--;
+        c->due += 1.0 / speedup;
+        return conn_write(c, line);
+    default:
+        return 1;
+    }
+}
+
+static int
+listen_on(const int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const double p) {
+    if (!num_setup_lat)
+        return 0;
+    size_t i = (size_t)(p * (num_setup_lat - 1) + 0.5);
+    return setup_lat[i];
+}
+
+static void
+print_stats(void) {
+    qsort(setup_lat, num_setup_lat, sizeof(double), cmp_double);
+    printf("accepted %lu\n", num_accepted);
+    printf("started %lu\n", (unsigned long)num_setup_lat);
+    printf("completed %lu\n", num_completed);
+    printf("closed_early %lu\n", num_closed_early);
+    printf("setup_ms_p50 %.3f\n", percentile(0.50) * 1000);
+    printf("setup_ms_p90 %.3f\n", percentile(0.90) * 1000);
+    printf("setup_ms_p99 %.3f\n", percentile(0.99) * 1000);
+    printf("setup_ms_max %.3f\n", percentile(1.00) * 1000);
+    fflush(stdout);
+}
+
+static void
+usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [-l latency_ms] [-j jitter_ms] [-s speedup] <base_port> <num_ports>\n",
+        argv0);
+}
+
+int
+main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:j:s:")) != -1) {
+        switch (opt) {
+        case 'l': latency = atof(optarg) / 1000; break;
+        case 'j': jitter = atof(optarg) / 1000; break;
+        case 's': speedup = atof(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2 || speedup <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const int base_port = atoi(argv[optind]);
+    const int num_ports = atoi(argv[optind + 1]);
+    // one listening socket and one connection per port, plus some spare
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        max_conns = rl.rlim_cur;
+    }
+    if (max_conns < 2 * (size_t)num_ports + 16) {
+        fprintf(stderr, "Need %d fds but can only have %lu\n", 2 * num_ports + 16, (unsigned long)max_conns);
+        return 1;
+    }
+    conns = calloc(max_conns, sizeof(struct conn *));
+    int epfd = epoll_create1(0);
+    int *listeners = calloc(num_ports, sizeof(int));
+    for (int i = 0; i < num_ports; i++) {
+        struct epoll_event e = { .events = EPOLLIN, .data.u64 = 0 };
+        if ((listeners[i] = listen_on(base_port + i)) < 0) {
+            fprintf(stderr, "Unable to listen on port %d: %s\n", base_port + i, strerror(errno));
+            return 1;
+        }
+        // listeners are marked by having the high bit set
+        e.data.u64 = (1ull << 63) | listeners[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i], &e);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    printf("READY\n");
+    fflush(stdout);
+    struct epoll_event *events = calloc(MAX_READY, sizeof(struct epoll_event));
+    while (!stop) {
+        // Find the soonest thing due to work out how long we can sleep. A
+        // linear scan is plenty fast for a few thousand connections.
+        double t = now(), soonest = t + 1.0;
+        for (size_t fd = 0; fd < max_conns; fd++) {
+            struct conn *c = conns[fd];
+            if (!c || c->action == act_none)
+                continue;
+            if (c->due <= t) {
+                if (!conn_run(c)) {
+                    if (c->action == act_result && c->secs_left)
+                        num_closed_early++;
+                    conn_close(epfd, c);
+                }
+                continue;
+            }
+            if (c->due < soonest)
+                soonest = c->due;
+        }
+        int timeout = (int)((soonest - now()) * 1000);
+        int n = epoll_wait(epfd, events, MAX_READY, timeout > 0 ? timeout : 0);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 >> 63) {
+                int lfd = (int)(events[i].data.u64 & 0xffffffff);
+                int fd;
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    struct epoll_event e = { .events = EPOLLIN, .data.u64 = fd };
+                    int one = 1;
+                    if ((size_t)fd >= max_conns) {
+                        close(fd);
+                        continue;
+                    }
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    struct conn *c = calloc(1, sizeof(struct conn));
+                    c->fd = fd;
+                    c->accepted = now();
+                    conns[fd] = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+                    num_accepted++;
+                }
+                continue;
+            }
+            struct conn *c = conns[events[i].data.u64];
+            if (c && !conn_read(c)) {
+                if (c->action == act_result && c->secs_left)
+                    num_closed_early++;
+                conn_close(epfd, c);
+            }
+        }
+    }
+    print_stats();
+    return 0;
+}
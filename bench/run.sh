@@ -0,0 +1,115 @@
+#!/bin/sh
+# End-to-end coordinator benchmark against a fleet of mock tor clients.
+#
+#   bench/run.sh [num_measurers ...]     (default: 100 1000 4096)
+#
+# For each fleet size, starts bench/mockfleet with that many control ports,
+# writes a client file for them (half m, half bg) and a schedule of ROUNDS
+# rounds of m,bg measurements that each use every client, runs flashflow
+# until it says it's done, and prints one line of results:
+#
+#   measurers   number of mock tor clients
+#   msms        measurements that succeeded / total
+#   secs        wall time until flashflow was done
+#   msm_per_sec measurements done per second of wall time
+#   setup_p*    milliseconds from a mock client accepting a connection to it
+#               being told to start measuring, as seen by the mock
+#   cpu_ms_msm  coordinator user+sys CPU time per measurement
+#
+# Knobs, as environment variables: LATENCY and JITTER (ms, per reply),
+# SPEEDUP (measurement seconds per real second), DUR (measurement seconds),
+# ROUNDS, BASE_PORT, FLASHFLOW and MOCKFLEET (paths to the binaries), and
+# KEEP=1 to keep each run's files.
+set -e
+
+FLASHFLOW=${FLASHFLOW:-./flashflow}
+MOCKFLEET=${MOCKFLEET:-bench/mockfleet}
+LATENCY=${LATENCY:-5}
+JITTER=${JITTER:-2}
+SPEEDUP=${SPEEDUP:-10}
+DUR=${DUR:-30}
+ROUNDS=${ROUNDS:-3}
+BASE_PORT=${BASE_PORT:-20000}
+TIMEOUT=${TIMEOUT:-600}
+
+[ $# -eq 0 ] && set -- 100 1000 4096
+# The coordinator needs an fd per measurer too
+ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+ticks=$(getconf CLK_TCK)
+
+# wait_for <file> <pattern> <secs>
+wait_for() {
+    i=0
+    while ! grep -q "$2" "$1" 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt $(($3 * 10)) ] && return 1
+        sleep 0.1
+    done
+}
+
+# getval <file> <key>: the value on the "key value" line of a mockfleet report
+getval() {
+    awk -v k="$2" '$1 == k { print $2 }' "$1"
+}
+
+printf "%-10s %-12s %-8s %-12s %-10s %-10s %-10s %-10s\n" \
+    measurers msms secs msm_per_sec setup_p50 setup_p90 setup_p99 cpu_ms_msm
+for n in "$@"; do
+    dir=$(mktemp -d "${TMPDIR:-/tmp}/ffbench.XXXXXX")
+    num_m=$(((n + 1) / 2))
+    num_bg=$((n - num_m))
+    per_round=$num_bg
+    [ "$per_round" -gt 0 ] || { echo "Need at least 2 measurers" >&2; exit 1; }
+    total=$((per_round * ROUNDS))
+    awk -v n="$n" -v m="$num_m" -v p="$BASE_PORT" 'BEGIN {
+        for (i = 0; i < n; i++)
+            printf "%s 127.0.0.1 %d pw\n", (i < m ? "m" : "bg"), p + i
+    }' > "$dir/clients.txt"
+    # Each measurement depends on the one per_round before it, so no more
+    # than per_round run at once and the fleet is never oversubscribed
+    awk -v t="$total" -v d="$DUR" -v r="$per_round" 'BEGIN {
+        for (i = 1; i <= t; i++)
+            printf "%d %040X %d m,bg 1000,125000 80,1 %d\n", i, i, d, (i > r ? i - r : 0)
+    }' > "$dir/fps.txt"
+
+    "$MOCKFLEET" -l "$LATENCY" -j "$JITTER" -s "$SPEEDUP" "$BASE_PORT" "$n" > "$dir/fleet.out" &
+    fleet=$!
+    if ! wait_for "$dir/fleet.out" READY 30; then
+        echo "mockfleet didn't start. See $dir" >&2
+        kill $fleet 2>/dev/null
+        exit 1
+    fi
+    start=$(date +%s.%N)
+    "$FLASHFLOW" "$dir/fps.txt" "$dir/clients.txt" "$dir/out.msm" "$dir/out.v3bw" 2> "$dir/flashflow.log" &
+    ff=$!
+    if ! wait_for "$dir/flashflow.log" " success, " "$TIMEOUT"; then
+        echo "flashflow didn't finish within $TIMEOUT secs. See $dir" >&2
+        kill $ff $fleet 2>/dev/null
+        exit 1
+    fi
+    end=$(date +%s.%N)
+    # user and sys time are the 14th and 15th fields, after the parenthesized
+    # command name, which can't contain spaces here
+    cpu=$(awk '{ print $14 + $15 }' "/proc/$ff/stat" 2>/dev/null || echo 0)
+    kill $ff
+    kill $fleet
+    wait $fleet || true
+    wait $ff 2>/dev/null || true
+    success=$(grep " success, " "$dir/flashflow.log" | tail -n 1 | sed 's/.*\] \([0-9]*\) success.*/\1/')
+
+    awk -v n="$n" -v s="${success:-0}" -v t="$total" -v a="$start" -v b="$end" \
+        -v p50="$(getval "$dir/fleet.out" setup_ms_p50)" \
+        -v p90="$(getval "$dir/fleet.out" setup_ms_p90)" \
+        -v p99="$(getval "$dir/fleet.out" setup_ms_p99)" \
+        -v cpu="$cpu" -v hz="$ticks" 'BEGIN {
+        secs = b - a
+        printf "%-10d %-12s %-8.1f %-12.2f %-10.1f %-10.1f %-10.1f %-10.3f\n",
+            n, s "/" t, secs, s / secs, p50, p90, p99,
+            (s ? cpu * 1000 / hz / s : 0)
+    }'
+    if [ "${KEEP:-0}" = 1 ]; then
+        echo "Files kept in $dir" >&2
+    else
+        rm -rf "$dir"
+    fi
+done
@@ -6,7 +6,9 @@
 #include "common.h"
 
 #define DESC_META_BUF_SIZE 512
-char desc_meta_buf[DESC_META_BUF_SIZE];
+// per thread so coordinators running in different threads don't describe
+// their metas over each other
+static __thread char desc_meta_buf[DESC_META_BUF_SIZE];
 
 inline const char *
 csm_st_str(const enum csm_state s) {
@@ -31,10 +33,10 @@ desc_meta(const struct ctrl_sock_meta *m) {
     if (!m) {
         return strcpy(desc_meta_buf, "(NULL)");
     }
-    const char *fmt="{%s %s:%s fd=%d m_id=%u}";
+    const char *fmt="{%s %s:%s#%u fd=%d m_id=%u}";
     snprintf(
         desc_meta_buf, DESC_META_BUF_SIZE, fmt,
-        m->class, m->host, m->port, m->fd, m->current_m_id);
+        m->class, m->host, m->port, m->slot, m->fd, m->current_m_id);
     return desc_meta_buf;
 }
 
@@ -45,4 +47,8 @@ free_ctrl_sock_meta(struct ctrl_sock_meta m) {
     free(m.host);
     free(m.port);
     free(m.pw);
+    if (m.shared && !--m.shared->refs) {
+        free(m.shared->slot_m_ids);
+        free(m.shared);
+    }
 }
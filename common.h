@@ -33,6 +33,19 @@ enum csm_state {
     csm_st_failed,
 };
 
+/* A measurer host with one or more slots, each of which is a control session
+ * of its own that can be in a different measurement. Shared by the metas for
+ * its slots. */
+struct ctrl_sock_host {
+    // total bw its slots may be told to use at once, or 0 for no limit
+    uint64_t capacity;
+    uint64_t used;
+    // the m_id each slot is in, or 0
+    unsigned *slot_m_ids;
+    unsigned num_slots;
+    unsigned refs;
+};
+
 struct ctrl_sock_meta {
     int fd;
     enum csm_state state;
@@ -42,6 +55,18 @@ struct ctrl_sock_meta {
     char *pw;
     int is_bg;
     unsigned current_m_id;
+    // which of shared's slots this is
+    unsigned slot;
+    // bw reserved on shared for the current measurement
+    unsigned bw;
+    struct ctrl_sock_host *shared;
+    // its track in the trace, once it has one
+    uint16_t trace_track;
+    // stopped before its TESTSPEED was over, which its tor client keeps
+    // running, so it stays connected and keeps its bw until that ends, or
+    // until stopping_failsafe if it never seems to
+    int stopping;
+    uint64_t stopping_failsafe;
 };
 
 struct msm_params {
@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <glib.h>
+#include "converge.h"
+
+/*
+ * Online convergence detection for running measurements.
+ *
+ * Every measurer sends us its bw for each second. The relay's bw for a second
+ * is the sum across all of the measurement's measurers, same as v3bw.c
+ * computes it afterwards. Once every measurer has reported a second we add
+ * its sum to a sorted list and look at the median. If enough seconds are in
+ * and the order-statistic confidence band around the median is narrow, more
+ * seconds aren't going to change the answer much and the measurement can be
+ * stopped.
+ *
+ * The complete seconds are also handed back to the caller as they happen, so
+ * the coordinator can report one total per second instead of every
+ * measurer's share of it.
+ */
+
+struct cv_msm {
+    unsigned num_hosts;
+    long first;
+    long sums[CV_MAX_SECS];
+    // the part of sums from bg measurers
+    long bg_sums[CV_MAX_SECS];
+    unsigned counts[CV_MAX_SECS];
+    // sums of the complete seconds, sorted
+    long sorted[CV_MAX_SECS];
+    unsigned num_sorted;
+    int converged;
+};
+
+struct cv_ctx {
+    // m_id -> struct cv_msm
+    GHashTable *msms;
+};
+
+// used by threads that haven't picked a cv_ctx of their own
+static struct cv_ctx cv_shared_ctx;
+static __thread struct cv_ctx *cv_cur = &cv_shared_ctx;
+#define cv_msms (cv_cur->msms)
+
+/**
+ * A new set of measurements to watch, for running more than one coordinator
+ * in a process. Pick it with cv_ctx_use().
+ */
+struct cv_ctx *
+cv_ctx_new(void) {
+    return calloc(1, sizeof(struct cv_ctx));
+}
+
+/**
+ * Have the cv_* functions called from this thread work on ctx from now on,
+ * or on the shared set if ctx is NULL
+ */
+void
+cv_ctx_use(struct cv_ctx *ctx) {
+    cv_cur = ctx ? ctx : &cv_shared_ctx;
+}
+
+void
+cv_ctx_free(struct cv_ctx *ctx) {
+    if (!ctx)
+        return;
+    if (cv_cur == ctx)
+        cv_cur = &cv_shared_ctx;
+    if (ctx->msms)
+        g_hash_table_destroy(ctx->msms);
+    free(ctx);
+}
+
+/**
+ * Start watching a measurement that is about to start, whose results will
+ * come from num_hosts measurers.
+ */
+void
+cv_start(const unsigned m_id, const unsigned num_hosts) {
+    if (!cv_msms) {
+        cv_msms = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    }
+    struct cv_msm *cv = calloc(1, sizeof(struct cv_msm));
+    cv->num_hosts = num_hosts;
+    cv->first = -1;
+    g_hash_table_replace(cv_msms, GUINT_TO_POINTER(m_id), cv);
+}
+
+static struct cv_msm *
+cv_get(const unsigned m_id) {
+    if (!cv_msms) return NULL;
+    return g_hash_table_lookup(cv_msms, GUINT_TO_POINTER(m_id));
+}
+
+static void
+cv_insert_sorted(struct cv_msm *cv, long sum) {
+    assert(cv->num_sorted < CV_MAX_SECS);
+    unsigned i = cv->num_sorted++;
+    for (; i > 0 && cv->sorted[i-1] > sum; i--) {
+        cv->sorted[i] = cv->sorted[i-1];
+    }
+    cv->sorted[i] = sum;
+}
+
+/**
+ * Whether the 95% confidence band for the median of cv's complete seconds is
+ * within CV_BAND of the median. The median is picked the same way as in
+ * v3bw.c.
+ */
+static int
+cv_check(const struct cv_msm *cv) {
+    const unsigned n = cv->num_sorted;
+    if (n < CV_MIN_SECS)
+        return 0;
+    const long med = cv->sorted[n/2];
+    const double half = 1.96 * sqrt(n) / 2;
+    long lo = (long)floor(n / 2.0 - half);
+    long hi = (long)ceil(n / 2.0 + half);
+    if (lo < 0) lo = 0;
+    if (hi > (long)n - 1) hi = (long)n - 1;
+    return cv->sorted[hi] - cv->sorted[lo] <= CV_BAND * med;
+}
+
+/**
+ * Add one measurer's bw for second ts to the given measurement. Returns 1 if
+ * this was the last measurer to report that second, in which case its totals
+ * are put in sec, otherwise 0. Results for measurements we aren't watching,
+ * or that have already converged, are ignored.
+ */
+int
+cv_add(const unsigned m_id, const long ts, const long bw, const int is_bg, struct cv_sec *sec) {
+    struct cv_msm *cv = cv_get(m_id);
+    if (!cv || cv->converged)
+        return 0;
+    if (cv->first < 0)
+        cv->first = ts;
+    if (ts < cv->first || ts >= cv->first + CV_MAX_SECS)
+        return 0;
+    const size_t offset = ts - cv->first;
+    cv->sums[offset] += bw;
+    if (is_bg)
+        cv->bg_sums[offset] += bw;
+    if (++cv->counts[offset] != cv->num_hosts)
+        return 0;
+    cv_insert_sorted(cv, cv->sums[offset]);
+    sec->ts = ts;
+    sec->bw = cv->sums[offset] - cv->bg_sums[offset];
+    sec->bg_bw = cv->bg_sums[offset];
+    sec->num_hosts = cv->num_hosts;
+    if (cv_check(cv)) {
+        LOG("Measurement id=%u converged after %u secs with median %ld\n",
+            m_id, cv->num_sorted, cv->sorted[cv->num_sorted/2]);
+        cv->converged = 1;
+    }
+    return 1;
+}
+
+int
+cv_converged(const unsigned m_id) {
+    struct cv_msm *cv = cv_get(m_id);
+    return cv && cv->converged;
+}
+
+/**
+ * How many seconds of the measurement have results from every measurer
+ */
+unsigned
+cv_num_secs(const unsigned m_id) {
+    struct cv_msm *cv = cv_get(m_id);
+    return cv ? cv->num_sorted : 0;
+}
+
+/**
+ * The median of the seconds that have results from every measurer, picked
+ * the same way as in v3bw.c, or 0 if there are none yet
+ */
+long
+cv_median(const unsigned m_id) {
+    struct cv_msm *cv = cv_get(m_id);
+    return cv && cv->num_sorted ? cv->sorted[cv->num_sorted/2] : 0;
+}
+
+/**
+ * Stop watching the measurement, freeing what we kept for it. Call this
+ * whenever a measurement ends, successfully or not.
+ */
+void
+cv_forget(const unsigned m_id) {
+    if (cv_msms)
+        g_hash_table_remove(cv_msms, GUINT_TO_POINTER(m_id));
+}
@@ -0,0 +1,30 @@
+#ifndef FF_CONVERGE_H
+#define FF_CONVERGE_H
+#include "common.h"
+// Never stop a measurement before this many seconds have every measurer's
+// result in them
+#define CV_MIN_SECS 10
+// Ignore results this many seconds or more after the first one, like v3bw.c
+#define CV_MAX_SECS 60
+// Stop once the median's confidence band is within this fraction of it
+#define CV_BAND 0.10
+// the relay's totals for one second that every measurer has reported
+struct cv_sec {
+    long ts;
+    // from measurers that aren't bg
+    long bw;
+    // the relay's own traffic, reported by the bg measurer
+    long bg_bw;
+    unsigned num_hosts;
+};
+struct cv_ctx;
+struct cv_ctx *cv_ctx_new(void);
+void cv_ctx_use(struct cv_ctx *ctx);
+void cv_ctx_free(struct cv_ctx *ctx);
+void cv_start(const unsigned m_id, const unsigned num_hosts);
+int cv_add(const unsigned m_id, const long ts, const long bw, const int is_bg, struct cv_sec *sec);
+int cv_converged(const unsigned m_id);
+unsigned cv_num_secs(const unsigned m_id);
+long cv_median(const unsigned m_id);
+void cv_forget(const unsigned m_id);
+#endif /* !defined(FF_CONVERGE_H) */
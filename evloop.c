@@ -0,0 +1,610 @@
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef FF_IO_URING
+#include <poll.h>
+#include <liburing.h>
+#endif
+#include "evloop.h"
+#include "trace.h"
+
+/*
+ * The coordinator's I/O. Each time around the main loop, it says which fds it
+ * is waiting to read from (ev_begin() then ev_want()), waits for some of them
+ * to have something with ev_wait(), and reads with ev_recv(). Commands go out
+ * with ev_send().
+ *
+ * With epoll that's just epoll_wait(), recv(), and send(), except fds stay
+ * registered for as long as they keep being wanted instead of being added and
+ * deleted every loop.
+ *
+ * With io_uring (if built with FF_IO_URING and the kernel supports it), each
+ * wanted socket gets a multishot receive that keeps filling buffers from a
+ * provided buffer ring. What arrives is copied to the fd's inbox until
+ * ev_recv() takes it. Sends are queued and submitted together the next time we
+ * wait. Most loops then make one io_uring_enter() no matter how many sockets
+ * are involved. Set FF_EVLOOP=epoll in the environment to use epoll anyway.
+ */
+
+#define EV_MAX_EVENTS 4096
+
+enum ev_backend_type {
+    ev_be_epoll = 0,
+    ev_be_uring,
+};
+
+struct ev_fd {
+    // ev->loop the last time this fd was wanted
+    unsigned wanted;
+    // from ev_watch(): wanted every loop until forgotten
+    int watch;
+    // epoll: registered. io_uring: has a receive or poll in flight
+    int armed;
+    // bumped when the fd is forgotten so late completions for it are ignored
+    unsigned gen;
+#ifdef FF_IO_URING
+    char *inbox;
+    size_t inbox_len;
+    size_t inbox_cap;
+    int eof;
+    int err;
+    int poll_ready;
+#endif
+};
+
+struct evloop {
+    enum ev_backend_type type;
+    unsigned loop;
+    struct ev_fd *fds;
+    int fds_cap;
+    int epfd;
+    struct epoll_event *events;
+#ifdef FF_IO_URING
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+#endif
+};
+
+static struct ev_fd *
+ev_fd_get(struct evloop *ev, const int fd) {
+    if (fd >= ev->fds_cap) {
+        int cap = ev->fds_cap ? ev->fds_cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        ev->fds = realloc(ev->fds, cap * sizeof(struct ev_fd));
+        memset(&ev->fds[ev->fds_cap], 0, (cap - ev->fds_cap) * sizeof(struct ev_fd));
+        ev->fds_cap = cap;
+    }
+    return &ev->fds[fd];
+}
+
+static int
+ev_is_wanted(const struct evloop *ev, const struct ev_fd *f) {
+    return f->watch || f->wanted == ev->loop;
+}
+
+/*
+ * epoll
+ */
+
+static void
+ev_epoll_sync(struct evloop *ev) {
+    struct epoll_event e = { .events = EPOLLIN };
+    for (int fd = 0; fd < ev->fds_cap; fd++) {
+        struct ev_fd *f = &ev->fds[fd];
+        const int want = ev_is_wanted(ev, f);
+        if (want && !f->armed) {
+            e.data.fd = fd;
+            if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e)) {
+                LOG("Error telling epoll to add %d: %s\n", fd, strerror(errno));
+            } else {
+                f->armed = 1;
+            }
+        } else if (!want && f->armed) {
+            if (epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL)) {
+                LOG("Error telling epoll to delete %d: %s\n", fd, strerror(errno));
+            }
+            f->armed = 0;
+        }
+    }
+}
+
+static int
+ev_epoll_wait(struct evloop *ev, const int timeout_ms, int ready[], int max_ready) {
+    ev_epoll_sync(ev);
+    if (max_ready > EV_MAX_EVENTS)
+        max_ready = EV_MAX_EVENTS;
+    const int n = epoll_wait(ev->epfd, ev->events, max_ready, timeout_ms);
+    for (int i = 0; i < n; i++)
+        ready[i] = ev->events[i].data.fd;
+    return n;
+}
+
+/*
+ * io_uring
+ */
+
+#ifdef FF_IO_URING
+#define EV_RING_ENTRIES 1024
+#define EV_CQ_ENTRIES (8 * EV_RING_ENTRIES)
+#define EV_BUF_GROUP 0
+// must be a power of 2
+#define EV_NUM_BUFS 1024
+#define EV_BUF_SIZE 4096
+#define EV_GEN_MASK 0x3fffffff
+
+// What a completion is for. Kept in the low 2 bits of its user data.
+enum ev_op {
+    ev_op_ignore = 0,
+    ev_op_recv,
+    ev_op_poll,
+    ev_op_send,
+};
+
+#define EV_UD(op, fd, gen) \
+    (((uint64_t)((gen) & EV_GEN_MASK) << 34) | ((uint64_t)(uint32_t)(fd) << 2) | (op))
+
+// A queued send. Its data has to live until the send completes. malloc()
+// alignment leaves the low 2 bits of its address free for ev_op_send.
+struct ev_send_req {
+    int fd;
+    unsigned gen;
+    size_t len;
+    char data[];
+};
+
+static struct io_uring_sqe *
+ev_get_sqe(struct evloop *ev) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ev->ring);
+    if (!sqe) {
+        // full. Submit what's queued to make room
+        io_uring_submit(&ev->ring);
+        sqe = io_uring_get_sqe(&ev->ring);
+    }
+    assert(sqe);
+    return sqe;
+}
+
+static int
+ev_uring_init(struct evloop *ev) {
+    struct io_uring_params params;
+    int ret;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = EV_CQ_ENTRIES;
+    if ((ret = io_uring_queue_init_params(EV_RING_ENTRIES, &ev->ring, &params)) < 0) {
+        LOG("Unable to set up io_uring, falling back to epoll: %s\n", strerror(-ret));
+        return 0;
+    }
+    if (!(ev->br = io_uring_setup_buf_ring(&ev->ring, EV_NUM_BUFS, EV_BUF_GROUP, 0, &ret))) {
+        LOG("Unable to set up io_uring buffer ring, falling back to epoll: %s\n", strerror(-ret));
+        io_uring_queue_exit(&ev->ring);
+        return 0;
+    }
+    ev->bufs = malloc(EV_NUM_BUFS * EV_BUF_SIZE);
+    for (int i = 0; i < EV_NUM_BUFS; i++) {
+        io_uring_buf_ring_add(ev->br, ev->bufs + i * EV_BUF_SIZE, EV_BUF_SIZE, i,
+            io_uring_buf_ring_mask(EV_NUM_BUFS), i);
+    }
+    io_uring_buf_ring_advance(ev->br, EV_NUM_BUFS);
+    return 1;
+}
+
+static void
+ev_uring_recycle(struct evloop *ev, const unsigned bid) {
+    io_uring_buf_ring_add(ev->br, ev->bufs + bid * EV_BUF_SIZE, EV_BUF_SIZE, bid,
+        io_uring_buf_ring_mask(EV_NUM_BUFS), 0);
+    io_uring_buf_ring_advance(ev->br, 1);
+}
+
+static void
+ev_uring_arm(struct evloop *ev, const int fd, struct ev_fd *f) {
+    struct io_uring_sqe *sqe = ev_get_sqe(ev);
+    if (f->watch) {
+        io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+        io_uring_sqe_set_data64(sqe, EV_UD(ev_op_poll, fd, f->gen));
+    } else {
+        io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = EV_BUF_GROUP;
+        io_uring_sqe_set_data64(sqe, EV_UD(ev_op_recv, fd, f->gen));
+    }
+    f->armed = 1;
+}
+
+/**
+ * Arm a receive for every wanted fd that doesn't have one. Receives stay armed
+ * when an fd stops being wanted. Whatever arrives waits in its inbox.
+ */
+static void
+ev_uring_sync(struct evloop *ev) {
+    for (int fd = 0; fd < ev->fds_cap; fd++) {
+        struct ev_fd *f = &ev->fds[fd];
+        if (ev_is_wanted(ev, f) && !f->armed && !f->eof && !f->err)
+            ev_uring_arm(ev, fd, f);
+    }
+}
+
+static void
+ev_uring_inbox_add(struct ev_fd *f, const char *data, const size_t len) {
+    if (f->inbox_len + len > f->inbox_cap) {
+        f->inbox_cap = f->inbox_cap ? f->inbox_cap : EV_BUF_SIZE;
+        while (f->inbox_len + len > f->inbox_cap)
+            f->inbox_cap *= 2;
+        f->inbox = realloc(f->inbox, f->inbox_cap);
+    }
+    memcpy(f->inbox + f->inbox_len, data, len);
+    f->inbox_len += len;
+}
+
+static void
+ev_uring_complete(struct evloop *ev, const struct io_uring_cqe *cqe) {
+    const uint64_t ud = io_uring_cqe_get_data64(cqe);
+    const enum ev_op op = ud & 3;
+    if (op == ev_op_ignore)
+        return;
+    if (op == ev_op_send) {
+        struct ev_send_req *req = (struct ev_send_req *)(uintptr_t)(ud & ~(uint64_t)3);
+        if (cqe->res < 0 || (size_t)cqe->res < req->len) {
+            LOG("Error sending to fd=%d: %s\n", req->fd,
+                cqe->res < 0 ? strerror(-cqe->res) : "short send");
+            if (req->fd < ev->fds_cap && ev->fds[req->fd].gen == req->gen)
+                ev->fds[req->fd].err = cqe->res < 0 ? -cqe->res : EIO;
+        }
+        free(req);
+        return;
+    }
+    const int fd = (ud >> 2) & 0xffffffff;
+    const unsigned gen = ud >> 34;
+    const int has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+    const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct ev_fd *f = fd < ev->fds_cap ? &ev->fds[fd] : NULL;
+    if (!f || (f->gen & EV_GEN_MASK) != gen) {
+        // for an fd that has since been forgotten
+        if (has_buf)
+            ev_uring_recycle(ev, bid);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        f->armed = 0;
+    if (op == ev_op_poll) {
+        if (cqe->res > 0) {
+            f->poll_ready = 1;
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            LOG("Error polling fd=%d: %s\n", fd, strerror(-cqe->res));
+        }
+        return;
+    }
+    if (cqe->res > 0) {
+        ev_uring_inbox_add(f, ev->bufs + bid * EV_BUF_SIZE, cqe->res);
+    } else if (cqe->res == 0) {
+        f->eof = 1;
+    } else if (cqe->res == -ENOBUFS) {
+        // Ran out of buffers. The receive ended and will be armed again
+        // after we've recycled some.
+    } else if (cqe->res != -ECANCELED) {
+        f->err = -cqe->res;
+    }
+    if (has_buf)
+        ev_uring_recycle(ev, bid);
+}
+
+static void
+ev_uring_reap(struct evloop *ev) {
+    struct io_uring_cqe *cqe;
+    unsigned head, count = 0;
+    io_uring_for_each_cqe(&ev->ring, head, cqe) {
+        ev_uring_complete(ev, cqe);
+        count++;
+    }
+    io_uring_cq_advance(&ev->ring, count);
+}
+
+static int
+ev_uring_is_ready(const struct ev_fd *f) {
+    return f->inbox_len || f->eof || f->err || f->poll_ready;
+}
+
+static int
+ev_uring_any_ready(const struct evloop *ev) {
+    for (int fd = 0; fd < ev->fds_cap; fd++)
+        if (ev_is_wanted(ev, &ev->fds[fd]) && ev_uring_is_ready(&ev->fds[fd]))
+            return 1;
+    return 0;
+}
+
+static int
+ev_uring_collect(struct evloop *ev, int ready[], const int max_ready) {
+    int n = 0;
+    for (int fd = 0; fd < ev->fds_cap && n < max_ready; fd++) {
+        struct ev_fd *f = &ev->fds[fd];
+        if (ev_is_wanted(ev, f) && ev_uring_is_ready(f)) {
+            ready[n++] = fd;
+            f->poll_ready = 0;
+        }
+    }
+    return n;
+}
+
+static int
+ev_uring_wait(struct evloop *ev, const int timeout_ms, int ready[], const int max_ready) {
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    while (1) {
+        ev_uring_sync(ev);
+        const int wait = timeout_ms != 0 && !ev_uring_any_ready(ev);
+        int timed_out = 0;
+        if (wait) {
+            struct io_uring_cqe *cqe;
+            struct __kernel_timespec ts, *tsp = NULL;
+            if (timeout_ms > 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long ns = (deadline.tv_sec - now.tv_sec) * 1000000000L + (deadline.tv_nsec - now.tv_nsec);
+                if (ns < 0)
+                    ns = 0;
+                ts.tv_sec = ns / 1000000000L;
+                ts.tv_nsec = ns % 1000000000L;
+                tsp = &ts;
+            }
+            const int ret = io_uring_submit_and_wait_timeout(&ev->ring, &cqe, 1, tsp, NULL);
+            if (ret == -ETIME) {
+                timed_out = 1;
+            } else if (ret < 0) {
+                errno = -ret;
+                return -1;
+            }
+        } else {
+            io_uring_submit(&ev->ring);
+        }
+        ev_uring_reap(ev);
+        if (!wait || timed_out || ev_uring_any_ready(ev))
+            return ev_uring_collect(ev, ready, max_ready);
+        // Only heard from fds that aren't wanted right now. Keep waiting.
+    }
+}
+
+static ssize_t
+ev_uring_recv(struct evloop *ev, const int fd, void *buf, const size_t len) {
+    struct ev_fd *f = ev_fd_get(ev, fd);
+    if (f->inbox_len) {
+        const size_t n = len < f->inbox_len ? len : f->inbox_len;
+        memcpy(buf, f->inbox, n);
+        memmove(f->inbox, f->inbox + n, f->inbox_len - n);
+        f->inbox_len -= n;
+        return n;
+    }
+    if (f->err) {
+        errno = f->err;
+        return -1;
+    }
+    if (f->eof)
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t
+ev_uring_send(struct evloop *ev, const int fd, const void *buf, const size_t len) {
+    struct ev_fd *f = ev_fd_get(ev, fd);
+    if (f->err) {
+        errno = f->err;
+        return -1;
+    }
+    struct ev_send_req *req = malloc(sizeof(struct ev_send_req) + len);
+    req->fd = fd;
+    req->gen = f->gen;
+    req->len = len;
+    memcpy(req->data, buf, len);
+    struct io_uring_sqe *sqe = ev_get_sqe(ev);
+    io_uring_prep_send(sqe, fd, req->data, len, 0);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)req | ev_op_send);
+    return len;
+}
+
+static void
+ev_uring_forget(struct evloop *ev, const int fd, struct ev_fd *f) {
+    if (f->armed) {
+        struct io_uring_sqe *sqe = ev_get_sqe(ev);
+        io_uring_prep_cancel64(sqe, EV_UD(f->watch ? ev_op_poll : ev_op_recv, fd, f->gen), 0);
+        io_uring_sqe_set_data64(sqe, EV_UD(ev_op_ignore, fd, f->gen));
+    }
+    // Submit now, before the caller closes fd: sends queued for it need to go
+    // out on this socket and not whatever gets its fd number next.
+    io_uring_submit(&ev->ring);
+    free(f->inbox);
+}
+#endif /* defined(FF_IO_URING) */
+
+/*
+ * Common interface
+ */
+
+struct evloop *
+ev_new(void) {
+    struct evloop *ev = calloc(1, sizeof(struct evloop));
+    // so that fds that have never been wanted (wanted == 0) aren't wanted now
+    ev->loop = 1;
+#ifdef FF_IO_URING
+    const char *want = getenv("FF_EVLOOP");
+    if (!(want && !strcmp(want, "epoll")) && ev_uring_init(ev)) {
+        ev->type = ev_be_uring;
+        LOG("Using %s for I/O\n", ev_backend(ev));
+        return ev;
+    }
+#endif
+    ev->type = ev_be_epoll;
+    if ((ev->epfd = epoll_create1(0)) < 0) {
+        LOG("Unable to create epoll fd: %s\n", strerror(errno));
+        free(ev);
+        return NULL;
+    }
+    ev->events = calloc(EV_MAX_EVENTS, sizeof(struct epoll_event));
+    LOG("Using %s for I/O\n", ev_backend(ev));
+    return ev;
+}
+
+const char *
+ev_backend(const struct evloop *ev) {
+    return ev->type == ev_be_uring ? "io_uring" : "epoll";
+}
+
+/**
+ * Start a new loop. Only fds given to ev_want() after this (and fds given to
+ * ev_watch()) are reported by ev_wait().
+ */
+void
+ev_begin(struct evloop *ev) {
+    ev->loop++;
+}
+
+void
+ev_want(struct evloop *ev, const int fd) {
+    ev_fd_get(ev, fd)->wanted = ev->loop;
+}
+
+void
+ev_want_all(struct evloop *ev, const int *fds, const size_t num_fds) {
+    for (size_t i = 0; i < num_fds; i++)
+        ev_want(ev, fds[i]);
+}
+
+/**
+ * Always report when fd is readable, but don't read from it. The caller does
+ * that itself. For things like inotify fds that aren't sockets.
+ */
+int
+ev_watch(struct evloop *ev, const int fd) {
+    ev_fd_get(ev, fd)->watch = 1;
+    if (ev->type == ev_be_epoll)
+        ev_epoll_sync(ev);
+    return 0;
+}
+
+/**
+ * Wait up to timeout_ms (or forever if -1) for wanted fds to have something to
+ * read. Fills ready with up to max_ready of them and returns how many, or 0 on
+ * timeout, or -1 on error with errno set.
+ */
+int
+ev_wait(struct evloop *ev, const int timeout_ms, int ready[], const int max_ready) {
+    struct timespec before, after;
+    int n;
+    const int tracing = tr_on();
+    if (tracing) {
+        // so what happened before a long wait isn't lost if we are killed
+        // during it
+        if (timeout_ms)
+            tr_sync();
+        clock_gettime(CLOCK_MONOTONIC, &before);
+    }
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring)
+        n = ev_uring_wait(ev, timeout_ms, ready, max_ready);
+    else
+#endif
+    n = ev_epoll_wait(ev, timeout_ms, ready, max_ready);
+    if (tracing) {
+        const int saved_errno = errno;
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        const long waited_us = (after.tv_sec - before.tv_sec) * 1000000L + (after.tv_nsec - before.tv_nsec) / 1000;
+        tr_event(tr_wakeup, 0, 0, 0, n < 0 ? 0 : n, waited_us);
+        errno = saved_errno;
+    }
+    return n;
+}
+
+/**
+ * Like recv(). Never blocks with io_uring: if nothing has arrived, returns -1
+ * with errno EAGAIN.
+ */
+ssize_t
+ev_recv(struct evloop *ev, const int fd, void *buf, const size_t len) {
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring)
+        return ev_uring_recv(ev, fd, buf, len);
+#endif
+    return recv(fd, buf, len, 0);
+}
+
+/**
+ * Like send(). With io_uring the data is copied and sent the next time we
+ * wait, and a failure is reported by the next ev_recv() or ev_send() on fd.
+ */
+ssize_t
+ev_send(struct evloop *ev, const int fd, const void *buf, const size_t len) {
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring)
+        return ev_uring_send(ev, fd, buf, len);
+#endif
+    return send(fd, buf, len, 0);
+}
+
+/**
+ * Send whatever ev_send() has queued now instead of the next time we wait, so
+ * a burst of sends goes out together
+ */
+void
+ev_flush(struct evloop *ev) {
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring)
+        io_uring_submit(&ev->ring);
+#else
+    (void)ev;
+#endif
+}
+
+/**
+ * Stop watching fd and drop anything buffered for it. Must be called before
+ * closing fd, since its number can be reused right after.
+ */
+void
+ev_forget(struct evloop *ev, const int fd) {
+    if (fd < 0 || fd >= ev->fds_cap)
+        return;
+    struct ev_fd *f = &ev->fds[fd];
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring)
+        ev_uring_forget(ev, fd, f);
+#endif
+    if (ev->type == ev_be_epoll && f->armed)
+        epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+    const unsigned gen = f->gen;
+    memset(f, 0, sizeof(struct ev_fd));
+    f->gen = gen + 1;
+}
+
+void
+ev_free(struct evloop *ev) {
+    if (!ev) return;
+#ifdef FF_IO_URING
+    if (ev->type == ev_be_uring) {
+        for (int fd = 0; fd < ev->fds_cap; fd++)
+            free(ev->fds[fd].inbox);
+        io_uring_free_buf_ring(&ev->ring, ev->br, EV_NUM_BUFS, EV_BUF_GROUP);
+        io_uring_queue_exit(&ev->ring);
+        free(ev->bufs);
+    }
+#endif
+    if (ev->type == ev_be_epoll) {
+        close(ev->epfd);
+        free(ev->events);
+    }
+    free(ev->fds);
+    free(ev);
+}
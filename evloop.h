@@ -0,0 +1,18 @@
+#ifndef FF_EVLOOP_H
+#define FF_EVLOOP_H
+#include <sys/types.h>
+#include "common.h"
+struct evloop;
+struct evloop *ev_new(void);
+const char *ev_backend(const struct evloop *ev);
+void ev_begin(struct evloop *ev);
+void ev_want(struct evloop *ev, const int fd);
+void ev_want_all(struct evloop *ev, const int *fds, const size_t num_fds);
+int ev_watch(struct evloop *ev, const int fd);
+int ev_wait(struct evloop *ev, const int timeout_ms, int ready[], const int max_ready);
+ssize_t ev_recv(struct evloop *ev, const int fd, void *buf, const size_t len);
+ssize_t ev_send(struct evloop *ev, const int fd, const void *buf, const size_t len);
+void ev_flush(struct evloop *ev);
+void ev_forget(struct evloop *ev, const int fd);
+void ev_free(struct evloop *ev);
+#endif /* !defined(FF_EVLOOP_H) */
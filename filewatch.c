@@ -0,0 +1,110 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include "filewatch.h"
+
+#define FW_EVENT_BUF_LEN (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/*
+ * We watch the directory each file lives in instead of the file itself. Most
+ * editors (and anything that writes a temp file and rename()s it into place)
+ * replace the file, which would silently kill a watch on the file's inode.
+ */
+struct file_watch {
+    int fd;
+    int num_files;
+    int wds[FW_MAX_FILES];
+    char *names[FW_MAX_FILES];
+};
+
+struct file_watch *
+fw_new(void) {
+    struct file_watch *fw = calloc(1, sizeof(struct file_watch));
+    if ((fw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        LOG("Unable to init inotify: %s\n", strerror(errno));
+        free(fw);
+        return NULL;
+    }
+    return fw;
+}
+
+/**
+ * Start watching fname for changes. Returns the index of fname, which is the
+ * bit that will be set in fw_read_changes()'s return value when it changes, or
+ * -1 on error.
+ */
+int
+fw_add(struct file_watch *fw, const char *fname) {
+    if (fw->num_files >= FW_MAX_FILES) {
+        LOG("Can't watch %s, already watching %d files\n", fname, fw->num_files);
+        return -1;
+    }
+    // dirname() and basename() may modify what they are given, so each gets
+    // its own copy
+    char *dir_copy = strdup(fname);
+    char *base_copy = strdup(fname);
+    const char *dir = dirname(dir_copy);
+    int wd = inotify_add_watch(fw->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        LOG("Unable to watch %s for changes to %s: %s\n", dir, fname, strerror(errno));
+        free(dir_copy);
+        free(base_copy);
+        return -1;
+    }
+    const int idx = fw->num_files++;
+    fw->wds[idx] = wd;
+    fw->names[idx] = strdup(basename(base_copy));
+    LOG("Watching %s for changes to %s\n", dir, fw->names[idx]);
+    free(dir_copy);
+    free(base_copy);
+    return idx;
+}
+
+int
+fw_fd(const struct file_watch *fw) {
+    return fw->fd;
+}
+
+/**
+ * Drain all pending inotify events without blocking. Returns a bitmask with
+ * bit i set if the i'th file given to fw_add() was written or replaced since
+ * the last call.
+ */
+unsigned
+fw_read_changes(struct file_watch *fw) {
+    char buf[FW_EVENT_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    unsigned changed = 0;
+    ssize_t len;
+    while ((len = read(fw->fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event *ev;
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)ptr;
+            if (!ev->len)
+                continue;
+            for (int i = 0; i < fw->num_files; i++) {
+                if (ev->wd == fw->wds[i] && !strcmp(ev->name, fw->names[i])) {
+                    changed |= 1u << i;
+                }
+            }
+        }
+    }
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG("Error reading inotify events: %s\n", strerror(errno));
+    }
+    return changed;
+}
+
+void
+fw_free(struct file_watch *fw) {
+    if (!fw) return;
+    for (int i = 0; i < fw->num_files; i++) {
+        free(fw->names[i]);
+    }
+    close(fw->fd);
+    free(fw);
+}
@@ -0,0 +1,11 @@
+#ifndef FF_FILEWATCH_H
+#define FF_FILEWATCH_H
+#include "common.h"
+#define FW_MAX_FILES 8
+struct file_watch;
+struct file_watch *fw_new(void);
+int fw_add(struct file_watch *fw, const char *fname);
+int fw_fd(const struct file_watch *fw);
+unsigned fw_read_changes(struct file_watch *fw);
+void fw_free(struct file_watch *fw);
+#endif /* !defined(FF_FILEWATCH_H) */
@@ -4,41 +4,187 @@
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
-#include <sys/epoll.h>
 #include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <glib.h>
 
 #include "common.h"
 #include "torclient.h"
 #include "rotatefd.h"
 #include "sched.h"
 #include "v3bw.h"
+#include "filewatch.h"
+#include "converge.h"
+#include "evloop.h"
+#include "replay.h"
+#include "sim.h"
+#include "status.h"
+#include "trace.h"
+#include "flashflow.h"
+#include "results.h"
 
 #define MAX_LOOPS_WITHOUT_PROGRESS 10
-#define EPOLL_TIMEOUT 3*1000
-#define EPOLL_MAX_EVENTS MAX_NUM_CTRL_SOCKS
-#define measurement_failed(m_id, m_ids, num_m, metas, num_metas) \
-    measurement_failed_((m_id), (m_ids), (num_m), (metas), (num_metas), __func__, __FILE__, __LINE__)
+// How many measurers that fail while setting up a measurement we will replace
+// before giving up on the measurement
+#define MAX_SUBSTITUTES 3
+#define EV_TIMEOUT 3*1000
+#define EV_MAX_READY MAX_NUM_CTRL_SOCKS
+#define FW_IDX_FP 0
+#define FW_IDX_CLIENT 1
+#define measurement_failed(ctx, m_id, reason) \
+    measurement_failed_((ctx), (m_id), (reason), __func__, __FILE__, __LINE__)
+
+struct running_msm {
+    // from sched_next_many(), so we don't have to go back to the sched for
+    // the measurement's params every loop
+    struct SchedMsm *desc;
+    unsigned num_substitutes;
+    struct timeval started;
+    // how far along its least far along measurer is, worked out while
+    // writing a status snapshot
+    enum csm_state phase;
+};
+
+/* Everything one coordinator needs from one time around its main loop to the
+ * next */
+struct ff_ctx {
+    char *fp_fname;
+    char *client_fname;
+    char *msm_out_fname;
+    char *v3bw_out_fname;
+    int count_success, count_failure, count_total;
+    // measurers replaced by substitute_meta() this round
+    unsigned count_substitutes;
+    // failed measurements the sched will retry, this round
+    unsigned count_retries;
+    // measurements whose measurers were all told to start this round, and how
+    // far apart that was
+    unsigned count_started;
+    long sum_skew_us, max_skew_us;
+    // sched_num() when the current round started. Measurements are added to
+    // the schedule as it's loaded, so count_total isn't known until the end.
+    size_t round_first_num;
+    // sched_num_complete() when the current round started
+    size_t round_first_complete;
+    struct ctrl_sock_meta *metas;
+    // number of tor clients read from file
+    int num_tor_clients;
+    unsigned *known_m_ids;
+    int num_known_m_ids;
+    // measurements that finished this loop, to tell the sched about all at
+    // once at the end of it
+    unsigned *done_m_ids;
+    int num_done_m_ids;
+    // m_id -> struct running_msm, for each measurement we are running
+    GHashTable *running_msms;
+    struct evloop *ev;
+    int *ready_fds;
+    int *authing_fds;
+    int *connecting_fds;
+    int *setting_bw_fds;
+    int *measuring_fds;
+    unsigned loops_without_progress;
+    // waited in ev_wait() without any progress since loops_without_progress
+    // last went up
+    int waited_ms;
+    int round_done;
+    struct file_watch *fw;
+    struct rotate_fd *out_rfd;
+    // whether each measurer's results are written to out_rfd, or only the
+    // per second totals of them
+    int out_samples;
+    // rotate out_rfd once it gets this big or old, unless 0
+    unsigned long out_max_bytes;
+    unsigned out_max_secs;
+    // where results go: out_rfd, then whatever the user of ctx added
+    struct res_bus *results;
+    SchedCtx *sched;
+    struct cv_ctx *cv;
+    // answers status queries, if asked to
+    struct st_server *st;
+    // where lifecycle events are traced, if asked to
+    struct tr_buf *tr;
+};
+
+void
+free_running_msm(struct running_msm *r) {
+    free(r->desc);
+    free(r);
+}
 
 void
 usage() {
     const char *s = \
-    "arguments: <fingerprint_file> <client_file> <msm_out_file> <v3bw_out_file>\n"
+    "arguments: [-s] [-j <journal_file>] [-c <capacity_file>] [-q <status_socket>] [-T <trace_file>] [-r <MB>] [-i <secs>] <fingerprint_file> <client_file> <msm_out_file> <v3bw_out_file>\n"
+    "       or: sched-convert <in_file> <out_file.bin>\n"
+    "       or: replay <msm_in_file> <fingerprint_file> <msm_out_file> <v3bw_out_file> [speed]\n"
+    "       or: sim [options] <fingerprint_file> <client_file>\n"
+    "       or: v3bw-merge [-p newest|decay] [-H secs] <v3bw_out_file> <msm_in_file>...\n"
+    "       or: trace2json <trace_file> <json_file>\n"
     "\n"
-    "fingerprint_file    place from which to read fingerprints to measure, one per line\n"
+    "fingerprint_file    place from which to read fingerprints to measure, one per line.\n"
+    "                    A .json schedule from the planner, or a .bin file made with\n"
+    "                    sched-convert, may be given instead\n"
     "client_file         place from which to read tor client info, one per line, 'class host port ctrl_port_pw'\n"
     "msm_out_file        place to which to write measurement results.\n"
-    "v3bw_out_fname      place to which to write v3bw file.\n";
+    "v3bw_out_fname      place to which to write v3bw file.\n"
+    "-s                  write only each measurement's total bw per second and its\n"
+    "                    result to msm_out_file, not every tor client's results.\n"
+    "-j journal_file     save progress to journal_file. If restarted with the same\n"
+    "                    one, finished measurements aren't run again and results\n"
+    "                    keep going to the same msm_out_file.\n"
+    "-c capacity_file    remember each relay's result in capacity_file, and give\n"
+    "                    its later measurements only as much of the schedule's\n"
+    "                    measurers as that calls for.\n"
+    "-q status_socket    answer connections to the Unix socket status_socket with\n"
+    "                    a JSON snapshot of what is going on.\n"
+    "-T trace_file       record when each measurement and tor client changes state,\n"
+    "                    and each wait for tor clients, to trace_file.\n"
+    "-r MB, -i secs      rotate msm_out_file while writing it once it has this many\n"
+    "                    MB in it, or every this many seconds. Finished parts are\n"
+    "                    gzipped in the background.\n"
+    "\n"
+    "fingerprint_file and client_file are watched for changes. New measurements\n"
+    "and tor clients are added to the running schedule without restarting. Once\n"
+    "all measurements are done, results are written and we wait for more.\n"
+    "\n"
+    "replay feeds the results in msm_in_file, from the schedule in fingerprint_file,\n"
+    "back through result handling and v3bw generation without any tor clients.\n"
+    "speed 1 replays them as fast as they were recorded, 2 twice as fast, etc. The\n"
+    "default, 0, replays them as fast as possible.\n"
+    "\n"
+    "sim predicts how long the schedule in fingerprint_file will take with the tor\n"
+    "clients in client_file, without running it. 'sim -h' lists its options.\n"
+    "\n"
+    "v3bw-merge writes one v3bw file from the results of several runs, each\n"
+    "msm_in_file along with the parts it was rotated into. With -p newest (the\n"
+    "default) each relay gets its newest result, with -p decay an average of its\n"
+    "results that counts each half as much for every -H secs (default 86400) it\n"
+    "is older than the newest.\n"
+    "\n"
+    "trace2json turns a trace_file from -T into JSON that Perfetto and\n"
+    "chrome://tracing can show.\n";
     LOG("%s", s);
 }
 
 
 int
-fill_msm_params(struct msm_params *p, const unsigned m_id) {
+fill_msm_params(struct ff_ctx *ctx, struct msm_params *p, const unsigned m_id) {
+    const struct running_msm *r = g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(m_id));
+    if (!r) {
+        LOG("Not running measurement id=%u\n", m_id);
+        return 0;
+    }
+    const struct SchedMsm *d = r->desc;
     p->id = m_id;
-    p->fp = sched_get_fp(p->id);
-    p->dur = sched_get_dur(p->id);
-    p->failsafe_stop = sched_get_failsafe_stop(p->id);
-    p->num_m = sched_get_hosts(p->id, &p->m, &p->m_bw, &p->m_nconn);
+    p->fp = d->fp;
+    p->dur = d->dur;
+    p->failsafe_stop = d->failsafe_stop;
+    p->num_m = d->num_hosts;
+    p->m = d->classes;
+    p->m_bw = d->bws;
+    p->m_nconn = d->conns;
     p->m_assigned = calloc(p->num_m, sizeof(int8_t));
     if (!p->fp) {
         LOG("Should have gotten a relay fp\n");
@@ -59,16 +205,30 @@ free_msm_params(struct msm_params *p) {
     if (!p) {
         return;
     }
-    sched_free_hosts(p->m, p->m_bw, p->m_nconn, p->num_m);
+    // everything else belongs to the measurement's struct running_msm
     free(p->m_assigned);
 }
 
+/**
+ * The measurement is about to actually start measuring. Give it its full
+ * failsafe stop time from now.
+ */
+void
+reset_failsafe_stop(struct ff_ctx *ctx, unsigned m_id) {
+    struct running_msm *r = g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(m_id));
+    r->desc->failsafe_stop = sched_reset_failsafe_stop(m_id);
+}
+
 int
-find_and_connect_metas(unsigned m_id, struct ctrl_sock_meta metas[], const int num_metas) {
+find_and_connect_metas(struct ff_ctx *ctx, unsigned m_id) {
+    struct ctrl_sock_meta *metas = ctx->metas;
+    const int num_metas = ctx->num_tor_clients;
     struct msm_params p;
-    if (!fill_msm_params(&p, m_id)) {
+    if (!fill_msm_params(ctx, &p, m_id)) {
         return 0;
     }
+    // measurers this measurement failed with before, if it's a retry
+    const struct SchedMsm *d = ((struct running_msm *)g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(m_id)))->desc;
     LOG("About to look for hosts with the following classes. Will eventually tell them the bw and nconn.\n")
     for (int i = 0; i < p.num_m; i++) {
         LOG("class=%s bw=%u nconn=%u\n", p.m[i], p.m_bw[i], p.m_nconn[i]);
@@ -76,8 +236,8 @@ find_and_connect_metas(unsigned m_id, struct ctrl_sock_meta metas[], const int n
     int next_meta;
     for (int i = 0; i < p.num_m; i++) {
         const char *class = p.m[i];
-        if ((next_meta = tc_next_available(num_metas, metas, class)) < 0) {
-            LOG("Unable to find available meta with class %s\n", class);
+        if ((next_meta = tc_next_available(num_metas, metas, class, m_id, p.m_bw[i], d->avoid, d->num_avoid)) < 0) {
+            LOG("Unable to find available meta with class %s and %u bw to spare\n", class, p.m_bw[i]);
             return 0;
         }
         metas[next_meta].current_m_id = m_id;
@@ -85,19 +245,118 @@ find_and_connect_metas(unsigned m_id, struct ctrl_sock_meta metas[], const int n
     return 1;
 }
 
+/**
+ * The given measurer failed while setting up its measurement. Replace it with
+ * an idle measurer of the same class, which is connected to and sent auth.
+ * The substitute catches up with the rest of the measurement's measurers in
+ * catch_up_substitutes(). Returns false if the measurement has had too many
+ * substitutes already or there are none to be had, in which case the caller
+ * should fail the measurement. Either way the given measurer is finished with.
+ *
+ * This closes the failed measurer's fd, so if you were in the middle of
+ * checking fds, go back to the start of the main loop.
+ */
 int
-send_auth_metas(unsigned m_id, struct ctrl_sock_meta metas[], const int num_metas) {
-    for (int i = 0; i < num_metas; i++) {
-        if (metas[i].current_m_id != m_id)
+substitute_meta(struct ff_ctx *ctx, struct ctrl_sock_meta *meta) {
+    struct ctrl_sock_meta *metas = ctx->metas;
+    const int num_metas = ctx->num_tor_clients;
+    const unsigned m_id = meta->current_m_id;
+    struct running_msm *r = g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(m_id));
+    // Measurers we try that can't even be sent auth. They keep m_id until
+    // we're done so tc_next_available() doesn't give them to us again.
+    int tried[MAX_SUBSTITUTES];
+    int num_tried = 0;
+    int sub = -1;
+    LOG("%s failed while setting up measurement id=%u\n", desc_meta(meta), m_id);
+    while (r->num_substitutes < MAX_SUBSTITUTES) {
+        if ((sub = tc_next_available(num_metas, metas, meta->class, m_id, meta->bw, r->desc->avoid, r->desc->num_avoid)) < 0) {
+            LOG("No idle %s measurer to replace it with\n", meta->class);
+            break;
+        }
+        r->num_substitutes++;
+        metas[sub].current_m_id = m_id;
+        if (tc_auth_socket(&metas[sub])) {
+            LOG("Replaced it with %s\n", desc_meta(&metas[sub]));
+            ctx->count_substitutes++;
+            break;
+        }
+        LOG("Unable to send auth to substitute %s\n", desc_meta(&metas[sub]));
+        tried[num_tried++] = sub;
+        sub = -1;
+    }
+    if (sub < 0 && r->num_substitutes >= MAX_SUBSTITUTES) {
+        LOG("Measurement id=%u has already had %d substitutes\n", m_id, MAX_SUBSTITUTES);
+    }
+    for (int i = 0; i < num_tried; i++) {
+        tc_mark_failed(&metas[tried[i]]);
+        tc_finished_with_meta(&metas[tried[i]]);
+    }
+    tc_mark_failed(meta);
+    tc_finished_with_meta(meta);
+    return sub >= 0;
+}
+
+int
+send_auth_metas(struct ff_ctx *ctx, unsigned m_id) {
+    struct ctrl_sock_meta *metas = ctx->metas;
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        if (metas[i].current_m_id != m_id || metas[i].state != csm_st_connected)
             continue;
-        tc_assert_state(&metas[i], csm_st_connected);
-        if (!tc_auth_socket(&metas[i])) {
+        if (!tc_auth_socket(&metas[i]) && !substitute_meta(ctx, &metas[i])) {
             return 0;
         }
     }
     return 1;
 }
 
+/**
+ * Find the first of the measurement's hosts with the given class. A
+ * substitute takes the bw and conns of that host. Measurers of the same class
+ * in a measurement almost always have the same bw and conns, and
+ * which measurer gets which host isn't remembered from one step to the next
+ * anyway.
+ */
+int
+host_of_class(const struct msm_params *p, const char *class) {
+    for (int k = 0; k < p->num_m; k++)
+        if (!strcmp(p->m[k], class))
+            return k;
+    return -1;
+}
+
+/**
+ * Move substitutes that are behind the rest of the measurement's measurers
+ * along to the step the rest are on, so the measurement can get past it.
+ * Returns false if a substitute failed and couldn't itself be replaced, in
+ * which case the caller should fail the measurement.
+ */
+int
+catch_up_substitutes(struct ff_ctx *ctx, const struct msm_params *p) {
+    struct ctrl_sock_meta *metas = ctx->metas;
+    const int num_metas = ctx->num_tor_clients;
+    enum csm_state furthest = csm_st_invalid;
+    for (int i = 0; i < num_metas; i++)
+        if (metas[i].current_m_id == p->id && metas[i].state > furthest)
+            furthest = metas[i].state;
+    for (int i = 0; i < num_metas; i++) {
+        struct ctrl_sock_meta *meta = &metas[i];
+        if (meta->current_m_id != p->id)
+            continue;
+        const int k = host_of_class(p, meta->class);
+        assert(k >= 0);
+        if (meta->state == csm_st_authed && furthest >= csm_st_told_connect_target) {
+            LOG("Catching up substitute %s: telling it to connect to target\n", desc_meta(meta));
+            if (!tc_tell_connect(meta, p->fp, p->m_nconn[k]) && !substitute_meta(ctx, meta))
+                return 0;
+        } else if (meta->state == csm_st_connected_target && furthest >= csm_st_setting_bw) {
+            LOG("Catching up substitute %s: telling it to set its bw\n", desc_meta(meta));
+            if (!tc_set_bw_rate(meta, p->m_bw[k]) && !substitute_meta(ctx, meta))
+                return 0;
+        }
+    }
+    return 1;
+}
+
 /** 
  * Returns def if all items in array are less than def, else the max of array
  */
@@ -185,31 +444,60 @@ is_totally_done(unsigned m_id, const struct ctrl_sock_meta metas[], const int nu
 }
 
 /**
- * A measurement failed. Give its id. Tell the sched that the measurement is
- * done. This will remove it from the given m_ids array. Set all the metas with
- * the given m_id as failed and mark them as finished. Returns the new number
- * of m_ids (note if it was 1, then now it's 0, which invalidates the m_id in
- * the m_ids array without replacing it).
+ * A measurement failed. Give its id. Tell the sched why, which may retry it.
+ * This will remove it from ctx's known_m_ids, moving the last one into its
+ * place (so if it was the last one, that index is no longer valid). Set all
+ * the metas with the given m_id as failed and mark them as finished, except
+ * those that were stopped early, which are still busy until their TESTSPEED
+ * is over.
  *
  * This will close fds for the metas that were a part of this experiment, so if
  * you were in the middle of checking fds, you will want to go back to the
- * start of the main loop and let epoll_wait() tell you again what fds are reading.
+ * start of the main loop and let ev_wait() tell you again what fds are reading.
  */
-int
+void
 measurement_failed_(
-        unsigned m_id,
-        unsigned m_ids[], int num_m,
-        struct ctrl_sock_meta metas[], const int num_metas,
+        struct ff_ctx *ctx, unsigned m_id, const unsigned reason,
         const char *func, const char *file, const int line) {
+    struct ctrl_sock_meta *metas = ctx->metas;
+    const int num_metas = ctx->num_tor_clients;
+    unsigned *m_ids = ctx->known_m_ids;
+    int num_m = ctx->num_known_m_ids;
     LOG("FAILED measurement id=%u at %s@%s:%d. Cleaning up.\n", m_id, func, file, line);
+    // "host:port" of each measurer, so a retry can avoid them
+    char **addrs = calloc(num_metas, sizeof(char *));
+    size_t num_addrs = 0;
     // cleanup all tor client metas that were a part of thie measurement
     for (int i = 0; i < num_metas; i++) {
-        if (metas[i].current_m_id == m_id) {
-            tc_mark_failed(&metas[i]);
-            tc_finished_with_meta(&metas[i]);
+        if (metas[i].current_m_id != m_id)
+            continue;
+        if (metas[i].stopping) {
+            metas[i].current_m_id = 0;
+            continue;
         }
+        addrs[num_addrs++] = g_strdup_printf("%s:%s", metas[i].host, metas[i].port);
+        tc_mark_failed(&metas[i]);
+        tc_finished_with_meta(&metas[i]);
+    }
+    tr_event(tr_msm_phase, 0, m_id, tr_ph_failed, 0, 0);
+    struct running_msm *r = g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(m_id));
+    struct res_event ev;
+    if (sched_mark_failed(m_id, reason, (const char *const *)addrs, num_addrs)) {
+        LOG("Will retry measurement id=%u\n", m_id);
+        // so v3bw generation throws away the results of this attempt
+        res_event_init(&ev, res_retry, m_id, r->desc->fp, "coord");
+        ev.n = r->desc->attempt + 1;
+        ctx->count_retries++;
+    } else {
+        res_event_init(&ev, res_done, m_id, r->desc->fp, "coord");
+        ev.ok = 0;
     }
-    sched_mark_done(m_id);
+    res_emit(ctx->results, &ev);
+    for (size_t i = 0; i < num_addrs; i++)
+        g_free(addrs[i]);
+    free(addrs);
+    g_hash_table_remove(ctx->running_msms, GUINT_TO_POINTER(m_id));
+    cv_forget(m_id);
     assert(num_m >= 0);
     // replace the given measurement id with whatever is the last one in the
     // list of all measurement ids
@@ -220,7 +508,33 @@ measurement_failed_(
             break;
         }
     }
-    return num_m;
+    ctx->num_known_m_ids = num_m;
+    ctx->count_failure++;
+}
+
+/**
+ * The given measurement's result has settled before its duration is up. Note
+ * that in the results so v3bw generation knows it has fewer seconds of data on
+ * purpose, then stop all of its measurers. The measurement is finished with
+ * like normal once they are all done, but its measurers' tor clients keep
+ * measuring until the duration is up, so they stay in use until then, or
+ * until the measurement's failsafe_stop if they don't say when that is.
+ */
+void
+stop_converged_measurement(
+        unsigned m_id, const char *fp, const uint64_t failsafe_stop,
+        struct ctrl_sock_meta metas[], const int num_metas,
+        const struct res_bus *results) {
+    struct res_event ev;
+    LOG("Measurement id=%u has converged. Stopping it early.\n", m_id);
+    res_event_init(&ev, res_converged, m_id, fp, "coord");
+    ev.n = cv_num_secs(m_id);
+    res_emit(results, &ev);
+    for (int i = 0; i < num_metas; i++) {
+        if (metas[i].current_m_id == m_id && metas[i].state == csm_st_measuring) {
+            tc_stop_measurement(&metas[i], failsafe_stop);
+        }
+    }
 }
 
 int
@@ -233,381 +547,982 @@ array_contains(int *arr, size_t arr_len, int val) {
     return 0;
 }
 
-void
-epoll_add_all(int epfd, int *arr, size_t arr_len) {
-    struct epoll_event epoll_tmp_ev;
-    epoll_tmp_ev.events = EPOLLIN;
-    for (int i = 0; i < arr_len; i++) {
-        epoll_tmp_ev.data.fd = arr[i];
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, arr[i], &epoll_tmp_ev)) {
-            LOG("Error teslling epoll to add %d: %s\n", arr[i], strerror(errno));
+/**
+ * A coordinator for the given files that is ready to go around its main loop
+ * with ff_ctx_run_once(). It has a schedule, measurers, event loop, and
+ * outputs all its own, so any number of them may run in one process. Returns
+ * NULL on error.
+ */
+struct ff_ctx *
+ff_ctx_new(
+        const char *fp_fname, const char *client_fname,
+        const char *msm_out_fname, const char *v3bw_out_fname) {
+    struct ff_ctx *ctx = calloc(1, sizeof(struct ff_ctx));
+    ctx->fp_fname = strdup(fp_fname);
+    ctx->client_fname = strdup(client_fname);
+    ctx->msm_out_fname = strdup(msm_out_fname);
+    ctx->v3bw_out_fname = strdup(v3bw_out_fname);
+    ctx->metas = calloc(MAX_NUM_CTRL_SOCKS, sizeof(struct ctrl_sock_meta));
+    ctx->known_m_ids = calloc(MAX_NUM_CTRL_SOCKS, sizeof(unsigned));
+    ctx->done_m_ids = calloc(MAX_NUM_CTRL_SOCKS, sizeof(unsigned));
+    ctx->ready_fds = calloc(EV_MAX_READY, sizeof(int));
+    ctx->authing_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
+    ctx->connecting_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
+    ctx->setting_bw_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
+    ctx->measuring_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
+    ctx->running_msms = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_running_msm);
+    ctx->sched = sched_ctx_new();
+    ctx->cv = cv_ctx_new();
+    sched_ctx_use(ctx->sched);
+    cv_ctx_use(ctx->cv);
+    LOG("Reading clients from %s\n", client_fname);
+    if ((ctx->num_tor_clients = tc_client_file_read(client_fname, ctx->metas)) < 1) {
+        LOG("Error reading %s or it was empty\n", client_fname);
+        ctx->num_tor_clients = 0;
+        ff_ctx_free(ctx);
+        return NULL;
+    }
+    LOG("We know about the following Tor clients. They may not exist, haven't checked.\n");
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        LOG("%s at %s:%s\n", ctx->metas[i].class, ctx->metas[i].host, ctx->metas[i].port);
+    }
+    LOG("Reading experiments from %s\n", fp_fname);
+    if (!sched_new(fp_fname)) {
+        LOG("Empty sched from %s or error\n", fp_fname);
+        ff_ctx_free(ctx);
+        return NULL;
+    }
+    // out_rfd is opened the first time around the main loop, once we know
+    // whether we are resuming from a journal
+    ctx->results = res_bus_new();
+    ctx->out_samples = 1;
+    res_bus_add_file(ctx->results, &ctx->out_rfd, &ctx->out_samples);
+    if (!(ctx->fw = fw_new()) ||
+            fw_add(ctx->fw, fp_fname) != FW_IDX_FP ||
+            fw_add(ctx->fw, client_fname) != FW_IDX_CLIENT) {
+        LOG("Unable to watch %s and %s for changes\n", fp_fname, client_fname);
+        ff_ctx_free(ctx);
+        return NULL;
+    }
+    if (!(ctx->ev = ev_new()) || ev_watch(ctx->ev, fw_fd(ctx->fw)) < 0) {
+        LOG("Unable to set up event loop\n");
+        ff_ctx_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Start writing results to a new msm_out file. If resuming, go back to the
+ * one the journal says we were writing to instead, throwing away the results
+ * of measurements that were interrupted so they can be run again.
+ */
+static void
+open_output(struct ff_ctx *ctx, const int resume) {
+    char prev[PATH_MAX];
+    if (resume && sched_journal_output(prev, sizeof(prev)) &&
+            (ctx->out_rfd = rfd_reopen(ctx->msm_out_fname, prev))) {
+        LOG("Resuming output to %s\n", ctx->out_rfd->fname);
+        char fp[RES_FP_LEN + 1];
+        unsigned m_id, attempt;
+        while ((m_id = sched_journal_pop_interrupted(fp, &attempt))) {
+            LOG("Measurement id=%u was interrupted and will be run again\n", m_id);
+            struct res_event ev;
+            res_event_init(&ev, res_retry, m_id, fp, "coord");
+            ev.n = attempt;
+            res_emit(ctx->results, &ev);
+            // the journal forgets it was interrupted once we've had them all
+            fflush(ctx->out_rfd->fd);
         }
+    } else {
+        ctx->out_rfd = rfd_open(ctx->msm_out_fname);
+        LOG("Will output results to %s\n", ctx->out_rfd->fname);
     }
+    rfd_set_rotation(ctx->out_rfd, ctx->out_max_bytes, ctx->out_max_secs);
+    sched_journal_set_output(ctx->out_rfd->fname);
 }
 
+/**
+ * Rotate ctx's msm_out file while it is being written once it has max_bytes
+ * in it or has been written to for max_secs, whichever comes first (0 for no
+ * limit). Finished parts are compressed in the background, and the v3bw file
+ * is made from all of them.
+ */
 void
-epoll_delete_all(int epfd, int *arr, size_t arr_len) {
-    for (int i = 0; i < arr_len; i++)
-        if (epoll_ctl(epfd, EPOLL_CTL_DEL, arr[i], NULL))
-            LOG("Error telling epoll to delete %d: %s\n", arr[i], strerror(errno));
+ff_ctx_set_rotation(struct ff_ctx *ctx, const unsigned long max_bytes, const unsigned max_secs) {
+    ctx->out_max_bytes = max_bytes;
+    ctx->out_max_secs = max_secs;
+    if (ctx->out_rfd)
+        rfd_set_rotation(ctx->out_rfd, max_bytes, max_secs);
 }
 
+/**
+ * Save ctx's progress to the journal in fname, so that if it is restarted
+ * with the same journal, measurements that finished aren't run again. Results
+ * keep going to the msm_out file it was writing to. Call before the first
+ * ff_ctx_run_once(). Returns 0, or -1 if the journal can't be opened.
+ */
 int
-main_loop_once(int argc, const char *argv[]) {
-    int count_success = 0, count_failure = 0, count_total = 0;
-    struct ctrl_sock_meta *metas = calloc(MAX_NUM_CTRL_SOCKS, sizeof(struct ctrl_sock_meta));
-    unsigned *known_m_ids = calloc(MAX_NUM_CTRL_SOCKS, sizeof(unsigned));
-    int num_known_m_ids = 0;
-    int epoll_fd = epoll_create1(0);
-    struct epoll_event *epoll_out_events = calloc(MAX_NUM_CTRL_SOCKS, sizeof(struct epoll_event));
-    int *authing_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
-    int *connecting_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
-    int *setting_bw_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
-    int *measuring_fds = calloc(MAX_NUM_CTRL_SOCKS, sizeof(int));
-    unsigned loops_without_progress = 0;
-    if (argc != 5) {
-        //LOG("argc=%d\n", argc);
-        usage();
+ff_ctx_set_journal(struct ff_ctx *ctx, const char *fname) {
+    sched_ctx_use(ctx->sched);
+    return sched_journal_open(fname) ? 0 : -1;
+}
+
+/**
+ * Keep each relay's last result in the capacity cache in fname, and give
+ * measurements of relays in it only as many of their measurers, with as much
+ * bw, as they need instead of all the schedule gives them. The cache is saved
+ * at the end of each round. Returns 0, or -1 if it can't be read.
+ */
+int
+ff_ctx_set_capacity(struct ff_ctx *ctx, const char *fname) {
+    sched_ctx_use(ctx->sched);
+    return sched_capacity_open(fname) ? 0 : -1;
+}
+
+static const char *
+phase_name(const enum csm_state state) {
+    switch (state) {
+        case csm_st_invalid:
+            return "starting";
+        case csm_st_connected:
+        case csm_st_authing:
+        case csm_st_authed:
+            return "authing";
+        case csm_st_told_connect_target:
+        case csm_st_connected_target:
+            return "connecting";
+        case csm_st_setting_bw:
+        case csm_st_bw_set:
+            return "setting_bw";
+        case csm_st_measuring:
+            return "measuring";
+        default:
+            return "done";
+    }
+}
+
+/* Write ctx's part of a status snapshot. The counts come from the sched, which
+ * keeps them as it goes. The rest is one pass over the measurers and one over
+ * the running measurements. */
+static void
+write_status(FILE *f, void *arg) {
+    struct ff_ctx *ctx = arg;
+    GHashTableIter iter;
+    gpointer k, v;
+    struct timeval now;
+    assert(gettimeofday(&now, NULL) == 0);
+    const size_t num = sched_num(), complete = sched_num_complete(), failed = sched_num_failed();
+    const size_t running = g_hash_table_size(ctx->running_msms);
+    const size_t waiting = num > complete + failed + running ? num - complete - failed - running : 0;
+    fprintf(f, "\"time\":%ld,\"round_done\":%d,", now.tv_sec, ctx->round_done);
+    fprintf(f, "\"sched\":{\"total\":%lu,\"waiting\":%lu,\"in_progress\":%lu,"
+        "\"complete\":%lu,\"failed\":%lu},", num, waiting, running, complete, failed);
+    fprintf(f, "\"round\":{\"success\":%d,\"failed_attempts\":%d,\"retries\":%u,"
+        "\"substitutes\":%u,\"started\":%u,\"start_skew_us_avg\":%ld,\"start_skew_us_max\":%ld},",
+        ctx->count_success, ctx->count_failure, ctx->count_retries, ctx->count_substitutes,
+        ctx->count_started, ctx->count_started ? ctx->sum_skew_us / ctx->count_started : 0,
+        ctx->max_skew_us);
+    g_hash_table_iter_init(&iter, ctx->running_msms);
+    while (g_hash_table_iter_next(&iter, &k, &v))
+        ((struct running_msm *)v)->phase = csm_st_invalid;
+    // each class's measurer slots, and how many of them are in a measurement
+    const char **classes = calloc(ctx->num_tor_clients + 1, sizeof(char *));
+    unsigned *slots = calloc(ctx->num_tor_clients + 1, sizeof(unsigned));
+    unsigned *busy = calloc(ctx->num_tor_clients + 1, sizeof(unsigned));
+    int num_classes = 0;
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        const struct ctrl_sock_meta *meta = &ctx->metas[i];
+        int c = 0;
+        while (c < num_classes && strcmp(classes[c], meta->class))
+            c++;
+        if (c == num_classes)
+            classes[num_classes++] = meta->class;
+        slots[c]++;
+        if (meta->current_m_id || meta->stopping)
+            busy[c]++;
+        if (!meta->current_m_id)
+            continue;
+        struct running_msm *r = g_hash_table_lookup(ctx->running_msms, GUINT_TO_POINTER(meta->current_m_id));
+        if (r && (r->phase == csm_st_invalid || meta->state < r->phase))
+            r->phase = meta->state;
+    }
+    fputs("\"measurers\":{", f);
+    for (int c = 0; c < num_classes; c++) {
+        fputs(c ? "," : "", f);
+        st_json_str(f, classes[c]);
+        fprintf(f, ":{\"slots\":%u,\"busy\":%u}", slots[c], busy[c]);
+    }
+    free(classes);
+    free(slots);
+    free(busy);
+    fputs("},\"in_flight\":[", f);
+    int first = 1;
+    g_hash_table_iter_init(&iter, ctx->running_msms);
+    while (g_hash_table_iter_next(&iter, &k, &v)) {
+        const unsigned m_id = GPOINTER_TO_UINT(k);
+        const struct running_msm *r = v;
+        const double elapsed = (now.tv_sec - r->started.tv_sec) + (now.tv_usec - r->started.tv_usec) / 1e6;
+        fprintf(f, "%s{\"id\":%u,\"fp\":\"%s\",\"attempt\":%u,\"phase\":\"%s\","
+            "\"elapsed\":%.1f,\"dur\":%u,\"secs\":%u,\"measurers\":%lu}",
+            first ? "" : ",", m_id, r->desc->fp, r->desc->attempt + 1, phase_name(r->phase),
+            elapsed, r->desc->dur, cv_num_secs(m_id), r->desc->num_hosts);
+        first = 0;
+    }
+    fputs("]", f);
+}
+
+/**
+ * Answer anyone who connects to a Unix socket at path with a snapshot of what
+ * ctx is doing, as JSON: counts of measurements by state, each running
+ * measurement's phase and how long it has been going, how busy each class of
+ * measurer is, and recent throughput. Served from ctx's own loop without
+ * blocking it. Returns 0, or -1 if the socket can't be made.
+ */
+int
+ff_ctx_set_status(struct ff_ctx *ctx, const char *path) {
+    if (ctx->st || !(ctx->st = st_new(path)))
+        return -1;
+    if (ev_watch(ctx->ev, st_fd(ctx->st)) < 0) {
+        LOG("Unable to watch status socket %s\n", path);
+        st_free(ctx->st);
+        ctx->st = NULL;
         return -1;
     }
-    const char *fp_fname = argv[1];
-    const char *client_fname = argv[2];
-    const char *msm_out_fname = argv[3];
-    const char *v3bw_out_fname = argv[4];
-    // number of tor clients read from file
-    int num_tor_clients;
-    LOG("Reading clients from %s\n", client_fname);
-    if ((num_tor_clients = tc_client_file_read(client_fname, metas)) < 1) {
-        LOG("Error reading %s or it was empty\n", client_fname);
+    st_watch_results(ctx->st, ctx->results);
+    LOG("Answering status queries on %s\n", path);
+    return 0;
+}
+
+/**
+ * Record a timestamped event to fname every time one of ctx's measurements
+ * moves on to its next phase, one of its measurers changes state, and it
+ * stops waiting for its measurers, for finding where the time between them
+ * goes. Events are buffered and written in blocks. Convert the file with
+ * trace2json. Returns 0, or -1 if fname can't be written.
+ */
+int
+ff_ctx_set_trace(struct ff_ctx *ctx, const char *fname) {
+    if (ctx->tr || !(ctx->tr = tr_new(fname)))
         return -1;
+    LOG("Tracing to %s\n", fname);
+    return 0;
+}
+
+/**
+ * Go around ctx's main loop once: pick up changes to its files, start at most
+ * one new measurement, move running ones along, and handle whatever its
+ * measurers have sent, waiting at most max_wait_ms for them to send
+ * something (no limit if negative). Returns 0, or -1 if something has gone
+ * so wrong that ctx can't go on.
+ */
+int
+ff_ctx_run_once(struct ff_ctx *ctx, const int max_wait_ms) {
+    int num_authing_fds = 0;
+    int num_connecting_fds = 0;
+    int num_setting_bw_fds = 0;
+    int num_measuring_fds = 0;
+    sched_ctx_use(ctx->sched);
+    cv_ctx_use(ctx->cv);
+    tc_set_evloop(ctx->ev);
+    tr_use(ctx->tr);
+    if (!ctx->out_rfd && !ctx->round_done)
+        open_output(ctx, 1);
+    if (ctx->st)
+        st_serve(ctx->st, write_status, ctx);
+    // Pick up changes to the client and fingerprint files. New tor
+    // clients are added first so new measurements can use them.
+    const unsigned changed = fw_read_changes(ctx->fw);
+    if (changed & (1u << FW_IDX_CLIENT)) {
+        int n = tc_client_file_merge(ctx->client_fname, ctx->metas, ctx->num_tor_clients);
+        if (n >= 0) {
+            LOG("Client file changed. Now know about %d tor clients (was %d)\n", n, ctx->num_tor_clients);
+            ctx->num_tor_clients = n;
+        }
     }
-    LOG("We know about the following Tor clients. They may not exist, haven't checked.\n");
-    for (int i = 0; i < num_tor_clients; i++) {
-        LOG("%s at %s:%s\n", metas[i].class, metas[i].host, metas[i].port);
+    if (changed & (1u << FW_IDX_FP)) {
+        size_t added = sched_merge(ctx->fp_fname);
+        LOG("Fingerprint file changed. Added %lu new measurements\n", added);
+        if (added && ctx->round_done) {
+            // Start a new round. Results go to a new output file, and the
+            // counts are for this round only.
+            open_output(ctx, 0);
+            ctx->count_success = ctx->count_failure = 0;
+            ctx->count_substitutes = ctx->count_retries = 0;
+            ctx->count_started = 0;
+            ctx->sum_skew_us = ctx->max_skew_us = 0;
+            ctx->round_first_num = sched_num() - added;
+            ctx->round_first_complete = sched_num_complete();
+            ctx->round_done = 0;
+        }
     }
-    LOG("Reading experiments from %s\n", fp_fname);
-    if (!(count_total = sched_new(fp_fname))) {
-        LOG("Empty sched from %s or error\n", fp_fname);
-        return -1;
+    // Keep reading the schedule a chunk at a time while measurements from
+    // what we've read so far are running
+    sched_load_more();
+    if (!ctx->round_done && sched_finished()) {
+        ctx->count_total = sched_num() - ctx->round_first_num;
+        // finished before a restart, according to the journal
+        const int resumed = sched_num_complete() - ctx->round_first_complete - ctx->count_success;
+        if (resumed > 0) {
+            LOG("%d measurements succeeded before we were restarted\n", resumed);
+            ctx->count_success += resumed;
+        }
+        rfd_close(ctx->out_rfd);
+        ctx->out_rfd = NULL;
+        v3bw_generate(ctx->msm_out_fname, ctx->v3bw_out_fname);
+        sched_capacity_save();
+        LOG("ALLLLLLLL DOOOONNEEEEE\n");
+        LOG("%d success, %d failed, %d total\n", ctx->count_success, ctx->count_total - ctx->count_success, ctx->count_total);
+        LOG("%d failed attempts, %u of them retried\n", ctx->count_failure, ctx->count_retries);
+        LOG("%u failed measurers replaced with substitutes\n", ctx->count_substitutes);
+        if (ctx->count_started) {
+            LOG("Measurers were started %ldus apart on average, %ldus at most\n",
+                ctx->sum_skew_us / ctx->count_started, ctx->max_skew_us);
+        }
+        LOG("Waiting for %s or %s to change\n", ctx->fp_fname, ctx->client_fname);
+        ctx->round_done = 1;
     }
-    struct rotate_fd *out_rfd = rfd_open(msm_out_fname);
-    LOG("Will output results to %s\n", out_rfd->fname);
-    // Main loop
-    while (!sched_finished()) {
-        int num_authing_fds = 0;
-        int num_connecting_fds = 0;
-        int num_setting_bw_fds = 0;
-        int num_measuring_fds = 0;
-        // Check if we've looped too many times without doing anything, and fail
-        // all existing measurements if so
-        if (loops_without_progress > MAX_LOOPS_WITHOUT_PROGRESS) {
-            LOG("Went %u main loops without any forward progress. Failing all "
-                "existing measurements.\n", loops_without_progress);
-            while (num_known_m_ids) {
-                num_known_m_ids = measurement_failed(
-                    known_m_ids[num_known_m_ids-1], known_m_ids, num_known_m_ids,
-                    metas, num_tor_clients);
-                count_failure++;
-            }
-            loops_without_progress = 0;
+    if (ctx->round_done) {
+        // Nothing to do until one of the files we watch changes
+        ev_begin(ctx->ev);
+        ev_wait(ctx->ev, max_wait_ms, ctx->ready_fds, EV_MAX_READY);
+        return 0;
+    }
+    // Check if we've looped too many times without doing anything, and fail
+    // all existing measurements if so
+    if (ctx->loops_without_progress > MAX_LOOPS_WITHOUT_PROGRESS) {
+        LOG("Went %u main loops without any forward progress. Failing all "
+            "existing measurements.\n", ctx->loops_without_progress);
+        while (ctx->num_known_m_ids) {
+            measurement_failed(ctx, ctx->known_m_ids[ctx->num_known_m_ids-1], SCHED_FAIL_TIMEOUT);
         }
-        // Check if any measurements have gone on for too long and fail them
-        for (int i = 0; i < num_known_m_ids; i++) {
-            struct msm_params p;
-            struct timeval now;
-            assert(fill_msm_params(&p, known_m_ids[i]));
-            assert(gettimeofday(&now, NULL) == 0);
-            if (now.tv_sec > p.failsafe_stop) {
-                LOG("Measurement id=%u has gone on for too long. Failing safe and stopping it.\n", known_m_ids[i]);
-                num_known_m_ids = measurement_failed(known_m_ids[i], known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                i--;
-                count_failure++;
-            }
-            free_msm_params(&p);
-        }
-        unsigned new_m_id;
-        if ((new_m_id = sched_next()) > 0) {
-        //while ((new_m_id = sched_next())) {
-            /*
-             * This COULD be a while loop that keeps starting new measurements
-             * while sched_next() returns new msm ids. And it originally was.
-             * The logic is that we might as well get started on as many as
-             * possible as soon as possible.
-             *
-             * The problem lies in the fact that in some of our experiements we
-             * actually run a full, complex schedule that sometimes has TONS of
-             * measurements that should start at the same time ... and deep
-             * inside find_and_connect_metas() down into tc_next_avilable() we
-             * have tc_make_socket() that BLOCKS. A socket might take 100ms to
-             * build, each measurement requires at least 2 sockets (1 bg
-             * client, 1 msm client), and there could be many 10s of msms to
-             * setup. That's ~10s to setup 50 msms. That 10s is a long time to
-             * eat into the first few measurements' failsafe stop time.
-             *
-             * So in closing, we only start one measurement at a time. The next
-             * loop back around we will again check here and start another one.
-             * Thus spreading out those blocking socket creations and allowing
-             * flashflow to work through the handshaking process for earlier
-             * measurements while new ones get started.
-             */
-            // We are allowed to start a new measurement. Get the ball rolling
-            // on that by finding and connecting to the needed tor clients.
-            LOG("Starting new measurement id=%u\n", new_m_id);
-            if (!find_and_connect_metas(new_m_id, metas, num_tor_clients)) {
-                LOG("Cannot start measurement id=%u. Skipping.\n", new_m_id);
-                num_known_m_ids = measurement_failed(
-                    new_m_id, known_m_ids, num_known_m_ids,
-                    metas, num_tor_clients);
-                count_failure++;
-            } else {
-                known_m_ids[num_known_m_ids++] = new_m_id;
-                if (!send_auth_metas(new_m_id, metas, num_tor_clients)) {
-                    num_known_m_ids = measurement_failed(new_m_id, known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                    count_failure++;
-                }
+        ctx->loops_without_progress = 0;
+    }
+    // Check if any measurements have gone on for too long and fail them
+    for (int i = 0; i < ctx->num_known_m_ids; i++) {
+        struct msm_params p;
+        struct timeval now;
+        assert(fill_msm_params(ctx, &p, ctx->known_m_ids[i]));
+        assert(gettimeofday(&now, NULL) == 0);
+        if (now.tv_sec > p.failsafe_stop) {
+            LOG("Measurement id=%u has gone on for too long. Failing safe and stopping it.\n", ctx->known_m_ids[i]);
+            measurement_failed(ctx, ctx->known_m_ids[i], SCHED_FAIL_TIMEOUT);
+            i--;
+        }
+        free_msm_params(&p);
+    }
+    // Same for measurers stopped early that haven't said their TESTSPEED is
+    // over, which would otherwise keep them busy for good
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        struct timeval now;
+        if (!ctx->metas[i].stopping)
+            continue;
+        assert(gettimeofday(&now, NULL) == 0);
+        if (now.tv_sec > ctx->metas[i].stopping_failsafe) {
+            LOG("%s never finished the TESTSPEED it was stopped early from. Giving up on it.\n",
+                desc_meta(&ctx->metas[i]));
+            tc_mark_failed(&ctx->metas[i]);
+            tc_finished_with_meta(&ctx->metas[i]);
+        }
+    }
+    unsigned new_m_id;
+    struct SchedMsm *new_msm;
+    if (sched_next_many(1, &new_msm)) {
+        /*
+         * This COULD ask sched_next_many() for every measurement that is
+         * ready instead of just one. And it originally started as many as it
+         * could. The logic is that we might as well get started on as many
+         * as possible as soon as possible.
+         *
+         * The problem lies in the fact that in some of our experiements we
+         * actually run a full, complex schedule that sometimes has TONS of
+         * measurements that should start at the same time ... and deep
+         * inside find_and_connect_metas() down into tc_next_avilable() we
+         * have tc_make_socket() that BLOCKS. A socket might take 100ms to
+         * build, each measurement requires at least 2 sockets (1 bg
+         * client, 1 msm client), and there could be many 10s of msms to
+         * setup. That's ~10s to setup 50 msms. That 10s is a long time to
+         * eat into the first few measurements' failsafe stop time.
+         *
+         * So in closing, we only start one measurement at a time. The next
+         * loop back around we will again check here and start another one.
+         * Thus spreading out those blocking socket creations and allowing
+         * flashflow to work through the handshaking process for earlier
+         * measurements while new ones get started.
+         */
+        // We are allowed to start a new measurement. Get the ball rolling
+        // on that by finding and connecting to the needed tor clients.
+        new_m_id = new_msm->id;
+        struct running_msm *r = calloc(1, sizeof(struct running_msm));
+        r->desc = new_msm;
+        assert(gettimeofday(&r->started, NULL) == 0);
+        g_hash_table_insert(ctx->running_msms, GUINT_TO_POINTER(new_m_id), r);
+        tr_event(tr_msm_phase, 0, new_m_id, tr_ph_start, 0, 0);
+        LOG("Starting new measurement id=%u (attempt %u)\n", new_m_id, new_msm->attempt + 1);
+        if (!find_and_connect_metas(ctx, new_m_id)) {
+            LOG("Cannot start measurement id=%u. Skipping.\n", new_m_id);
+            measurement_failed(ctx, new_m_id, SCHED_FAIL_NO_MEASURERS);
+        } else {
+            ctx->known_m_ids[ctx->num_known_m_ids++] = new_m_id;
+            if (!send_auth_metas(ctx, new_m_id)) {
+                measurement_failed(ctx, new_m_id, SCHED_FAIL_SETUP);
             }
         }
-        // for each known measurement, do things for them if any of them need
-        // things done. (wow such shitty comment)
-        for (int i = 0; i < num_known_m_ids; i++) {
-            struct msm_params p;
-            assert(fill_msm_params(&p, known_m_ids[i]));
-            // for authed -> tell connect to target
-            if (is_totally_authed(known_m_ids[i], metas, num_tor_clients)) {
-                // loop through all known tor clients and look for ones that can
-                // help
-                for (int j = 0; j < num_tor_clients; j++) {
-                    if (metas[j].current_m_id == known_m_ids[i]) {
-                        // this tor client J is for the current measurement I.
-                        // Loop over the msm params and see if the K'th one is
-                        // unassigned and matches tor client J's class.
-                        for (int k = 0; k < p.num_m; k++) {
-                            if (!strcmp(p.m[k], metas[j].class) && !p.m_assigned[k]) {
-                                if (!tc_tell_connect(&metas[j], p.fp, p.m_nconn[k])) {
-                                    LOG("Unable to to tell %s to connect to target\n", desc_meta(&metas[j]));
-                                    num_known_m_ids = measurement_failed(
-                                        known_m_ids[i], known_m_ids, num_known_m_ids,
-                                        metas, num_tor_clients);
-                                    count_failure++;
-                                    // jump to the end of the main loop. We just
-                                    // moved the contents of known_m_ids around
-                                    // and may screw ourselves up if we were to
-                                    // continue looping here.
-                                    goto main_loop_end;
+    }
+    // for each known measurement, do things for them if any of them need
+    // things done. (wow such shitty comment)
+    for (int i = 0; i < ctx->num_known_m_ids; i++) {
+        struct msm_params p;
+        assert(fill_msm_params(ctx, &p, ctx->known_m_ids[i]));
+        if (!catch_up_substitutes(ctx, &p)) {
+            measurement_failed(ctx, ctx->known_m_ids[i], SCHED_FAIL_SETUP);
+            goto main_loop_end;
+        }
+        // for authed -> tell connect to target
+        if (is_totally_authed(ctx->known_m_ids[i], ctx->metas, ctx->num_tor_clients)) {
+            tr_event(tr_msm_phase, 0, ctx->known_m_ids[i], tr_ph_authed, 0, 0);
+            // loop through all known tor clients and look for ones that can
+            // help
+            for (int j = 0; j < ctx->num_tor_clients; j++) {
+                // substitutes that just replaced one of the others are
+                // still authing and will catch up later
+                if (ctx->metas[j].current_m_id == ctx->known_m_ids[i] && ctx->metas[j].state == csm_st_authed) {
+                    // this tor client J is for the current measurement I.
+                    // Loop over the msm params and see if the K'th one is
+                    // unassigned and matches tor client J's class.
+                    for (int k = 0; k < p.num_m; k++) {
+                        if (!strcmp(p.m[k], ctx->metas[j].class) && !p.m_assigned[k]) {
+                            if (!tc_tell_connect(&ctx->metas[j], p.fp, p.m_nconn[k])) {
+                                LOG("Unable to to tell %s to connect to target\n", desc_meta(&ctx->metas[j]));
+                                if (substitute_meta(ctx, &ctx->metas[j])) {
+                                    // it will catch up
+                                    p.m_assigned[k] = 1;
+                                    break;
                                 }
-                                tc_assert_state(&metas[j], csm_st_told_connect_target);
-                                p.m_assigned[k] = 1;
-                                break;
+                                measurement_failed(ctx, ctx->known_m_ids[i], SCHED_FAIL_SETUP);
+                                // jump to the end of the main loop. We just
+                                // moved the contents of ctx->known_m_ids around
+                                // and may screw ourselves up if we were to
+                                // continue looping here.
+                                goto main_loop_end;
                             }
+                            tc_assert_state(&ctx->metas[j], csm_st_told_connect_target);
+                            p.m_assigned[k] = 1;
+                            break;
                         }
                     }
                 }
-                for (int j = 0; j < p.num_m; j++) {
-                    assert(p.m_assigned[j]);
-                }
             }
-            // for connected to target -> set bw
-            if (is_totally_connected_target(known_m_ids[i], metas, num_tor_clients)) {
-                for (int j = 0; j < num_tor_clients; j++) {
-                    if (metas[j].current_m_id == known_m_ids[i]) {
-                        // this tor client J is for the current measurement I.
-                        // Loop over the msm params and see if the K'th one is
-                        // unassigned (hasn't been told its bw yet)
-                        for (int k = 0; k < p.num_m; k++) {
-                            if (!strcmp(p.m[k], metas[j].class) && !p.m_assigned[k]) {
-                                if (!tc_set_bw_rate(&metas[j], p.m_bw[k])) {
-                                    LOG("Unable to tell %s to set its bw rate\n", desc_meta(&metas[j]));
-                                    num_known_m_ids = measurement_failed(
-                                        known_m_ids[i], known_m_ids, num_known_m_ids,
-                                        metas, num_tor_clients);
-                                    count_failure++;
-                                    // jump to the end of the main loop. We just moved
-                                    // the contents of known_m_ids around and may screw
-                                    // ourselves up if we were to continue looping here.
-                                    goto main_loop_end;
+            for (int j = 0; j < p.num_m; j++) {
+                assert(p.m_assigned[j]);
+            }
+        }
+        // for connected to target -> set bw
+        if (is_totally_connected_target(ctx->known_m_ids[i], ctx->metas, ctx->num_tor_clients)) {
+            tr_event(tr_msm_phase, 0, ctx->known_m_ids[i], tr_ph_connected, 0, 0);
+            for (int j = 0; j < ctx->num_tor_clients; j++) {
+                if (ctx->metas[j].current_m_id == ctx->known_m_ids[i] && ctx->metas[j].state == csm_st_connected_target) {
+                    // this tor client J is for the current measurement I.
+                    // Loop over the msm params and see if the K'th one is
+                    // unassigned (hasn't been told its bw yet)
+                    for (int k = 0; k < p.num_m; k++) {
+                        if (!strcmp(p.m[k], ctx->metas[j].class) && !p.m_assigned[k]) {
+                            if (!tc_set_bw_rate(&ctx->metas[j], p.m_bw[k])) {
+                                LOG("Unable to tell %s to set its bw rate\n", desc_meta(&ctx->metas[j]));
+                                if (substitute_meta(ctx, &ctx->metas[j])) {
+                                    // it will catch up
+                                    p.m_assigned[k] = 1;
+                                    break;
                                 }
-                                tc_assert_state(&metas[j], csm_st_setting_bw);
-                                p.m_assigned[k] = 1;
-                                break;
+                                measurement_failed(ctx, ctx->known_m_ids[i], SCHED_FAIL_SETUP);
+                                // jump to the end of the main loop. We just moved
+                                // the contents of ctx->known_m_ids around and may screw
+                                // ourselves up if we were to continue looping here.
+                                goto main_loop_end;
                             }
+                            tc_assert_state(&ctx->metas[j], csm_st_setting_bw);
+                            p.m_assigned[k] = 1;
+                            break;
                         }
                     }
                 }
-                for (int j = 0; j < p.num_m; j++) {
-                    assert(p.m_assigned[j]);
-                }
             }
-            // for bw is set -> start measurement
-            if (is_totally_bw_set(known_m_ids[i], metas, num_tor_clients)) {
-                LOG("YAY ITS TIME TO START MEAUREMENT %u FINALLY\n", known_m_ids[i]);
-                sched_reset_failsafe_stop(known_m_ids[i]);
-                int num_told = 0;
-                for (int j = 0; j < num_tor_clients; j++) {
-                    if (metas[j].current_m_id == known_m_ids[i]) {
-                        if (!tc_start_measurement(&metas[j], p.dur)) {
-                            LOG("Unable to tell %s to start measuring\n", desc_meta(&metas[j]));
-                            num_known_m_ids = measurement_failed(
-                                known_m_ids[i], known_m_ids, num_known_m_ids,
-                                metas, num_tor_clients);
-                            count_failure++;
-                            // jump to the end of the main loop. We just moved
-                            // the contents of known_m_ids around and may screw
-                            // ourselves up if we were to continue looping here.
-                            goto main_loop_end;
-                        }
-                        tc_assert_state(&metas[j], csm_st_measuring);
-                        num_told++;
-                    }
+            for (int j = 0; j < p.num_m; j++) {
+                assert(p.m_assigned[j]);
+            }
+        }
+        // for bw is set -> start measurement
+        if (is_totally_bw_set(ctx->known_m_ids[i], ctx->metas, ctx->num_tor_clients)) {
+            LOG("YAY ITS TIME TO START MEAUREMENT %u FINALLY\n", ctx->known_m_ids[i]);
+            reset_failsafe_stop(ctx, ctx->known_m_ids[i]);
+            cv_start(ctx->known_m_ids[i], p.num_m);
+            // Start them all in one burst so their seconds line up
+            struct ctrl_sock_meta **starting = calloc(p.num_m, sizeof(struct ctrl_sock_meta *));
+            int num_starting = 0;
+            for (int j = 0; j < ctx->num_tor_clients; j++) {
+                if (ctx->metas[j].current_m_id == ctx->known_m_ids[i]) {
+                    assert(num_starting < p.num_m);
+                    starting[num_starting++] = &ctx->metas[j];
                 }
-                assert(num_told == p.num_m);
             }
-            // for when done measuring
-            if (is_totally_done(known_m_ids[i], metas, num_tor_clients)) {
-                LOG("WOOHOO MEASUREMENT %u IS DONE\n", known_m_ids[i]);
-                for (int j = 0; j < num_tor_clients; j++) {
-                    if (metas[j].current_m_id == known_m_ids[i]) {
-                        tc_assert_state(&metas[j], csm_st_done);
-                        tc_finished_with_meta(&metas[j]);
+            assert(num_starting == p.num_m);
+            long skew_us;
+            const int num_told = tc_start_measurements(starting, num_starting, p.dur, &skew_us);
+            free(starting);
+            if (num_told < num_starting) {
+                measurement_failed(ctx, ctx->known_m_ids[i], SCHED_FAIL_SETUP);
+                // jump to the end of the main loop. We just moved
+                // the contents of ctx->known_m_ids around and may screw
+                // ourselves up if we were to continue looping here.
+                goto main_loop_end;
+            }
+            LOG("Started measurement id=%u on %d measurers with %ldus skew\n", ctx->known_m_ids[i], num_told, skew_us);
+            ctx->count_started++;
+            ctx->sum_skew_us += skew_us;
+            if (skew_us > ctx->max_skew_us)
+                ctx->max_skew_us = skew_us;
+            struct res_event ev;
+            res_event_init(&ev, res_started, ctx->known_m_ids[i], p.fp, "coord");
+            ev.n = num_told;
+            ev.skew_us = skew_us;
+            res_emit(ctx->results, &ev);
+            tr_event(tr_msm_phase, 0, ctx->known_m_ids[i], tr_ph_measuring, 0, 0);
+        }
+        // for when done measuring
+        if (is_totally_done(ctx->known_m_ids[i], ctx->metas, ctx->num_tor_clients)) {
+            LOG("WOOHOO MEASUREMENT %u IS DONE\n", ctx->known_m_ids[i]);
+            tr_event(tr_msm_phase, 0, ctx->known_m_ids[i], tr_ph_done, 0, 0);
+            for (int j = 0; j < ctx->num_tor_clients; j++) {
+                if (ctx->metas[j].current_m_id == ctx->known_m_ids[i]) {
+                    tc_assert_state(&ctx->metas[j], csm_st_done);
+                    if (ctx->metas[j].stopping) {
+                        // no longer part of the measurement, but still busy
+                        // until its TESTSPEED is over
+                        ctx->metas[j].current_m_id = 0;
+                    } else {
+                        tc_finished_with_meta(&ctx->metas[j]);
                     }
                 }
-                sched_mark_done(known_m_ids[i]);
-                known_m_ids[i--] = known_m_ids[--num_known_m_ids];
-                count_success++;
-            }
-            free_msm_params(&p);
-        }
-        for (int i = 0; i < num_tor_clients; i++) {
-            if (metas[i].state == csm_st_authing) {
-                // Build up the list of tor client fds that we are currently waiting
-                // on auth success message from
-                LOG("Adding %s to list of fds needed auth response\n", desc_meta(&metas[i]));
-                authing_fds[num_authing_fds++] = metas[i].fd;
-            } else if (metas[i].state == csm_st_told_connect_target) {
-                // Build up the list of tor client fds that we are currently waiting on
-                // a connect-to-target success message from
-                LOG("Adding %s to list of fds needed connect-to-target response\n", desc_meta(&metas[i]));
-                connecting_fds[num_connecting_fds++] = metas[i].fd;
-            } else if (metas[i].state == csm_st_setting_bw) {
-                // Build up the list of tor client fds that we are currently waiting on
-                // for a success msg about setting bw
-                LOG("Adding %s to list of fds needed did-set-bw response\n", desc_meta(&metas[i]));
-                setting_bw_fds[num_setting_bw_fds++] = metas[i].fd;
-            } else if (metas[i].state == csm_st_measuring) {
-                // Build up the list of tor client fds that we are currently waiting on
-                // for a per-second measurement result from
-                LOG("Adding %s to list of ongoing measurement fds\n", desc_meta(&metas[i]));
-                measuring_fds[num_measuring_fds++] = metas[i].fd;
             }
+            struct res_event ev;
+            res_event_init(&ev, res_result, ctx->known_m_ids[i], p.fp, "coord");
+            ev.bw = cv_median(ctx->known_m_ids[i]);
+            ev.n = cv_num_secs(ctx->known_m_ids[i]);
+            res_emit(ctx->results, &ev);
+            // only a result v3bw generation would believe says what the
+            // relay can do
+            if (ev.n >= SECS_REQUIRED || cv_converged(ctx->known_m_ids[i]))
+                sched_capacity_learn(ctx->known_m_ids[i], ev.bw);
+            res_event_init(&ev, res_done, ctx->known_m_ids[i], p.fp, "coord");
+            ev.ok = 1;
+            res_emit(ctx->results, &ev);
+            ctx->done_m_ids[ctx->num_done_m_ids++] = ctx->known_m_ids[i];
+            g_hash_table_remove(ctx->running_msms, GUINT_TO_POINTER(ctx->known_m_ids[i]));
+            cv_forget(ctx->known_m_ids[i]);
+            ctx->known_m_ids[i--] = ctx->known_m_ids[--ctx->num_known_m_ids];
+            ctx->count_success++;
         }
-        epoll_add_all(epoll_fd, authing_fds, num_authing_fds);
-        epoll_add_all(epoll_fd, connecting_fds, num_connecting_fds);
-        epoll_add_all(epoll_fd, setting_bw_fds, num_setting_bw_fds);
-        epoll_add_all(epoll_fd, measuring_fds, num_measuring_fds);
-        assert(num_authing_fds >= 0);
-        assert(num_connecting_fds >= 0);
-        assert(num_setting_bw_fds >= 0);
-        assert(num_measuring_fds >= 0);
-        int num_interesting_fds = num_authing_fds + num_connecting_fds + num_setting_bw_fds + num_measuring_fds;
-        if (!num_interesting_fds) {
-            LOG("%d interesting fds. skipping epoll_wait()\n", num_interesting_fds);
-            goto main_loop_end;
+        free_msm_params(&p);
+    }
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        if (ctx->metas[i].state == csm_st_authing) {
+            // Build up the list of tor client fds that we are currently waiting
+            // on auth success message from
+            LOG("Adding %s to list of fds needed auth response\n", desc_meta(&ctx->metas[i]));
+            ctx->authing_fds[num_authing_fds++] = ctx->metas[i].fd;
+        } else if (ctx->metas[i].state == csm_st_told_connect_target) {
+            // Build up the list of tor client fds that we are currently waiting on
+            // a connect-to-target success message from
+            LOG("Adding %s to list of fds needed connect-to-target response\n", desc_meta(&ctx->metas[i]));
+            ctx->connecting_fds[num_connecting_fds++] = ctx->metas[i].fd;
+        } else if (ctx->metas[i].state == csm_st_setting_bw) {
+            // Build up the list of tor client fds that we are currently waiting on
+            // for a success msg about setting bw
+            LOG("Adding %s to list of fds needed did-set-bw response\n", desc_meta(&ctx->metas[i]));
+            ctx->setting_bw_fds[num_setting_bw_fds++] = ctx->metas[i].fd;
+        } else if (ctx->metas[i].state == csm_st_measuring) {
+            // Build up the list of tor client fds that we are currently waiting on
+            // for a per-second measurement result from
+            LOG("Adding %s to list of ongoing measurement fds\n", desc_meta(&ctx->metas[i]));
+            ctx->measuring_fds[num_measuring_fds++] = ctx->metas[i].fd;
+        } else if (ctx->metas[i].stopping) {
+            // Stopped early, and waiting on it to say its TESTSPEED is over
+            LOG("Adding %s to list of ongoing measurement fds to drain\n", desc_meta(&ctx->metas[i]));
+            ctx->measuring_fds[num_measuring_fds++] = ctx->metas[i].fd;
         }
-        LOG("Going in to epoll_wait() with %d interesting fds\n", num_interesting_fds);
-        int epoll_result = epoll_wait(epoll_fd, epoll_out_events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
-        if (epoll_result < 0) {
-            perror("Error on epoll_wait()");
-            loops_without_progress++;
-            goto main_loop_end;
-        } else if (epoll_result == 0) {
-            LOG("%u ms timeout on epoll_wait().\n", EPOLL_TIMEOUT);
-            loops_without_progress++;
+    }
+    // fds that stay wanted from one loop to the next stay registered
+    ev_begin(ctx->ev);
+    ev_want_all(ctx->ev, ctx->authing_fds, num_authing_fds);
+    ev_want_all(ctx->ev, ctx->connecting_fds, num_connecting_fds);
+    ev_want_all(ctx->ev, ctx->setting_bw_fds, num_setting_bw_fds);
+    ev_want_all(ctx->ev, ctx->measuring_fds, num_measuring_fds);
+    assert(num_authing_fds >= 0);
+    assert(num_connecting_fds >= 0);
+    assert(num_setting_bw_fds >= 0);
+    assert(num_measuring_fds >= 0);
+    int num_interesting_fds = num_authing_fds + num_connecting_fds + num_setting_bw_fds + num_measuring_fds;
+    if (!num_interesting_fds) {
+        // Nothing is running. If all that is left is waiting to be retried,
+        // wait until the first retry is due instead of spinning, still waking
+        // up for changes to the files we watch and for status queries.
+        const uint64_t retry_at = sched_next_retry_at();
+        const time_t now = time(NULL);
+        if (!retry_at || retry_at <= (uint64_t)now) {
+            LOG("%d interesting fds. skipping ev_wait()\n", num_interesting_fds);
             goto main_loop_end;
-        } else {
-            loops_without_progress = 0;
         }
-        struct ctrl_sock_meta *meta;
-        for (int i = 0; i < epoll_result; i++) {
-            if (!(meta = meta_with_fd(epoll_out_events[i].data.fd, metas, num_tor_clients))) {
-                LOG("Could not find fd=%d in metas\n", epoll_out_events[i].data.fd);
-                return -1;
+        int idle_ms = retry_at - now > INT_MAX / 1000 ? INT_MAX : (int)(retry_at - now) * 1000;
+        if (max_wait_ms >= 0 && max_wait_ms < idle_ms)
+            idle_ms = max_wait_ms;
+        LOG("Nothing running. Waiting up to %d ms for the next retry\n", idle_ms);
+        if (ev_wait(ctx->ev, idle_ms, ctx->ready_fds, EV_MAX_READY) < 0)
+            perror("Error on ev_wait()");
+        goto main_loop_end;
+    }
+    LOG("Going in to ev_wait() with %d interesting fds\n", num_interesting_fds);
+    // Don't wait around if there's more schedule to load
+    int ev_timeout = sched_loading() ? 0 : EV_TIMEOUT;
+    if (max_wait_ms >= 0 && max_wait_ms < ev_timeout)
+        ev_timeout = max_wait_ms;
+    struct timeval wait_start, wait_end;
+    assert(gettimeofday(&wait_start, NULL) == 0);
+    int ev_result = ev_wait(ctx->ev, ev_timeout, ctx->ready_fds, EV_MAX_READY);
+    assert(gettimeofday(&wait_end, NULL) == 0);
+    if (ev_result < 0) {
+        perror("Error on ev_wait()");
+        ctx->loops_without_progress++;
+        goto main_loop_end;
+    } else if (ev_result == 0) {
+        if (ev_timeout) {
+            LOG("%u ms timeout on ev_wait().\n", ev_timeout);
+            // a loop without progress is EV_TIMEOUT of waiting, however many
+            // calls it took
+            if ((ctx->waited_ms += ev_timeout) >= EV_TIMEOUT) {
+                ctx->loops_without_progress++;
+                ctx->waited_ms = 0;
             }
-            // Check for authed sockets
-            if (array_contains(authing_fds, num_authing_fds, meta->fd)) {
-                if (!tc_authed_socket(meta)) {
-                    LOG("Unable to auth to fd=%d\n", meta->fd);
-                    num_known_m_ids = measurement_failed(
-                        meta->current_m_id, known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                    count_failure++;
-                    goto main_loop_end;
+        }
+        goto main_loop_end;
+    }
+    // Only hearing from a measurer is progress. Waking up for the files we
+    // watch or a status query counts as waiting, or a dashboard polling often
+    // enough would keep the failsafe from ever going off.
+    int heard_from_measurer = 0;
+    for (int i = 0; i < ev_result; i++) {
+        if (ctx->ready_fds[i] != fw_fd(ctx->fw) && !(ctx->st && ctx->ready_fds[i] == st_fd(ctx->st)))
+            heard_from_measurer = 1;
+    }
+    if (heard_from_measurer) {
+        ctx->loops_without_progress = 0;
+        ctx->waited_ms = 0;
+    } else if ((ctx->waited_ms += (wait_end.tv_sec - wait_start.tv_sec) * 1000 +
+            (wait_end.tv_usec - wait_start.tv_usec) / 1000) >= EV_TIMEOUT) {
+        ctx->loops_without_progress++;
+        ctx->waited_ms = 0;
+    }
+    struct ctrl_sock_meta *meta;
+    for (int i = 0; i < ev_result; i++) {
+        if (ctx->ready_fds[i] == fw_fd(ctx->fw) || (ctx->st && ctx->ready_fds[i] == st_fd(ctx->st))) {
+            // handled at the top of the next loop
+            continue;
+        }
+        if (!(meta = meta_with_fd(ctx->ready_fds[i], ctx->metas, ctx->num_tor_clients))) {
+            LOG("Could not find fd=%d in ctx->metas\n", ctx->ready_fds[i]);
+            return -1;
+        }
+        // Check for authed sockets
+        if (array_contains(ctx->authing_fds, num_authing_fds, meta->fd)) {
+            if (!tc_authed_socket(meta)) {
+                LOG("Unable to auth to fd=%d\n", meta->fd);
+                const unsigned m_id = meta->current_m_id;
+                if (!substitute_meta(ctx, meta)) {
+                    measurement_failed(ctx, m_id, SCHED_FAIL_SETUP);
                 }
-                tc_assert_state(meta, csm_st_authed);
+                goto main_loop_end;
             }
-            // Check for connected-to-target sockets
-            else if (array_contains(connecting_fds, num_connecting_fds, meta->fd)) {
-                if (!tc_connected_socket(meta)) {
-                    LOG("fd=%d was unable to connect to target\n", meta->fd);
-                    num_known_m_ids = measurement_failed(
-                        meta->current_m_id, known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                    count_failure++;
-                    goto main_loop_end;
+            tc_assert_state(meta, csm_st_authed);
+        }
+        // Check for connected-to-target sockets
+        else if (array_contains(ctx->connecting_fds, num_connecting_fds, meta->fd)) {
+            if (!tc_connected_socket(meta)) {
+                LOG("fd=%d was unable to connect to target\n", meta->fd);
+                const unsigned m_id = meta->current_m_id;
+                if (!substitute_meta(ctx, meta)) {
+                    measurement_failed(ctx, m_id, SCHED_FAIL_SETUP);
                 }
-                tc_assert_state(meta, csm_st_connected_target);
+                goto main_loop_end;
             }
-            // Check for did-set-bw sockets
-            else if (array_contains(setting_bw_fds, num_setting_bw_fds, meta->fd)) {
-                if (!tc_did_set_bw_rate(meta)) {
-                    LOG("fd=%d was unable to set its bw\n", meta->fd);
-                    num_known_m_ids = measurement_failed(
-                        meta->current_m_id, known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                    count_failure++;
-                    goto main_loop_end;
+            tc_assert_state(meta, csm_st_connected_target);
+        }
+        // Check for did-set-bw sockets
+        else if (array_contains(ctx->setting_bw_fds, num_setting_bw_fds, meta->fd)) {
+            if (!tc_did_set_bw_rate(meta)) {
+                LOG("fd=%d was unable to set its bw\n", meta->fd);
+                const unsigned m_id = meta->current_m_id;
+                if (!substitute_meta(ctx, meta)) {
+                    measurement_failed(ctx, m_id, SCHED_FAIL_SETUP);
                 }
-                tc_assert_state(meta, csm_st_bw_set);
+                goto main_loop_end;
             }
-            // Check for socks with results
-            else if (array_contains(measuring_fds, num_measuring_fds, meta->fd)) {
-                struct msm_params p;
-                assert(fill_msm_params(&p, meta->current_m_id));
-                if (!tc_output_result(meta, p.id, p.fp, out_rfd->fd)) {
-                    LOG("Error while outputting some results of measurement id=%u\n", meta->current_m_id);
-                    num_known_m_ids = measurement_failed(
-                        meta->current_m_id, known_m_ids, num_known_m_ids, metas, num_tor_clients);
-                    count_failure++;
-                    goto main_loop_end;
-                }
-            } else {
-                LOG("fd=%d was not in any of our sets. WTF is it doing? This is bad ...\n", meta->fd);
+            tc_assert_state(meta, csm_st_bw_set);
+        }
+        // Check for socks with results
+        else if (array_contains(ctx->measuring_fds, num_measuring_fds, meta->fd)) {
+            if (meta->stopping) {
+                if (!tc_drain_stopped(meta))
+                    tc_finished_with_meta(meta);
+                continue;
+            }
+            if (meta->state != csm_st_measuring) {
+                // its measurement was stopped early while handling
+                // another fd this time around
+                continue;
+            }
+            struct msm_params p;
+            assert(fill_msm_params(ctx, &p, meta->current_m_id));
+            if (!tc_output_result(meta, p.id, p.fp, ctx->results)) {
+                LOG("Error while outputting some results of measurement id=%u\n", meta->current_m_id);
+                measurement_failed(ctx, meta->current_m_id, SCHED_FAIL_MEASURE);
+                goto main_loop_end;
+            }
+            if (cv_converged(meta->current_m_id)) {
+                stop_converged_measurement(
+                    meta->current_m_id, p.fp, p.failsafe_stop, ctx->metas, ctx->num_tor_clients, ctx->results);
             }
+        } else {
+            LOG("fd=%d was not in any of our sets. WTF is it doing? This is bad ...\n", meta->fd);
         }
+    }
 main_loop_end:
-        // Tell epoll we don't care about any sockets
-        epoll_delete_all(epoll_fd, authing_fds, num_authing_fds);
-        epoll_delete_all(epoll_fd, connecting_fds, num_connecting_fds);
-        epoll_delete_all(epoll_fd, setting_bw_fds, num_setting_bw_fds);
-        epoll_delete_all(epoll_fd, measuring_fds, num_measuring_fds);
-        (void)0; // purposeful no-op, in case refactoring ever removes all
-                 //other statements after main_loop_end label
-    }
-    rfd_close(out_rfd);
-    v3bw_generate(msm_out_fname, v3bw_out_fname);
-    LOG("ALLLLLLLL DOOOONNEEEEE\n");
-    LOG("%d success, %d failed, %d total\n", count_success, count_failure, count_total);
-    free(metas);
-    free(known_m_ids);
-    free(epoll_out_events);
-    free(authing_fds);
-    free(connecting_fds);
-    free(setting_bw_fds);
-    free(measuring_fds);
-    close(epoll_fd);
+    // results go out before the journal says they're done, so a coordinator
+    // that is killed doesn't resume without them
+    if (ctx->num_done_m_ids && ctx->out_rfd)
+        fflush(ctx->out_rfd->fd);
+    sched_mark_done_many(ctx->done_m_ids, ctx->num_done_m_ids);
+    ctx->num_done_m_ids = 0;
     return 0;
 }
 
+void
+ff_ctx_free(struct ff_ctx *ctx) {
+    if (!ctx)
+        return;
+    sched_ctx_use(ctx->sched);
+    cv_ctx_use(ctx->cv);
+    tc_set_evloop(ctx->ev);
+    tr_use(ctx->tr);
+    for (int i = 0; i < ctx->num_tor_clients; i++) {
+        if (ctx->metas[i].fd >= 0)
+            tc_finished_with_meta(&ctx->metas[i]);
+        free_ctrl_sock_meta(ctx->metas[i]);
+    }
+    tc_set_evloop(NULL);
+    tr_free(ctx->tr);
+    if (ctx->out_rfd)
+        rfd_close(ctx->out_rfd);
+    // so no segment is left half compressed, as a .gz.tmp, when we exit
+    rfd_gz_wait();
+    sched_capacity_save();
+    res_bus_free(ctx->results);
+    st_free(ctx->st);
+    if (ctx->fw)
+        fw_free(ctx->fw);
+    if (ctx->ev)
+        ev_free(ctx->ev);
+    g_hash_table_destroy(ctx->running_msms);
+    sched_ctx_free(ctx->sched);
+    cv_ctx_free(ctx->cv);
+    free(ctx->metas);
+    free(ctx->known_m_ids);
+    free(ctx->done_m_ids);
+    free(ctx->ready_fds);
+    free(ctx->authing_fds);
+    free(ctx->connecting_fds);
+    free(ctx->setting_bw_fds);
+    free(ctx->measuring_fds);
+    free(ctx->fp_fname);
+    free(ctx->client_fname);
+    free(ctx->msm_out_fname);
+    free(ctx->v3bw_out_fname);
+    free(ctx);
+}
+
+/**
+ * Call cb with each result event, along with arg, as ctx gets them. Every
+ * event from then on is seen, in the order they happen.
+ */
+void
+ff_ctx_add_callback(struct ff_ctx *ctx, res_callback cb, void *arg) {
+    res_bus_add_callback(ctx->results, cb, arg);
+}
+
+/**
+ * Whether to write every measurer's results to ctx's msm_out file (the
+ * default), or only one total per second for each measurement. Callbacks and
+ * rings get both either way.
+ */
+void
+ff_ctx_set_samples(struct ff_ctx *ctx, const int on) {
+    ctx->out_samples = on;
+}
+
+/**
+ * Keep ctx's result events in a ring of at least capacity events, for
+ * res_ring_poll() to take them from. The ring may be polled from another
+ * thread, and is freed with ctx.
+ */
+struct res_ring *
+ff_ctx_add_ring(struct ff_ctx *ctx, const size_t capacity) {
+    return res_bus_add_ring(ctx->results, capacity);
+}
+
 int
-main(int argc, const char *argv[]) {
+main_loop_once(int argc, const char *argv[]) {
+    int summary = 0;
+    const char *journal_fname = NULL;
+    const char *capacity_fname = NULL;
+    const char *status_path = NULL;
+    const char *trace_fname = NULL;
+    unsigned long rotate_mb = 0, rotate_secs = 0;
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "sj:c:q:T:r:i:")) != -1) {
+        switch (opt) {
+            case 's':
+                summary = 1;
+                break;
+            case 'j':
+                journal_fname = optarg;
+                break;
+            case 'c':
+                capacity_fname = optarg;
+                break;
+            case 'q':
+                status_path = optarg;
+                break;
+            case 'T':
+                trace_fname = optarg;
+                break;
+            case 'r':
+            case 'i':
+                *(opt == 'r' ? &rotate_mb : &rotate_secs) = strtoul(optarg, &end, 10);
+                if (*end || !*optarg) {
+                    usage();
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (argc - optind != 4) {
+        //LOG("argc=%d\n", argc);
+        usage();
+        return -1;
+    }
+    argv += optind - 1;
+    struct ff_ctx *ctx = ff_ctx_new(argv[1], argv[2], argv[3], argv[4]);
+    if (!ctx)
+        return -1;
+    ff_ctx_set_samples(ctx, !summary);
+    ff_ctx_set_rotation(ctx, rotate_mb * 1000 * 1000, rotate_secs);
+    if (journal_fname && ff_ctx_set_journal(ctx, journal_fname) < 0) {
+        ff_ctx_free(ctx);
+        return -1;
+    }
+    if (capacity_fname && ff_ctx_set_capacity(ctx, capacity_fname) < 0) {
+        ff_ctx_free(ctx);
+        return -1;
+    }
+    if (status_path && ff_ctx_set_status(ctx, status_path) < 0) {
+        ff_ctx_free(ctx);
+        return -1;
+    }
+    if (trace_fname && ff_ctx_set_trace(ctx, trace_fname) < 0) {
+        ff_ctx_free(ctx);
+        return -1;
+    }
     int ret;
-    while (1) {
-        ret = main_loop_once(argc, argv);
-        if (ret) return ret;
+    // we keep waiting for changes to the files we watch, so this only ends
+    // if something goes wrong
+    while (!(ret = ff_ctx_run_once(ctx, -1)));
+    ff_ctx_free(ctx);
+    return ret;
+}
+
+static int
+v3bw_merge_main(int argc, char *argv[]) {
+    enum v3bw_policy policy = v3bw_newest;
+    unsigned long half_life = 86400;
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:H:")) != -1) {
+        switch (opt) {
+            case 'p':
+                if (!strcmp(optarg, "newest")) {
+                    policy = v3bw_newest;
+                } else if (!strcmp(optarg, "decay")) {
+                    policy = v3bw_decay;
+                } else {
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'H':
+                half_life = strtoul(optarg, &end, 10);
+                if (*end || !half_life) {
+                    usage();
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+        return -1;
+    }
+    return v3bw_merge(
+        (const char *const *)argv + optind + 1, argc - optind - 1, argv[optind],
+        policy, half_life);
+}
+
+int
+main(int argc, const char *argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "sched-convert")) {
+        if (argc != 4) {
+            usage();
+            return -1;
+        }
+        return sched_convert(argv[2], argv[3]) ? 0 : -1;
+    }
+    if (argc > 1 && !strcmp(argv[1], "replay")) {
+        double speed = 0;
+        char *end = NULL;
+        if (argc == 7)
+            speed = strtod(argv[6], &end);
+        if ((argc != 6 && argc != 7) || (end && (*end || speed < 0))) {
+            usage();
+            return -1;
+        }
+        return rp_run(argv[2], argv[3], argv[4], argv[5], speed);
+    }
+    if (argc > 1 && !strcmp(argv[1], "sim")) {
+        return sim_main(argc - 1, (char **)argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "v3bw-merge")) {
+        return v3bw_merge_main(argc - 1, (char **)argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "trace2json")) {
+        if (argc != 4) {
+            usage();
+            return -1;
+        }
+        return tr_to_json(argv[2], argv[3]);
     }
+    return main_loop_once(argc, argv);
 }
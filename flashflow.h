@@ -0,0 +1,19 @@
+#ifndef FF_FLASHFLOW_H
+#define FF_FLASHFLOW_H
+#include "common.h"
+#include "results.h"
+struct ff_ctx;
+struct ff_ctx *ff_ctx_new(
+    const char *fp_fname, const char *client_fname,
+    const char *msm_out_fname, const char *v3bw_out_fname);
+int ff_ctx_run_once(struct ff_ctx *ctx, const int max_wait_ms);
+void ff_ctx_set_samples(struct ff_ctx *ctx, const int on);
+int ff_ctx_set_journal(struct ff_ctx *ctx, const char *fname);
+int ff_ctx_set_capacity(struct ff_ctx *ctx, const char *fname);
+int ff_ctx_set_status(struct ff_ctx *ctx, const char *path);
+int ff_ctx_set_trace(struct ff_ctx *ctx, const char *fname);
+void ff_ctx_set_rotation(struct ff_ctx *ctx, const unsigned long max_bytes, const unsigned max_secs);
+void ff_ctx_add_callback(struct ff_ctx *ctx, res_callback cb, void *arg);
+struct res_ring *ff_ctx_add_ring(struct ff_ctx *ctx, const size_t capacity);
+void ff_ctx_free(struct ff_ctx *ctx);
+#endif /* !defined(FF_FLASHFLOW_H) */
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include "replay.h"
+#include "torclient.h"
+#include "rotatefd.h"
+#include "results.h"
+#include "converge.h"
+#include "v3bw.h"
+#include "sched.h"
+
+/*
+ * Replay a msm_out file through the same code the coordinator uses to handle
+ * results, without any tor clients or network.
+ *
+ * Every measurer in the file gets a socketpair. Its lines are written to one
+ * end at the time (relative to the first line) they were originally logged,
+ * divided by the speed, and tc_output_result() reads them from the other end
+ * just like it would from a control socket. Lines a measurer sent that were
+ * logged with the same timestamp were read with one recv() originally, so
+ * they are written together. When everything has been replayed, a v3bw file
+ * is generated from the new msm_out file.
+ *
+ * Lines are replayed in the order they were logged, so the same input always
+ * gives the same output, apart from the new timestamps.
+ */
+
+struct rp_event {
+    double ts;
+    // position in the file, to keep lines with the same ts in order
+    size_t seq;
+    // index into the list of streams
+    unsigned stream;
+    char *line;
+};
+
+/* Everything one measurer sent during one measurement, or the coordinator's
+ * own lines about a measurement */
+struct rp_stream {
+    unsigned m_id;
+    char *fp;
+    int is_coord;
+    struct ctrl_sock_meta meta;
+    // our end of the socketpair whose other end is meta.fd, or -1
+    int peer;
+    // done with it. Anything else it sent is ignored
+    int closed;
+    size_t last_event;
+};
+
+/* Per measurement, so convergence tracking starts and stops with it */
+struct rp_msm {
+    unsigned num_hosts;
+    unsigned open_streams;
+    // measurers with lines in the file. If none, they were left out and
+    // only the coordinator's per second totals are there.
+    unsigned num_measurers;
+};
+
+struct rp_log {
+    struct rp_event *events;
+    size_t num_events, cap_events;
+    struct rp_stream *streams;
+    size_t num_streams, cap_streams;
+    // "m_id who" -> index into streams + 1
+    GHashTable *stream_idx;
+    // m_id -> struct rp_msm
+    GHashTable *msms;
+    size_t num_bad, num_unknown;
+};
+
+static double
+rp_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+compare_events(const void *a, const void *b) {
+    const struct rp_event *aa = a, *bb = b;
+    if (aa->ts != bb->ts)
+        return aa->ts < bb->ts ? -1 : 1;
+    return (aa->seq > bb->seq) - (aa->seq < bb->seq);
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+    const double aa = *(const double *)a, bb = *(const double *)b;
+    return (aa > bb) - (aa < bb);
+}
+
+static struct rp_msm *
+rp_get_msm(struct rp_log *log, const unsigned m_id) {
+    struct rp_msm *msm = g_hash_table_lookup(log->msms, GUINT_TO_POINTER(m_id));
+    if (msm)
+        return msm;
+    if (!sched_has(m_id))
+        return NULL;
+    char **classes;
+    uint32_t *bws, *conns;
+    msm = calloc(1, sizeof(struct rp_msm));
+    msm->num_hosts = sched_get_hosts(m_id, &classes, &bws, &conns);
+    sched_free_hosts(classes, bws, conns, msm->num_hosts);
+    g_hash_table_insert(log->msms, GUINT_TO_POINTER(m_id), msm);
+    return msm;
+}
+
+/* The stream for the given measurement and who ("coord" or
+ * "class;host:port"), made if we haven't seen it yet. Returns -1 if who is
+ * malformed. */
+static long
+rp_get_stream(struct rp_log *log, const unsigned m_id, const char *fp, const char *who) {
+    char *key = g_strdup_printf("%u %s", m_id, who);
+    const size_t idx = GPOINTER_TO_SIZE(g_hash_table_lookup(log->stream_idx, key));
+    if (idx) {
+        g_free(key);
+        return idx - 1;
+    }
+    struct rp_stream s;
+    memset(&s, 0, sizeof(s));
+    s.m_id = m_id;
+    s.fp = strdup(fp);
+    s.peer = -1;
+    s.meta.fd = -1;
+    s.meta.current_m_id = m_id;
+    if (!strcmp(who, "coord")) {
+        s.is_coord = 1;
+    } else {
+        const char *semi = strchr(who, ';');
+        const char *colon = strrchr(who, ':');
+        if (!semi || !colon || colon < semi) {
+            free(s.fp);
+            g_free(key);
+            return -1;
+        }
+        s.meta.class = strndup(who, semi - who);
+        s.meta.host = strndup(semi + 1, colon - semi - 1);
+        s.meta.port = strdup(colon + 1);
+        s.meta.is_bg = !strcmp(s.meta.class, "bg");
+        rp_get_msm(log, m_id)->num_measurers++;
+    }
+    if (log->num_streams == log->cap_streams) {
+        log->cap_streams = log->cap_streams ? log->cap_streams * 2 : 64;
+        log->streams = realloc(log->streams, log->cap_streams * sizeof(struct rp_stream));
+    }
+    log->streams[log->num_streams++] = s;
+    // the hash table owns key now
+    g_hash_table_insert(log->stream_idx, key, GSIZE_TO_POINTER(log->num_streams));
+    return log->num_streams - 1;
+}
+
+/* Read every line of a msm_out file into log. Lines for measurements that
+ * aren't in the schedule, and lines that don't look like ours, are counted
+ * and skipped. */
+static void
+rp_read(FILE *in, struct rp_log *log) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        // <ts> <m_id> <fp> <who> <rest of line>
+        char *head = line;
+        char *ts_s = strsep(&head, " ");
+        char *m_id_s = strsep(&head, " ");
+        char *fp = strsep(&head, " ");
+        char *who = strsep(&head, " ");
+        char *rest = head;
+        char *end;
+        if (!rest || !*rest) {
+            log->num_bad++;
+            continue;
+        }
+        const double ts = strtod(ts_s, &end);
+        if (*end) {
+            log->num_bad++;
+            continue;
+        }
+        const unsigned long m_id = strtoul(m_id_s, &end, 10);
+        if (*end || !m_id) {
+            log->num_bad++;
+            continue;
+        }
+        if (!rp_get_msm(log, m_id)) {
+            log->num_unknown++;
+            continue;
+        }
+        const long stream = rp_get_stream(log, m_id, fp, who);
+        if (stream < 0) {
+            log->num_bad++;
+            continue;
+        }
+        if (log->num_events == log->cap_events) {
+            log->cap_events = log->cap_events ? log->cap_events * 2 : 1024;
+            log->events = realloc(log->events, log->cap_events * sizeof(struct rp_event));
+        }
+        log->events[log->num_events].ts = ts;
+        log->events[log->num_events].seq = log->num_events;
+        log->events[log->num_events].stream = stream;
+        log->events[log->num_events].line = strdup(rest);
+        log->num_events++;
+    }
+    free(line);
+}
+
+/* Order the lines by when they were logged, and note each stream's last one
+ * so it can be closed then */
+static void
+rp_prepare(struct rp_log *log) {
+    qsort(log->events, log->num_events, sizeof(struct rp_event), compare_events);
+    for (size_t i = 0; i < log->num_events; i++)
+        log->streams[log->events[i].stream].last_event = i;
+}
+
+static int
+rp_open_stream(struct rp_log *log, struct rp_stream *s) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("Error making socketpair for replay");
+        return 0;
+    }
+    s->meta.fd = sv[0];
+    s->peer = sv[1];
+    s->meta.state = csm_st_measuring;
+    struct rp_msm *msm = rp_get_msm(log, s->m_id);
+    if (!msm->open_streams++)
+        cv_start(s->m_id, msm->num_hosts);
+    return 1;
+}
+
+static void
+rp_close_stream(struct rp_log *log, struct rp_stream *s) {
+    if (s->peer >= 0) {
+        close(s->meta.fd);
+        close(s->peer);
+        s->meta.fd = s->peer = -1;
+        // the measurement's convergence tracking is kept until the end, as
+        // its RESULT line comes after all its measurers are done
+        rp_get_msm(log, s->m_id)->open_streams--;
+    }
+    s->closed = 1;
+}
+
+static void
+rp_free(struct rp_log *log) {
+    for (size_t i = 0; i < log->num_events; i++)
+        free(log->events[i].line);
+    for (size_t i = 0; i < log->num_streams; i++) {
+        free(log->streams[i].fp);
+        free_ctrl_sock_meta(log->streams[i].meta);
+    }
+    free(log->events);
+    free(log->streams);
+    g_hash_table_destroy(log->stream_idx);
+    g_hash_table_destroy(log->msms);
+}
+
+/**
+ * Replay the results in msm_in_fname, which came from the schedule in
+ * fp_fname, writing them to msm_out_fname and then generating a v3bw file
+ * from them. speed 1 replays at the speed they were recorded, 2 twice as
+ * fast, and so on. speed 0 replays them as fast as possible.
+ */
+int
+rp_run(
+        const char *msm_in_fname, const char *fp_fname,
+        const char *msm_out_fname, const char *v3bw_out_fname,
+        const double speed) {
+    struct rp_log log;
+    FILE *in;
+    memset(&log, 0, sizeof(log));
+    log.stream_idx = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    log.msms = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    LOG("Reading experiments from %s\n", fp_fname);
+    if (!sched_new(fp_fname)) {
+        LOG("Empty sched from %s or error\n", fp_fname);
+        return -1;
+    }
+    while (sched_load_more());
+    if (!(in = fopen(msm_in_fname, "r"))) {
+        perror("Unable to open results to replay");
+        return -1;
+    }
+    rp_read(in, &log);
+    fclose(in);
+    LOG("Read %lu lines from %lu measurers in %s. Skipped %lu bad lines and "
+        "%lu lines for measurements not in %s\n",
+        log.num_events, log.num_streams, msm_in_fname,
+        log.num_bad, log.num_unknown, fp_fname);
+    if (!log.num_events) {
+        rp_free(&log);
+        return -1;
+    }
+    rp_prepare(&log);
+    struct rotate_fd *out_rfd = rfd_open(msm_out_fname);
+    LOG("Will output results to %s\n", out_rfd->fname);
+    struct res_bus *results = res_bus_new();
+    res_bus_add_file(results, &out_rfd, NULL);
+    // how long each tc_output_result() call took
+    double *lat = malloc(log.num_events * sizeof(double));
+    size_t num_lat = 0, num_ignored = 0;
+    const double first_ts = log.events[0].ts;
+    const double start = rp_now();
+    char buf[READ_BUF_LEN];
+    for (size_t i = 0; i < log.num_events;) {
+        const struct rp_event *e = &log.events[i];
+        struct rp_stream *s = &log.streams[e->stream];
+        if (speed > 0) {
+            const double wait = start + (e->ts - first_ts) / speed - rp_now();
+            if (wait > 0)
+                usleep(wait * 1000000);
+        }
+        if (s->is_coord) {
+            struct res_event ev;
+            if (!strncmp(e->line, "RESULT ", 7) && rp_get_msm(&log, s->m_id)->num_measurers) {
+                // worked out again from what was replayed
+                res_event_init(&ev, res_result, s->m_id, s->fp, "coord");
+                ev.bw = cv_median(s->m_id);
+                ev.n = cv_num_secs(s->m_id);
+            } else {
+                res_event_init(&ev, res_line, s->m_id, s->fp, "coord");
+                ev.line = e->line;
+            }
+            if (!strncmp(e->line, "RETRY ", 6)) {
+                // the next attempt's result is worked out from its own
+                // seconds, like measurement_failed() makes sure of
+                cv_forget(s->m_id);
+                cv_start(s->m_id, rp_get_msm(&log, s->m_id)->num_hosts);
+            }
+            res_emit(results, &ev);
+            i++;
+            continue;
+        }
+        if (s->closed || (s->peer < 0 && !rp_open_stream(&log, s))) {
+            num_ignored++;
+            i++;
+            continue;
+        }
+        // Everything this measurer sent that was read at once, as long as it
+        // fits in one read
+        size_t len = 0;
+        size_t j = i;
+        for (; j < log.num_events; j++) {
+            const struct rp_event *f = &log.events[j];
+            const size_t line_len = strlen(f->line);
+            if (f->stream != e->stream || f->ts != e->ts ||
+                    len + line_len + 2 >= READ_BUF_LEN)
+                break;
+            memcpy(buf + len, f->line, line_len);
+            memcpy(buf + len + line_len, "\r\n", 2);
+            len += line_len + 2;
+        }
+        if (j == i) {
+            LOG("Line too long to replay: '%s'\n", e->line);
+            num_ignored++;
+            i++;
+            continue;
+        }
+        if (send(s->peer, buf, len, 0) != (ssize_t)len) {
+            perror("Error writing replayed lines");
+            rp_close_stream(&log, s);
+            i = j;
+            continue;
+        }
+        const double before = rp_now();
+        const int ok = tc_output_result(&s->meta, s->m_id, s->fp, results);
+        lat[num_lat++] = rp_now() - before;
+        if (!ok || s->meta.state != csm_st_measuring || j - 1 == s->last_event) {
+            rp_close_stream(&log, s);
+        }
+        i = j;
+    }
+    const double replay_secs = rp_now() - start;
+    for (size_t i = 0; i < log.num_streams; i++) {
+        rp_close_stream(&log, &log.streams[i]);
+        cv_forget(log.streams[i].m_id);
+    }
+    rfd_close(out_rfd);
+    res_bus_free(results);
+    const double v3bw_start = rp_now();
+    const int ret = v3bw_generate(msm_out_fname, v3bw_out_fname);
+    const double v3bw_secs = rp_now() - v3bw_start;
+    qsort(lat, num_lat, sizeof(double), compare_doubles);
+    LOG("Replayed %lu lines in %.3fs (%.0f lines/s), ignoring %lu\n",
+        log.num_events, replay_secs,
+        replay_secs > 0 ? log.num_events / replay_secs : 0, num_ignored);
+    if (num_lat) {
+        LOG("tc_output_result() calls: %lu. Microseconds p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+            num_lat, lat[num_lat/2] * 1e6, lat[num_lat*9/10] * 1e6,
+            lat[num_lat*99/100] * 1e6, lat[num_lat-1] * 1e6);
+    }
+    LOG("v3bw generation took %.3fs\n", v3bw_secs);
+    free(lat);
+    rp_free(&log);
+    return ret;
+}
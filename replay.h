@@ -0,0 +1,8 @@
+#ifndef FF_REPLAY_H
+#define FF_REPLAY_H
+#include "common.h"
+int rp_run(
+    const char *msm_in_fname, const char *fp_fname,
+    const char *msm_out_fname, const char *v3bw_out_fname,
+    const double speed);
+#endif /* !defined(FF_REPLAY_H) */
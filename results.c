@@ -0,0 +1,228 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "results.h"
+#include "rotatefd.h"
+
+/*
+ * Where results go as they arrive. Everything the coordinator learns about a
+ * measurement while it runs becomes a struct res_event, which is handed to
+ * each consumer on the bus in the order they were added: callbacks, rings
+ * that another part of the program (or another thread) polls, and the
+ * msm_out file.
+ */
+
+struct res_consumer {
+    res_callback cb;
+    void *arg;
+    // frees arg along with the bus, if set
+    void (*free_arg)(void *arg);
+};
+
+struct res_bus {
+    struct res_consumer *consumers;
+    size_t num_consumers;
+};
+
+/* A single producer, single consumer queue of events. The coordinator only
+ * ever adds to head and the poller only ever takes from tail, so they may be
+ * different threads. When it's full new events are dropped rather than
+ * holding up the coordinator. */
+struct res_ring {
+    struct res_event *events;
+    // a power of 2
+    size_t cap;
+    size_t head;
+    size_t tail;
+    unsigned long dropped;
+};
+
+struct res_bus *
+res_bus_new(void) {
+    return calloc(1, sizeof(struct res_bus));
+}
+
+static void
+res_bus_add(struct res_bus *bus, res_callback cb, void *arg, void (*free_arg)(void *arg)) {
+    bus->consumers = realloc(bus->consumers, (bus->num_consumers + 1) * sizeof(struct res_consumer));
+    bus->consumers[bus->num_consumers].cb = cb;
+    bus->consumers[bus->num_consumers].arg = arg;
+    bus->consumers[bus->num_consumers].free_arg = free_arg;
+    bus->num_consumers++;
+}
+
+/**
+ * Call cb with every event from now on, along with arg
+ */
+void
+res_bus_add_callback(struct res_bus *bus, res_callback cb, void *arg) {
+    res_bus_add(bus, cb, arg, NULL);
+}
+
+static void
+res_ring_push(const struct res_event *ev, void *arg) {
+    struct res_ring *ring = arg;
+    const size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->cap) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct res_event *slot = &ring->events[head & (ring->cap - 1)];
+    *slot = *ev;
+    slot->line = NULL;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+res_ring_free(void *arg) {
+    struct res_ring *ring = arg;
+    free(ring->events);
+    free(ring);
+}
+
+/**
+ * Keep every event from now on in a ring of at least capacity events, to be
+ * taken with res_ring_poll(). The ring belongs to the bus.
+ */
+struct res_ring *
+res_bus_add_ring(struct res_bus *bus, const size_t capacity) {
+    struct res_ring *ring = calloc(1, sizeof(struct res_ring));
+    ring->cap = 1;
+    while (ring->cap < capacity)
+        ring->cap *= 2;
+    ring->events = calloc(ring->cap, sizeof(struct res_event));
+    res_bus_add(bus, res_ring_push, ring, res_ring_free);
+    return ring;
+}
+
+/**
+ * Take up to max of the oldest events from the ring. Returns how many.
+ */
+size_t
+res_ring_poll(struct res_ring *ring, struct res_event out[], const size_t max) {
+    const size_t tail = ring->tail;
+    const size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t n = head - tail;
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; i++)
+        out[i] = ring->events[(tail + i) & (ring->cap - 1)];
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * How many events didn't fit in the ring because it wasn't polled often
+ * enough
+ */
+unsigned long
+res_ring_dropped(const struct res_ring *ring) {
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+struct res_file {
+    struct rotate_fd *const *rfd;
+    const int *samples;
+};
+
+/* Write the event as a line of the msm_out file, in the format v3bw.c and
+ * replay read */
+static void
+res_write_file(const struct res_event *ev, void *arg) {
+    const struct res_file *f = arg;
+    struct rotate_fd *rfd = *f->rfd;
+    if (!rfd)
+        return;
+    const int samples = !f->samples || *f->samples;
+    int len = 0;
+    switch (ev->kind) {
+        case res_sample:
+            if (!samples)
+                break;
+            // fallthrough
+        case res_line:
+            len = fprintf(rfd->fd, TS_FMT " %u %s %s %s\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->measurer, ev->line);
+            break;
+        case res_converged:
+            len = fprintf(rfd->fd, TS_FMT " %u %s coord CONVERGED %u\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->n);
+            break;
+        case res_retry:
+            len = fprintf(rfd->fd, TS_FMT " %u %s coord RETRY %u\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->n);
+            break;
+        case res_second:
+            // only needed when the samples it sums aren't there
+            if (samples)
+                break;
+            len = fprintf(rfd->fd, TS_FMT " %u %s coord SEC %ld %ld %ld\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->ts, ev->bw, ev->bg_bw);
+            break;
+        case res_result:
+            len = fprintf(rfd->fd, TS_FMT " %u %s coord RESULT %ld %u\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->bw, ev->n);
+            break;
+        case res_started:
+            len = fprintf(rfd->fd, TS_FMT " %u %s coord START %u %ld\n",
+                ev->t.tv_sec, ev->t.tv_usec, ev->m_id, ev->fp, ev->n, ev->skew_us);
+            break;
+        case res_done:
+            break;
+    }
+    if (len > 0)
+        rfd_wrote(rfd, len);
+}
+
+/**
+ * Write events to the msm_out file *rfd, whichever file that is at the time,
+ * so it follows the coordinator starting a new one each round. While
+ * *samples is false (it is always true if samples is NULL) each measurer's
+ * results aren't written, only the coordinator's per second totals of them,
+ * making the file smaller by about the number of measurers per measurement.
+ */
+void
+res_bus_add_file(struct res_bus *bus, struct rotate_fd *const *rfd, const int *samples) {
+    struct res_file *f = malloc(sizeof(struct res_file));
+    f->rfd = rfd;
+    f->samples = samples;
+    res_bus_add(bus, res_write_file, f, free);
+}
+
+void
+res_bus_free(struct res_bus *bus) {
+    if (!bus)
+        return;
+    for (size_t i = 0; i < bus->num_consumers; i++)
+        if (bus->consumers[i].free_arg)
+            bus->consumers[i].free_arg(bus->consumers[i].arg);
+    free(bus->consumers);
+    free(bus);
+}
+
+/**
+ * Fill in ev as having happened now, with everything but the fields for its
+ * kind
+ */
+void
+res_event_init(
+        struct res_event *ev, const enum res_kind kind,
+        const unsigned m_id, const char *fp, const char *measurer) {
+    ev->kind = kind;
+    ev->m_id = m_id;
+    assert(gettimeofday(&ev->t, NULL) == 0);
+    snprintf(ev->fp, sizeof(ev->fp), "%s", fp);
+    snprintf(ev->measurer, sizeof(ev->measurer), "%s", measurer);
+    ev->ts = ev->bw = ev->bg_bw = 0;
+    ev->n = 0;
+    ev->ok = 0;
+    ev->skew_us = 0;
+    ev->line = NULL;
+}
+
+void
+res_emit(const struct res_bus *bus, const struct res_event *ev) {
+    for (size_t i = 0; i < bus->num_consumers; i++)
+        bus->consumers[i].cb(ev, bus->consumers[i].arg);
+}
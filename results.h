@@ -0,0 +1,67 @@
+#ifndef FF_RESULTS_H
+#define FF_RESULTS_H
+#include <stddef.h>
+#include "common.h"
+#define RES_FP_LEN 40
+#define RES_MEASURER_LEN 128
+enum res_kind {
+    // a measurer's bw for one second
+    res_sample = 0,
+    // anything else a measurer sent while measuring
+    res_line,
+    // the measurement is being stopped early because its result settled
+    res_converged,
+    // the measurement failed and will be tried again
+    res_retry,
+    // the measurement is over, successfully or failed for good
+    res_done,
+    // the relay's total bw for a second that every measurer has reported
+    res_second,
+    // the measurement's result, just before it is done successfully
+    res_result,
+    // every measurer has been told to start measuring
+    res_started,
+};
+struct res_event {
+    enum res_kind kind;
+    unsigned m_id;
+    // when the coordinator got it
+    struct timeval t;
+    char fp[RES_FP_LEN + 1];
+    // "class;host:port" of the measurer it's from, or "coord"
+    char measurer[RES_MEASURER_LEN];
+    // res_sample and res_second: the second and the bw for it. res_result:
+    // the median bw of the complete seconds.
+    long ts;
+    long bw;
+    // res_second: the part of the relay's bw that isn't from measuring it,
+    // which bw doesn't include
+    long bg_bw;
+    // res_converged and res_result: seconds of results. res_retry: the
+    // attempt that failed. res_second and res_started: measurers.
+    unsigned n;
+    // res_done: whether it succeeded
+    int ok;
+    // res_started: usecs from telling the first measurer to start to telling
+    // the last
+    long skew_us;
+    // res_sample and res_line: what the measurer sent. Only valid until the
+    // callback returns, and NULL in events from a ring.
+    const char *line;
+};
+typedef void (*res_callback)(const struct res_event *ev, void *arg);
+struct res_bus;
+struct res_ring;
+struct rotate_fd;
+struct res_bus *res_bus_new(void);
+void res_bus_add_callback(struct res_bus *bus, res_callback cb, void *arg);
+struct res_ring *res_bus_add_ring(struct res_bus *bus, const size_t capacity);
+void res_bus_add_file(struct res_bus *bus, struct rotate_fd *const *rfd, const int *samples);
+void res_bus_free(struct res_bus *bus);
+void res_event_init(
+    struct res_event *ev, const enum res_kind kind,
+    const unsigned m_id, const char *fp, const char *measurer);
+void res_emit(const struct res_bus *bus, const struct res_event *ev);
+size_t res_ring_poll(struct res_ring *ring, struct res_event out[], const size_t max);
+unsigned long res_ring_dropped(const struct res_ring *ring);
+#endif /* !defined(FF_RESULTS_H) */
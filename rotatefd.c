@@ -6,8 +6,25 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include <glib.h>
 #include "rotatefd.h"
 
+/*
+ * Files that are numbered so that a new one is made each time instead of
+ * overwriting the last, with a symlink at the requested name pointing at the
+ * latest. fname_in is written to fname_in.N for the lowest N not used yet.
+ *
+ * With rfd_set_rotation(), fname_in.N is also rotated while it is being
+ * written to once it gets too big or too old: it is renamed to fname_in.N.K,
+ * for the next K, and a new fname_in.N is started. fname_in.N.K is then
+ * compressed to fname_in.N.K.gz by a background thread. rfd_for_each_segment()
+ * goes through all of them in order, compressed or not.
+ */
+
 /* wrapper around libgen.h's basename because it's stupid. hur dur maybe we
  * modify the given path char *, but maybe we don't. hur dur maybe the returned
  * char * is within the given char *, but maybe it isn't.
@@ -31,12 +48,68 @@ my_basename(const char *path) {
     return ret_2;
 }
 
+// fname_in -> the N its next file will get, so we only look through the
+// directory for the files that are already there once
+static GHashTable *rfd_next_idx;
+static pthread_mutex_t rfd_next_idx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parse the number at the start of s, which must be followed by '\0' or '.'.
+ * Returns -1 if there isn't one. */
+static long
+rfd_parse_idx(const char *s, const char **end) {
+    char *e;
+    if (*s < '0' || *s > '9')
+        return -1;
+    const long idx = strtol(s, &e, 10);
+    if (*e != '\0' && *e != '.')
+        return -1;
+    *end = e;
+    return idx;
+}
+
+/* Look through fname_in's directory once for the numbered files it already
+ * has. Returns the highest N of fname_in.N (or of its segments), or -1 if
+ * there are none. If n is non-negative, *max_seg is set to the highest K of
+ * fname_in.n.K, or -1. */
+static long
+rfd_scan(const char *fname_in, const long n, long *max_seg) {
+    char *copy = strdup(fname_in);
+    char *base = my_basename(fname_in);
+    const size_t base_len = strlen(base);
+    long max_idx = -1;
+    if (max_seg)
+        *max_seg = -1;
+    DIR *dir = opendir(dirname(copy));
+    struct dirent *de;
+    while (dir && (de = readdir(dir))) {
+        const char *end;
+        if (strncmp(de->d_name, base, base_len) || de->d_name[base_len] != '.')
+            continue;
+        const long idx = rfd_parse_idx(de->d_name + base_len + 1, &end);
+        if (idx < 0)
+            continue;
+        if (idx > max_idx)
+            max_idx = idx;
+        if (max_seg && idx == n && *end == '.') {
+            const long seg = rfd_parse_idx(end + 1, &end);
+            if (seg > *max_seg)
+                *max_seg = seg;
+        }
+    }
+    if (dir)
+        closedir(dir);
+    free(base);
+    free(copy);
+    return max_idx;
+}
+
 static struct rotate_fd*
 rfd_init(const char *fname_req, const char *fname, FILE *fd) {
-    struct rotate_fd *rfd = malloc(sizeof(struct rotate_fd));
+    struct rotate_fd *rfd = calloc(1, sizeof(struct rotate_fd));
     rfd->fname_req = strdup(fname_req);
     rfd->fname = strdup(fname);
     rfd->fd = fd;
+    rfd->opened = time(NULL);
     return rfd;
 }
 
@@ -53,31 +126,257 @@ rfd_free(struct rotate_fd *rfd) {
 
 struct rotate_fd*
 rfd_open(const char *fname_in) {
-    // 5 extra: 1 for \0, 1 for '.', and 3 for ints up to 999
+    // 12 extra: 1 for \0, 1 for '.', and 10 for any unsigned
     // exåmple fname_in = /path/to/file.txt
     // could need to store /path/to/file.txt.123 in fname_buf
-    const size_t len = strlen(fname_in) + 5;
+    const size_t len = strlen(fname_in) + 12;
     char *fname_buf = malloc(len);
-    unsigned next = 0;
     FILE *fd;
     struct rotate_fd *rfd;
+    pthread_mutex_lock(&rfd_next_idx_lock);
+    if (!rfd_next_idx)
+        rfd_next_idx = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    gpointer found = g_hash_table_lookup(rfd_next_idx, fname_in);
+    // stored plus one so 0 isn't mistaken for not there
+    unsigned next = found ? GPOINTER_TO_UINT(found) - 1 : rfd_scan(fname_in, -1, NULL) + 1;
+    // something else may have made some since we looked
     do {
         assert(snprintf(fname_buf, len, "%s.%u", fname_in, next) > 0);
-        if (access(fname_buf, F_OK) < 0) {
-            //LOG("Will open %s for %s\n", fname_buf, fname_in);
-            if (!(fd = fopen(fname_buf, "w"))) {
-                LOG("Unable to open file in rfd_open: %s\n", strerror(errno));
+    } while (access(fname_buf, F_OK) == 0 && ++next);
+    g_hash_table_replace(rfd_next_idx, strdup(fname_in), GUINT_TO_POINTER(next + 2));
+    pthread_mutex_unlock(&rfd_next_idx_lock);
+    //LOG("Will open %s for %s\n", fname_buf, fname_in);
+    if (!(fd = fopen(fname_buf, "w"))) {
+        LOG("Unable to open file in rfd_open: %s\n", strerror(errno));
+    }
+    rfd = rfd_init(fname_in, fname_buf, fd);
+    free(fname_buf);
+    return rfd;
+}
+
+/**
+ * Go back to appending to fname, a file made by rfd_open(fname_req) earlier,
+ * such as before a restart. A torn last line, from being killed part way
+ * through writing it, is ended first so it doesn't swallow the next line.
+ * Returns NULL if it can't be opened.
+ */
+struct rotate_fd*
+rfd_reopen(const char *fname_req, const char *fname) {
+    FILE *fd;
+    const char *end;
+    if (!(fd = fopen(fname, "a+"))) {
+        LOG("Unable to reopen %s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+    if (fseek(fd, -1, SEEK_END) == 0) {
+        const int last = fgetc(fd);
+        fseek(fd, 0, SEEK_END);
+        if (last != '\n')
+            fputc('\n', fd);
+    }
+    struct rotate_fd *rfd = rfd_init(fname_req, fname, fd);
+    rfd->bytes = ftell(fd);
+    // carry on numbering its segments where we left off
+    const size_t req_len = strlen(fname_req);
+    long n = -1, max_seg = -1;
+    if (!strncmp(fname, fname_req, req_len) && fname[req_len] == '.')
+        n = rfd_parse_idx(fname + req_len + 1, &end);
+    if (n >= 0)
+        rfd_scan(fname_req, n, &max_seg);
+    rfd->next_seg = max_seg + 1;
+    return rfd;
+}
+
+/**
+ * Rotate rfd once it has had max_bytes written to it, or once it has been
+ * open for max_secs, whichever comes first. 0 for no limit.
+ */
+void
+rfd_set_rotation(struct rotate_fd *rfd, const unsigned long max_bytes, const unsigned max_secs) {
+    rfd->max_bytes = max_bytes;
+    rfd->max_secs = max_secs;
+}
+
+/* Segments waiting to be compressed, and the thread that does it */
+struct rfd_gz_job {
+    char *fname;
+    struct rfd_gz_job *next;
+};
+static struct rfd_gz_job *rfd_gz_head, *rfd_gz_tail;
+static pthread_mutex_t rfd_gz_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rfd_gz_cond = PTHREAD_COND_INITIALIZER;
+static int rfd_gz_started;
+// compressing or queued to be
+static unsigned rfd_gz_pending;
+
+/* Compress fname to fname.gz and remove fname. The .gz is written under
+ * another name first so that it only ever exists complete, and fname is only
+ * removed once it does, so a reader always finds one or the other. */
+static int
+rfd_gz_file(const char *fname) {
+    char *tmp = g_strdup_printf("%s.gz.tmp", fname);
+    char *gz_fname = g_strdup_printf("%s.gz", fname);
+    char buf[READ_BUF_LEN];
+    size_t n;
+    int ok = 0;
+    FILE *in = fopen(fname, "r");
+    gzFile out = in ? gzopen(tmp, "wb") : NULL;
+    if (out) {
+        ok = 1;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (gzwrite(out, buf, n) != (int)n) {
+                ok = 0;
+                break;
             }
-            rfd = rfd_init(fname_in, fname_buf, fd);
-            free(fname_buf);
-            return rfd;
         }
-    } while (++next < 1000);
-    LOG("Unable to open %s because too many exist already\n", fname_in);
-    free(fname_buf);
+        ok &= !ferror(in);
+        ok &= gzclose(out) == Z_OK;
+    }
+    if (in)
+        fclose(in);
+    if (ok && rename(tmp, gz_fname) == 0) {
+        unlink(fname);
+    } else {
+        LOG("Unable to compress %s. Leaving it as it is\n", fname);
+        unlink(tmp);
+        ok = 0;
+    }
+    g_free(tmp);
+    g_free(gz_fname);
+    return ok;
+}
+
+static void *
+rfd_gz_thread(void *arg) {
+    pthread_mutex_lock(&rfd_gz_lock);
+    while (1) {
+        while (!rfd_gz_head)
+            pthread_cond_wait(&rfd_gz_cond, &rfd_gz_lock);
+        struct rfd_gz_job *job = rfd_gz_head;
+        if (!(rfd_gz_head = job->next))
+            rfd_gz_tail = NULL;
+        pthread_mutex_unlock(&rfd_gz_lock);
+        rfd_gz_file(job->fname);
+        free(job->fname);
+        free(job);
+        pthread_mutex_lock(&rfd_gz_lock);
+        rfd_gz_pending--;
+        pthread_cond_broadcast(&rfd_gz_cond);
+    }
     return NULL;
 }
 
+static void
+rfd_gz_later(const char *fname) {
+    struct rfd_gz_job *job = calloc(1, sizeof(struct rfd_gz_job));
+    job->fname = strdup(fname);
+    pthread_mutex_lock(&rfd_gz_lock);
+    if (!rfd_gz_started) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, rfd_gz_thread, NULL) != 0) {
+            pthread_mutex_unlock(&rfd_gz_lock);
+            LOG("Unable to start compression thread. Compressing %s now\n", fname);
+            rfd_gz_file(fname);
+            free(job->fname);
+            free(job);
+            return;
+        }
+        pthread_detach(t);
+        rfd_gz_started = 1;
+    }
+    if (rfd_gz_tail)
+        rfd_gz_tail->next = job;
+    else
+        rfd_gz_head = job;
+    rfd_gz_tail = job;
+    rfd_gz_pending++;
+    pthread_cond_broadcast(&rfd_gz_cond);
+    pthread_mutex_unlock(&rfd_gz_lock);
+}
+
+/**
+ * Wait until every finished segment has been compressed
+ */
+void
+rfd_gz_wait(void) {
+    pthread_mutex_lock(&rfd_gz_lock);
+    while (rfd_gz_pending)
+        pthread_cond_wait(&rfd_gz_cond, &rfd_gz_lock);
+    pthread_mutex_unlock(&rfd_gz_lock);
+}
+
+/* Move what has been written so far to the next segment, to be compressed in
+ * the background, and start writing to fname again from scratch */
+static void
+rfd_rotate(struct rotate_fd *rfd) {
+    char *seg = g_strdup_printf("%s.%u", rfd->fname, rfd->next_seg++);
+    FILE *fd;
+    if (fclose(rfd->fd) < 0) {
+        LOG("Trouble closing rotate_fd fd: %s\n", strerror(errno));
+    }
+    if (rename(rfd->fname, seg) < 0) {
+        LOG("Unable to rotate %s to %s: %s\n", rfd->fname, seg, strerror(errno));
+    } else {
+        LOG("Rotated %s to %s after %lu bytes\n", rfd->fname, seg, rfd->bytes);
+        rfd_gz_later(seg);
+    }
+    if (!(fd = fopen(rfd->fname, "a"))) {
+        LOG("Unable to open file in rfd_rotate: %s\n", strerror(errno));
+    }
+    rfd->fd = fd;
+    rfd->bytes = 0;
+    rfd->opened = time(NULL);
+    g_free(seg);
+}
+
+/**
+ * Note that len more bytes were written to rfd, rotating it if that, or how
+ * long it has been open, is past its limits
+ */
+void
+rfd_wrote(struct rotate_fd *rfd, const size_t len) {
+    rfd->bytes += len;
+    if ((rfd->max_bytes && rfd->bytes >= rfd->max_bytes) ||
+            (rfd->max_secs && time(NULL) - rfd->opened >= rfd->max_secs))
+        rfd_rotate(rfd);
+}
+
+/**
+ * Call cb with each of the files fname has been rotated into, oldest first,
+ * and then fname itself, along with whether it is gzip compressed. fname may
+ * be the symlink rfd_close() leaves at the requested name. Returns the number
+ * of files, or -1 if cb returned nonzero for one.
+ */
+int
+rfd_for_each_segment(const char *fname, int (*cb)(const char *fname, int gz, void *arg), void *arg) {
+    char *real = realpath(fname, NULL);
+    const char *path = real ? real : fname;
+    int count = 0;
+    for (unsigned k = 0;; k++) {
+        char *seg = g_strdup_printf("%s.%u.gz", path, k);
+        int gz = 1;
+        if (access(seg, F_OK) < 0) {
+            // not compressed yet
+            seg[strlen(seg) - 3] = '\0';
+            gz = 0;
+            if (access(seg, F_OK) < 0) {
+                g_free(seg);
+                break;
+            }
+        }
+        const int ret = cb(seg, gz, arg);
+        g_free(seg);
+        if (ret) {
+            free(real);
+            return -1;
+        }
+        count++;
+    }
+    const int ret = cb(path, 0, arg);
+    free(real);
+    return ret ? -1 : count + 1;
+}
+
 void
 rfd_close(struct rotate_fd *rfd) {
     // there's a few file names in play here. let's clear some things up.
@@ -94,15 +393,18 @@ rfd_close(struct rotate_fd *rfd) {
     if (!rfd) return;
     char *target_basename = my_basename(rfd->fname); // must free
     if (rfd->fd >= 0) {
-        // not going to be atomic, sorry
-        if (unlink(rfd->fname_req) < 0) {
-            LOG("Unable to unlink old rotate_fd symlink: %s\n", strerror(errno));
-            // but continue on anyway and hope for the best
-        }
-        if (symlink(target_basename, rfd->fname_req) < 0) {
+        // Make the new symlink next to the old one and rename it over the
+        // old one, so there's always a symlink and it's always whole
+        char *tmp = g_strdup_printf("%s.tmp", rfd->fname_req);
+        unlink(tmp);
+        if (symlink(target_basename, tmp) < 0) {
             LOG("Unable to create new rotate_fd symlink: %s\n", strerror(errno));
             // whelp. shit's fucked yo. keeeep going
+        } else if (rename(tmp, rfd->fname_req) < 0) {
+            LOG("Unable to replace old rotate_fd symlink: %s\n", strerror(errno));
+            unlink(tmp);
         }
+        g_free(tmp);
     }
     if (fclose(rfd->fd) < 0) {
         LOG("Trouble closing rotate_fd fd: %s\n", strerror(errno));
@@ -1,11 +1,26 @@
 #ifndef FF_ROTATEFD_H
 #define FF_ROTATEFD_H
+#include <stdio.h>
+#include <time.h>
 #include "common.h"
 struct rotate_fd {
 	char *fname_req;
 	char *fname;
 	FILE *fd;
+	// written to fd since it was opened or last rotated
+	unsigned long bytes;
+	time_t opened;
+	// rotate when either is reached, unless 0
+	unsigned long max_bytes;
+	unsigned max_secs;
+	// K of the next fname.K to rotate to
+	unsigned next_seg;
 };
 struct rotate_fd *rfd_open(const char *fname_in);
+struct rotate_fd *rfd_reopen(const char *fname_req, const char *fname);
+void rfd_set_rotation(struct rotate_fd *rfd, const unsigned long max_bytes, const unsigned max_secs);
+void rfd_wrote(struct rotate_fd *rfd, const size_t len);
+void rfd_gz_wait(void);
+int rfd_for_each_segment(const char *fname, int (*cb)(const char *fname, int gz, void *arg), void *arg);
 void rfd_close(struct rotate_fd *rfd);
 #endif /* !defined(FF_ROTATEFD_H) */
@@ -0,0 +1,153 @@
+//! Microbenchmarks for parsing schedules and handing hosts to C.
+//!
+//!     cargo bench --features bench [-- num_msms num_hosts]
+//!
+//! Each benchmark is warmed up, run enough times per sample that a sample
+//! takes at least MIN_SAMPLE, and sampled NUM_SAMPLES times. One JSON object
+//! per benchmark is printed to stdout, in the same format as
+//! bench/microbench.c uses for the C side.
+use libc::c_char;
+use sched::bench::{is_fp, parse_line};
+use sched::{sched_free_hosts, sched_get_hosts, sched_load_more, sched_new};
+use std::ffi::CString;
+use std::fs;
+use std::hint::black_box;
+use std::io::Write;
+use std::time::{Duration, Instant};
+
+const MIN_SAMPLE: Duration = Duration::from_millis(20);
+const NUM_SAMPLES: usize = 15;
+const NUM_WARMUP: usize = 3;
+
+fn time_iters<F: FnMut(u64)>(f: &mut F, iters: u64) -> Duration {
+    let start = Instant::now();
+    f(iters);
+    start.elapsed()
+}
+
+/// Time f, which must do its work iters times, and print the results as a
+/// line of JSON
+fn run_bench<F: FnMut(u64)>(name: &str, params: serde_json::Value, mut f: F) {
+    for _ in 0..NUM_WARMUP {
+        time_iters(&mut f, 1);
+    }
+    let mut iters = 1;
+    while time_iters(&mut f, iters) < MIN_SAMPLE {
+        iters *= 2;
+    }
+    let mut samples: Vec<f64> = (0..NUM_SAMPLES)
+        .map(|_| time_iters(&mut f, iters).as_nanos() as f64 / iters as f64)
+        .collect();
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let out = serde_json::json!({
+        "lang": "rust",
+        "bench": name,
+        "params": params,
+        "iters": iters,
+        "ns_per_op": {
+            "median": samples[NUM_SAMPLES / 2],
+            "min": samples[0],
+            "max": samples[NUM_SAMPLES - 1],
+        },
+    });
+    println!("{}", out);
+    std::io::stdout().flush().unwrap();
+}
+
+/// A line of a text schedule for measurement id with num_hosts hosts, the
+/// last of which is bg
+fn sched_line(id: u32, num_hosts: usize) -> String {
+    let host = |h: usize, m: &str, bg: &str| if h == num_hosts - 1 { bg.to_string() } else { m.to_string() };
+    let list = |m: &str, bg: &str| (0..num_hosts).map(|h| host(h, m, bg)).collect::<Vec<_>>().join(",");
+    format!(
+        "{} {:040X} 30 {} {} {} 0",
+        id,
+        id,
+        list("m", "bg"),
+        list("1000", "125000"),
+        list("80", "1")
+    )
+}
+
+fn bench_parse_line(num_hosts: usize) {
+    let lines: Vec<String> = (1..=64).map(|i| sched_line(i, num_hosts)).collect();
+    run_bench("MeasurementSpec::new_from_string", serde_json::json!({ "hosts": num_hosts }), |iters| {
+        for i in 0..iters {
+            black_box(parse_line(black_box(&lines[i as usize % lines.len()])));
+        }
+    });
+}
+
+fn bench_is_fp() {
+    let words: [&[u8]; 3] = [
+        b"0123456789ABCDEF0123456789ABCDEF01234567",
+        b"0123456789ABCDEF",
+        b"0123456789ABCDEF0123456789ABCDEF0123456x",
+    ];
+    run_bench("is_fp", serde_json::json!({ "mix": "valid,short,bad_last" }), |iters| {
+        for i in 0..iters {
+            black_box(is_fp(black_box(words[i as usize % words.len()])));
+        }
+    });
+}
+
+/// Write a schedule of num_msms measurements to a temp file and return its
+/// name
+fn write_sched(num_msms: u32, num_hosts: usize) -> String {
+    let fname = format!("{}/ff-kernels-{}.txt", std::env::temp_dir().display(), std::process::id());
+    let mut f = fs::File::create(&fname).unwrap();
+    for id in 1..=num_msms {
+        writeln!(f, "{}", sched_line(id, num_hosts)).unwrap();
+    }
+    fname
+}
+
+fn load(fname: &CString) {
+    sched_new(fname.as_ptr());
+    while sched_load_more() {}
+}
+
+fn bench_load_txt(fname: &CString, num_msms: u32, num_hosts: usize) {
+    run_bench("load_txt", serde_json::json!({ "msms": num_msms, "hosts": num_hosts }), |iters| {
+        for _ in 0..iters {
+            load(fname);
+        }
+    });
+}
+
+fn bench_hosts_round_trip(fname: &CString, num_msms: u32, num_hosts: usize) {
+    load(fname);
+    let params = serde_json::json!({ "msms": num_msms, "hosts": num_hosts });
+    run_bench("sched_get_hosts+sched_free_hosts", params, |iters| {
+        for i in 0..iters {
+            let mut classes: *mut *mut c_char = std::ptr::null_mut();
+            let mut bws: *mut u32 = std::ptr::null_mut();
+            let mut conns: *mut u32 = std::ptr::null_mut();
+            let id = (i % num_msms as u64) as u32 + 1;
+            let n = sched_get_hosts(id, &mut classes, &mut bws, &mut conns);
+            sched_free_hosts(classes, bws, conns, black_box(n));
+        }
+    });
+}
+
+fn main() {
+    // cargo passes --bench to harness = false benches
+    let args: Vec<String> = std::env::args().skip(1).filter(|a| !a.starts_with("--")).collect();
+    let sizes: Vec<(u32, usize)> = match args.len() {
+        0 => vec![(1000, 3), (100000, 5)],
+        2 => vec![(args[0].parse().expect("num_msms"), args[1].parse().expect("num_hosts"))],
+        _ => panic!("usage: kernels [num_msms num_hosts]"),
+    };
+    bench_is_fp();
+    for num_hosts in [2, 5, 10].iter() {
+        bench_parse_line(*num_hosts);
+    }
+    for (num_msms, num_hosts) in sizes {
+        assert!(num_msms > 0 && num_hosts > 0);
+        let fname = write_sched(num_msms, num_hosts);
+        let cfname = CString::new(fname.clone()).unwrap();
+        bench_load_txt(&cfname, num_msms, num_hosts);
+        bench_hosts_round_trip(&cfname, num_msms, num_hosts);
+        fs::remove_file(&fname).unwrap();
+    }
+}
@@ -0,0 +1,16 @@
+//! Ways in to crate-private code for benches/kernels.rs. Only built with
+//! `--features bench`.
+use super::MeasurementSpec;
+
+/// Parse one line of a text schedule the way the loader does. Returns true if
+/// it was a valid measurement.
+pub fn parse_line(s: &str) -> bool {
+    match MeasurementSpec::new_from_string(s) {
+        Ok(Some(_)) => true,
+        _ => false,
+    }
+}
+
+pub fn is_fp(fp: &[u8]) -> bool {
+    super::is_fp(fp)
+}
@@ -0,0 +1,389 @@
+//! Binary schedule format.
+//!
+//! A text schedule repeats the fingerprint, class names, bandwidths, and conns
+//! on every line. The binary format stores each of those once in a table and
+//! has fixed size measurement records that refer to them by index, so a large
+//! schedule can be mmap'ed and copied into a Sched without parsing or
+//! allocating anything per measurement.
+//!
+//! Everything is little endian. The file starts with a Header. The tables
+//! follow it, each starting on an 8 byte boundary at the offset the header
+//! gives:
+//!
+//! - fps: num_fps 40 byte uppercase hex fingerprints
+//! - classes: num_classes 32 byte NUL padded class names
+//! - hosts: num_hosts HostRec
+//! - msms: num_msms MsmRec, each referring to a run of hosts and of deps
+//! - deps: num_deps u32 measurement IDs (CSR style, indexed by MsmRec)
+use super::{Host, Measurement, Sched, Span, State, FP_LEN};
+use std::collections::HashSet;
+use std::fs::{File, OpenOptions};
+use std::io::{self, BufWriter, Write};
+use std::mem;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+use std::slice;
+
+const MAGIC: [u8; 8] = *b"FFSCHED\0";
+const VERSION: u32 = 1;
+const CLASS_LEN: usize = 32;
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Header {
+    magic: [u8; 8],
+    version: u32,
+    num_fps: u32,
+    num_classes: u32,
+    num_hosts: u32,
+    num_msms: u32,
+    num_deps: u32,
+    fps_off: u64,
+    classes_off: u64,
+    hosts_off: u64,
+    msms_off: u64,
+    deps_off: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct HostRec {
+    class: u32,
+    bw: u32,
+    conns: u32,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct MsmRec {
+    id: u32,
+    fp: u32,
+    dur: u32,
+    host_start: u32,
+    host_len: u32,
+    dep_start: u32,
+    dep_len: u32,
+}
+
+/// A read only mapping of a whole file, unmapped when dropped
+struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+impl Mmap {
+    fn new(file: &File) -> io::Result<Mmap> {
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "empty file"));
+        }
+        let ptr = unsafe {
+            libc::mmap(ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE, file.as_raw_fd(), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        unsafe { libc::madvise(ptr, len, libc::MADV_SEQUENTIAL) };
+        Ok(Mmap { ptr, len })
+    }
+
+    fn bytes(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr, self.len) };
+    }
+}
+
+fn bad(what: &str) -> String {
+    format!("corrupt schedule: {}", what)
+}
+
+/// The count records of type T starting at off, if they are all in buf and
+/// properly aligned
+fn table<'a, T>(buf: &'a [u8], off: u64, count: u32, what: &str) -> Result<&'a [T], String> {
+    let size = (count as u64)
+        .checked_mul(mem::size_of::<T>() as u64)
+        .ok_or_else(|| bad(what))?;
+    let end = off.checked_add(size).ok_or_else(|| bad(what))?;
+    if end > buf.len() as u64 || off % mem::align_of::<T>() as u64 != 0 {
+        return Err(bad(what));
+    }
+    let start = unsafe { buf.as_ptr().add(off as usize) };
+    Ok(unsafe { slice::from_raw_parts(start as *const T, count as usize) })
+}
+
+/// Add the measurements in fname to sched. Its tables are appended to ours
+/// as-is (except for classes, which are looked up by name) so nothing is
+/// parsed or allocated per measurement. Measurement IDs that appear twice in
+/// the file, or that we already have when merging, are skipped. Each
+/// measurement gets the same checks as one from a text schedule, and a file
+/// with one that fails them is rejected as corrupt. Returns the number of
+/// measurements added.
+pub(crate) fn load(sched: &mut Sched, fname: &str, merge: bool) -> Result<usize, String> {
+    if cfg!(target_endian = "big") {
+        return Err("binary schedules are only supported on little endian hosts".to_string());
+    }
+    let file = OpenOptions::new().read(true).open(fname).map_err(|e| e.to_string())?;
+    let map = Mmap::new(&file).map_err(|e| e.to_string())?;
+    let buf = map.bytes();
+    let hdr: Header = table::<Header>(buf, 0, 1, "header")?[0];
+    if hdr.magic != MAGIC {
+        return Err("not a binary schedule".to_string());
+    }
+    if hdr.version != VERSION {
+        return Err(format!("unsupported version {}", hdr.version));
+    }
+    let fps: &[[u8; FP_LEN]] = table(buf, hdr.fps_off, hdr.num_fps, "fps")?;
+    let classes: &[[u8; CLASS_LEN]] = table(buf, hdr.classes_off, hdr.num_classes, "classes")?;
+    let hosts: &[HostRec] = table(buf, hdr.hosts_off, hdr.num_hosts, "hosts")?;
+    let msms: &[MsmRec] = table(buf, hdr.msms_off, hdr.num_msms, "msms")?;
+    let deps: &[u32] = table(buf, hdr.deps_off, hdr.num_deps, "deps")?;
+    // Validate everything before touching sched so a bad file leaves it as
+    // it was
+    if !fps.iter().all(|fp| super::is_fp(fp)) {
+        return Err(bad("invalid fingerprint"));
+    }
+    let mut class_map = Vec::with_capacity(classes.len());
+    for c in classes {
+        let len = c.iter().position(|b| *b == 0).unwrap_or(CLASS_LEN);
+        let name = std::str::from_utf8(&c[..len]).map_err(|_| bad("class name"))?;
+        if name.is_empty() {
+            return Err(bad("empty class name"));
+        }
+        class_map.push(name);
+    }
+    if hosts.iter().any(|h| h.class >= hdr.num_classes) {
+        return Err(bad("host class out of range"));
+    }
+    for m in msms {
+        let in_range = |start: u32, len: u32, max: u32| (start as u64 + len as u64) <= max as u64;
+        if m.id == 0
+            || m.fp >= hdr.num_fps
+            || !in_range(m.host_start, m.host_len, hdr.num_hosts)
+            || !in_range(m.dep_start, m.dep_len, hdr.num_deps)
+        {
+            return Err(bad(&format!("measurement {} out of range", m.id)));
+        }
+        let m_hosts = &hosts[m.host_start as usize..(m.host_start + m.host_len) as usize];
+        let m_deps = &deps[m.dep_start as usize..(m.dep_start + m.dep_len) as usize];
+        super::check_msm(m.id, m_hosts.iter().map(|h| (class_map[h.class as usize], h.bw, h.conns)), m_deps)
+            .map_err(|e| bad(&format!("measurement {}: {}", m.id, e)))?;
+    }
+    let class_map: Vec<u32> = class_map.iter().map(|c| sched.intern_class(c)).collect();
+    let fp_base = sched.fps.len() as u32;
+    let host_base = sched.hosts.len() as u32;
+    let dep_base = sched.deps.len() as u32;
+    sched.fps.extend_from_slice(fps);
+    sched.hosts.extend(hosts.iter().map(|h| Host {
+        class: class_map[h.class as usize],
+        bw: h.bw,
+        conns: h.conns,
+    }));
+    sched.deps.extend_from_slice(deps);
+    sched.msms.reserve(msms.len());
+    let mut seen = HashSet::with_capacity(msms.len());
+    let mut added = 0;
+    for m in msms {
+        if !seen.insert(m.id) {
+            eprintln!("{}: Every measurement must have unique ID. Skipping {}", fname, m.id);
+            continue;
+        }
+        if sched.msms.contains_key(&m.id) {
+            if !merge {
+                panic!("Measurement {} already loaded while not merging", m.id);
+            }
+            continue;
+        }
+        sched.insert(Measurement {
+            id: m.id,
+            fp: fp_base + m.fp,
+            dur: m.dur,
+            state: State::Waiting,
+            hosts: Span { start: host_base + m.host_start, len: m.host_len },
+            depends: Span { start: dep_base + m.dep_start, len: m.dep_len },
+            failsafe_stop: 0,
+            rank: m.dur as u64,
+            fails: Default::default(),
+        });
+        added += 1;
+    }
+    Ok(added)
+}
+
+fn pad_to(out: &mut impl Write, pos: &mut u64, align: u64) -> io::Result<()> {
+    while *pos % align != 0 {
+        out.write_all(&[0])?;
+        *pos += 1;
+    }
+    Ok(())
+}
+
+fn write_raw<T>(out: &mut impl Write, pos: &mut u64, items: &[T]) -> io::Result<()> {
+    let bytes = unsafe {
+        slice::from_raw_parts(items.as_ptr() as *const u8, items.len() * mem::size_of::<T>())
+    };
+    out.write_all(bytes)?;
+    *pos += bytes.len() as u64;
+    Ok(())
+}
+
+/// Write all of sched's measurements to fname in the binary format. The
+/// tables are written as they are, so whatever sharing the text loader found
+/// is kept.
+pub(crate) fn write(sched: &Sched, fname: &str) -> io::Result<()> {
+    if cfg!(target_endian = "big") {
+        return Err(io::Error::new(io::ErrorKind::Other, "binary schedules are only supported on little endian hosts"));
+    }
+    let mut classes = Vec::with_capacity(sched.classes.len());
+    for c in sched.classes.iter() {
+        if c.is_empty() || c.len() > CLASS_LEN || c.contains('\0') {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, format!("class name '{}' can't be stored", c)));
+        }
+        let mut rec = [0u8; CLASS_LEN];
+        rec[..c.len()].copy_from_slice(c.as_bytes());
+        classes.push(rec);
+    }
+    let hosts: Vec<HostRec> = sched
+        .hosts
+        .iter()
+        .map(|h| HostRec { class: h.class, bw: h.bw, conns: h.conns })
+        .collect();
+    // Keep the order stable so the same input gives the same file
+    let mut ids: Vec<u32> = sched.msms.keys().copied().collect();
+    ids.sort_unstable();
+    let msms: Vec<MsmRec> = ids
+        .iter()
+        .map(|id| {
+            let m = &sched.msms[id];
+            MsmRec {
+                id: m.id,
+                fp: m.fp,
+                dur: m.dur,
+                host_start: m.hosts.start,
+                host_len: m.hosts.len,
+                dep_start: m.depends.start,
+                dep_len: m.depends.len,
+            }
+        })
+        .collect();
+    let align8 = |x: u64| (x + 7) & !7;
+    let mut hdr = Header {
+        magic: MAGIC,
+        version: VERSION,
+        num_fps: sched.fps.len() as u32,
+        num_classes: classes.len() as u32,
+        num_hosts: hosts.len() as u32,
+        num_msms: msms.len() as u32,
+        num_deps: sched.deps.len() as u32,
+        ..Default::default()
+    };
+    hdr.fps_off = align8(mem::size_of::<Header>() as u64);
+    hdr.classes_off = align8(hdr.fps_off + (FP_LEN * sched.fps.len()) as u64);
+    hdr.hosts_off = align8(hdr.classes_off + (CLASS_LEN * classes.len()) as u64);
+    hdr.msms_off = align8(hdr.hosts_off + (mem::size_of::<HostRec>() * hosts.len()) as u64);
+    hdr.deps_off = align8(hdr.msms_off + (mem::size_of::<MsmRec>() * msms.len()) as u64);
+    let mut out = BufWriter::new(File::create(fname)?);
+    let mut pos = 0;
+    write_raw(&mut out, &mut pos, &[hdr])?;
+    pad_to(&mut out, &mut pos, 8)?;
+    write_raw(&mut out, &mut pos, &sched.fps)?;
+    pad_to(&mut out, &mut pos, 8)?;
+    write_raw(&mut out, &mut pos, &classes)?;
+    pad_to(&mut out, &mut pos, 8)?;
+    write_raw(&mut out, &mut pos, &hosts)?;
+    pad_to(&mut out, &mut pos, 8)?;
+    write_raw(&mut out, &mut pos, &msms)?;
+    pad_to(&mut out, &mut pos, 8)?;
+    write_raw(&mut out, &mut pos, &sched.deps)?;
+    out.flush()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+
+    const TXT: &str = "\
+1 000000000000000000000000000000000000000A 30 m,m,bg 1000,2000,125000 80,80,1 0
+2 000000000000000000000000000000000000000B 20 m,m,bg 1000,2000,125000 80,80,1 1
+3 000000000000000000000000000000000000000A 30 m2 3000 160 1,2
+";
+
+    fn tmp(name: &str) -> String {
+        std::env::temp_dir()
+            .join(format!("ff-binsched-{}-{}", std::process::id(), name))
+            .to_string_lossy()
+            .into_owned()
+    }
+
+    /// Everything about each measurement, in ID order, with the table
+    /// indexes resolved
+    fn describe(sched: &Sched) -> Vec<(u32, String, u32, Vec<(String, u32, u32)>, Vec<u32>)> {
+        let mut ids: Vec<u32> = sched.msms.keys().copied().collect();
+        ids.sort_unstable();
+        ids.iter()
+            .map(|id| {
+                let m = &sched.msms[id];
+                let hosts = sched.hosts[m.hosts.range()]
+                    .iter()
+                    .map(|h| (sched.classes[h.class as usize].clone(), h.bw, h.conns))
+                    .collect();
+                let fp = String::from_utf8(sched.fps[m.fp as usize].to_vec()).unwrap();
+                (m.id, fp, m.dur, hosts, sched.deps[m.depends.range()].to_vec())
+            })
+            .collect()
+    }
+
+    /// The schedule in TXT, and the name of a .bin file it was written to
+    fn converted(name: &str) -> (Sched, String) {
+        let txt = tmp(&format!("{}.txt", name));
+        let bin = tmp(&format!("{}.bin", name));
+        fs::write(&txt, TXT).unwrap();
+        let mut sched = Sched::default();
+        assert_eq!(sched.start_load(&txt, false), Ok(3));
+        while sched.load_chunk() {}
+        fs::remove_file(&txt).unwrap();
+        write(&sched, &bin).unwrap();
+        (sched, bin)
+    }
+
+    #[test]
+    fn round_trip() {
+        let (orig, bin) = converted("round_trip");
+        let mut loaded = Sched::default();
+        assert_eq!(load(&mut loaded, &bin, false), Ok(3));
+        fs::remove_file(&bin).unwrap();
+        assert_eq!(describe(&loaded), describe(&orig));
+    }
+
+    #[test]
+    fn truncated() {
+        let (_, bin) = converted("truncated");
+        let full = fs::read(&bin).unwrap();
+        for len in [0, 8, mem::size_of::<Header>(), full.len() / 2, full.len() - 1].iter() {
+            fs::write(&bin, &full[..*len]).unwrap();
+            let mut sched = Sched::default();
+            assert!(load(&mut sched, &bin, false).is_err(), "loaded {} of {} bytes", len, full.len());
+            assert!(sched.msms.is_empty());
+        }
+        fs::remove_file(&bin).unwrap();
+    }
+
+    #[test]
+    fn self_depend() {
+        let (mut sched, bin) = converted("self_depend");
+        // 2 depends on 1. Make it depend on itself instead.
+        let deps = sched.msms[&2].depends;
+        sched.deps[deps.start as usize] = 2;
+        write(&sched, &bin).unwrap();
+        let mut loaded = Sched::default();
+        let err = load(&mut loaded, &bin, false).unwrap_err();
+        fs::remove_file(&bin).unwrap();
+        assert!(err.contains("itself"), "{}", err);
+        assert!(loaded.msms.is_empty());
+    }
+}
@@ -0,0 +1,218 @@
+//! Cache of each relay's capacity, as last measured, for sizing its next
+//! measurement.
+//!
+//! A schedule gives every measurement of a relay the same measurers with the
+//! same bw, however fast the relay turned out to be. With the cache, a
+//! measurement of a relay we have measured before only gets as many of its
+//! measurers, with as much bw and as many conns, as it needs for
+//! CAPACITY_FACTOR_PCT percent of the relay's last result. That leaves the
+//! rest of the measurers' capacity for other measurements. The schedule's
+//! hosts are the most a measurement ever gets: a relay that needs more than
+//! them is measured with all of them, as without the cache. Retries always
+//! get all of them too.
+//!
+//! The file is little endian: a header of MAGIC, VERSION, and the number of
+//! records as a u32, then fixed size records sorted by fingerprint, each the
+//! relay's fingerprint as 20 bytes (not 40 hex digits), its bw as a u32, and
+//! when that was learned as a u32. Loading it is one read and no parsing. It
+//! is rewritten next to itself and renamed over the old one when saved.
+use super::{Host, Sched, Span, FP_LEN};
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Write};
+
+const MAGIC: [u8; 8] = *b"FFCAPS\0\0";
+const VERSION: u32 = 1;
+/// Length of a relay fingerprint in bytes
+const FP_BIN_LEN: usize = FP_LEN / 2;
+/// Size of the header and of each record in the file
+const HEADER_LEN: usize = 16;
+const REC_LEN: usize = FP_BIN_LEN + 8;
+/// Give a relay measurers with this many percent of its last result, so a
+/// relay that got faster since is still measured at full speed (and its new
+/// result gets it more next time)
+const CAPACITY_FACTOR_PCT: u64 = 225;
+
+/// What we last learned about one relay
+#[derive(Clone, Copy)]
+struct Capacity {
+    /// Its result, in the same units as the schedule's bws
+    bw: u32,
+    /// When, in seconds since the epoch
+    when: u32,
+}
+
+pub(crate) struct Capacities {
+    fname: String,
+    caps: HashMap<[u8; FP_BIN_LEN], Capacity>,
+    /// Whether caps has changed since it was loaded or saved
+    dirty: bool,
+}
+
+fn bad(fname: &str, what: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, format!("corrupt capacity cache {}: {}", fname, what))
+}
+
+fn u32_at(buf: &[u8], at: usize) -> u32 {
+    let mut b = [0; 4];
+    b.copy_from_slice(&buf[at..at + 4]);
+    u32::from_le_bytes(b)
+}
+
+fn hex_val(c: u8) -> u8 {
+    match c {
+        b'0'..=b'9' => c - b'0',
+        b'a'..=b'f' => c - b'a' + 10,
+        _ => c - b'A' + 10,
+    }
+}
+
+/// The bytes of a (valid) hex fingerprint
+fn fp_bin(fp: &[u8; FP_LEN]) -> [u8; FP_BIN_LEN] {
+    let mut out = [0; FP_BIN_LEN];
+    for (i, b) in out.iter_mut().enumerate() {
+        *b = hex_val(fp[2 * i]) << 4 | hex_val(fp[2 * i + 1]);
+    }
+    out
+}
+
+impl Capacities {
+    /// Load the cache in fname, or start an empty one if there isn't one yet
+    pub(crate) fn open(fname: &str) -> io::Result<Self> {
+        let mut caps = HashMap::new();
+        match fs::read(fname) {
+            Err(ref e) if e.kind() == io::ErrorKind::NotFound => {}
+            Err(e) => return Err(e),
+            Ok(buf) => {
+                if buf.len() < HEADER_LEN || buf[..8] != MAGIC {
+                    return Err(bad(fname, "not a capacity cache"));
+                }
+                if u32_at(&buf, 8) != VERSION {
+                    return Err(bad(fname, &format!("unsupported version {}", u32_at(&buf, 8))));
+                }
+                let num_recs = u32_at(&buf, 12) as usize;
+                if buf.len() != HEADER_LEN + num_recs * REC_LEN {
+                    return Err(bad(fname, "wrong length"));
+                }
+                caps.reserve(num_recs);
+                for rec in buf[HEADER_LEN..].chunks_exact(REC_LEN) {
+                    let mut fp = [0; FP_BIN_LEN];
+                    fp.copy_from_slice(&rec[..FP_BIN_LEN]);
+                    let bw = u32_at(rec, FP_BIN_LEN);
+                    let when = u32_at(rec, FP_BIN_LEN + 4);
+                    caps.insert(fp, Capacity { bw, when });
+                }
+            }
+        }
+        Ok(Capacities { fname: fname.to_string(), caps, dirty: false })
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.caps.len()
+    }
+
+    pub(crate) fn get(&self, fp: &[u8; FP_LEN]) -> Option<u32> {
+        self.caps.get(&fp_bin(fp)).map(|c| c.bw)
+    }
+
+    pub(crate) fn set(&mut self, fp: &[u8; FP_LEN], bw: u64, now: u64) {
+        let cap = Capacity { bw: bw.min(u32::MAX as u64) as u32, when: now.min(u32::MAX as u64) as u32 };
+        self.caps.insert(fp_bin(fp), cap);
+        self.dirty = true;
+    }
+
+    /// Write the cache to its file, if it has changed
+    pub(crate) fn save(&mut self) -> io::Result<()> {
+        if !self.dirty {
+            return Ok(());
+        }
+        let mut fps: Vec<&[u8; FP_BIN_LEN]> = self.caps.keys().collect();
+        fps.sort_unstable();
+        let tmp = format!("{}.tmp", self.fname);
+        {
+            let mut w = BufWriter::new(File::create(&tmp)?);
+            w.write_all(&MAGIC)?;
+            w.write_all(&VERSION.to_le_bytes())?;
+            w.write_all(&(fps.len() as u32).to_le_bytes())?;
+            for fp in fps {
+                let c = &self.caps[fp];
+                w.write_all(fp)?;
+                w.write_all(&c.bw.to_le_bytes())?;
+                w.write_all(&c.when.to_le_bytes())?;
+            }
+            w.into_inner()?.sync_all()?;
+        }
+        fs::rename(&tmp, &self.fname)?;
+        self.dirty = false;
+        Ok(())
+    }
+}
+
+impl Sched {
+    /// The hosts the given measurement, which is about to start, should get
+    /// according to the capacity cache, if they differ from the schedule's.
+    /// The schedule's non-bg hosts are taken in order until they have enough
+    /// bw between them, and their bw (and conns along with it) scaled down
+    /// so they have just enough. The bg host, if any, is kept as is.
+    pub(crate) fn sized_hosts(&mut self, id: u32) -> Option<Span> {
+        let m = &self.msms[&id];
+        if m.attempts() > 0 {
+            return None;
+        }
+        let cap = self.capacity.as_ref()?.get(&self.fps[m.fp as usize])?;
+        if cap == 0 {
+            // no more to go on than not knowing it at all
+            return None;
+        }
+        let target = (cap as u64 * CAPACITY_FACTOR_PCT / 100).max(1);
+        let hosts = &self.hosts[m.hosts.range()];
+        let is_bg = |h: &Host| self.classes[h.class as usize] == "bg";
+        let mut num = 0;
+        let mut sum = 0;
+        for h in hosts.iter().filter(|h| !is_bg(h)) {
+            if sum >= target {
+                break;
+            }
+            num += 1;
+            sum += h.bw as u64;
+        }
+        if sum < target {
+            return None;
+        }
+        let mut sized = Vec::with_capacity(hosts.len());
+        let mut taken = 0;
+        for h in hosts {
+            if is_bg(h) {
+                sized.push(*h);
+                continue;
+            }
+            if taken == num {
+                continue;
+            }
+            taken += 1;
+            let bw = ((h.bw as u64 * target + sum - 1) / sum).max(1);
+            let conns = match h.bw {
+                0 => h.conns as u64,
+                _ => ((h.conns as u64 * bw + h.bw as u64 - 1) / h.bw as u64).max(1),
+            };
+            sized.push(Host { class: h.class, bw: bw as u32, conns: conns as u32 });
+        }
+        if sized[..] == *hosts {
+            return None;
+        }
+        Some(self.store_hosts(sized))
+    }
+
+    /// Remember the result of the given measurement, which succeeded, as its
+    /// relay's capacity
+    pub(crate) fn learn_capacity(&mut self, id: u32, bw: u64) {
+        let now = self.now();
+        let fp = match self.msms.get(&id) {
+            Some(m) => self.fps[m.fp as usize],
+            None => return,
+        };
+        if let Some(c) = self.capacity.as_mut() {
+            c.set(&fp, bw, now);
+        }
+    }
+}
@@ -0,0 +1,441 @@
+//! Journal of schedule progress, so a coordinator that is restarted partway
+//! through a long schedule can pick up where it left off.
+//!
+//! The journal is a text file with one record per line, appended to as
+//! measurements change state:
+//!
+//! - `sched <size> <mtime> <fname>`: the schedule file, as it was when it was
+//!   last loaded
+//! - `out <fname>`: results are being written to fname
+//! - `start <id> <fp>`: the measurement was started
+//! - `retry <id> <reason>`: it failed for a SCHED_FAIL_* reason and will be
+//!   retried
+//! - `done <id>`: it finished successfully
+//! - `failed <id>`: it failed for good
+//!
+//! Each record is written with a single write() so it costs about as much as
+//! the measurement's results do. When the file has grown to several times the
+//! number of measurements it knows about, it is rewritten with just the latest
+//! state of each. A torn last line from being killed mid-write is skipped.
+//!
+//! On reopening, finished measurements are finished again as they are loaded,
+//! so they and what depends on them are handled as if they had just
+//! finished. Ones that were started but never finished are interrupted: they
+//! are left Waiting to run again, and handed to C once so it can discard
+//! whatever results the interrupted attempt wrote. Their `start` records are
+//! kept until C has had all of them, so being killed again before then
+//! doesn't lose that they need discarding.
+//!
+//! Measurement IDs only mean something within one schedule, and JSON
+//! schedules always number them from 1. A journal for a different schedule
+//! file, or for one that changed while the coordinator wasn't running, is
+//! moved aside to `<fname>.old` and a new one started.
+use super::{Sched, State, FP_LEN, NUM_FAIL_REASONS};
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufRead, BufReader, BufWriter, Write};
+use std::time::SystemTime;
+
+/// Rewrite the journal once it has this many more records than twice the
+/// number of measurements in it
+const COMPACT_SLACK: usize = 4096;
+
+/// The latest state of one measurement, as far as the journal knows
+struct Entry {
+    state: State,
+    fails: [u8; NUM_FAIL_REASONS],
+    /// While InProgress
+    fp: Option<[u8; FP_LEN]>,
+}
+
+impl Default for Entry {
+    fn default() -> Self {
+        Entry { state: State::Waiting, fails: [0; NUM_FAIL_REASONS], fp: None }
+    }
+}
+
+/// How the journal tells schedule files apart: "<size> <mtime> <fname>"
+pub(crate) fn sched_ident(fname: &str) -> String {
+    let (size, mtime) = match fs::metadata(fname) {
+        Ok(md) => (
+            md.len(),
+            md.modified()
+                .ok()
+                .and_then(|t| t.duration_since(SystemTime::UNIX_EPOCH).ok())
+                .map_or(0, |d| d.as_secs()),
+        ),
+        Err(_) => (0, 0),
+    };
+    format!("{} {} {}", size, mtime, fname)
+}
+
+/// What the records in a journal add up to
+#[derive(Default)]
+struct Progress {
+    entries: HashMap<u32, Entry>,
+    /// From the last `sched` record
+    sched: Option<String>,
+    /// From the last `out` record
+    output: Option<String>,
+}
+
+pub(crate) struct Journal {
+    fname: String,
+    file: File,
+    progress: Progress,
+    /// Records in the file
+    num_records: usize,
+    /// Measurements that were InProgress when the journal was opened:
+    /// (ID, fp, the attempt that was interrupted), highest ID first
+    interrupted: Vec<(u32, [u8; FP_LEN], u32)>,
+    /// The file still has the start records of the interrupted measurements,
+    /// and mustn't be compacted until C has had all of them
+    keep_interrupted: bool,
+}
+
+impl Journal {
+    /// Open the journal at fname for the schedule sched (from sched_ident()),
+    /// reading whatever is in it already, or start a new one if there isn't
+    /// one or it is for a different schedule
+    pub(crate) fn open(fname: &str, sched: &str) -> io::Result<Self> {
+        let mut p = Progress::default();
+        let mut num_records = 0;
+        let mut bad = 0;
+        if let Ok(file) = File::open(fname) {
+            for line in BufReader::new(file).lines() {
+                num_records += 1;
+                match line {
+                    Ok(line) if apply(&mut p, &line) => {}
+                    _ => bad += 1,
+                }
+            }
+        }
+        if bad > 0 {
+            eprintln!("{}: skipped {} bad records", fname, bad);
+        }
+        if num_records > 0 && p.sched.as_deref() != Some(sched) {
+            let old = format!("{}.old", fname);
+            eprintln!(
+                "{} is for schedule '{}', not '{}'. Moving it to {} and starting over",
+                fname,
+                p.sched.as_deref().unwrap_or("(unknown)"),
+                sched,
+                old
+            );
+            fs::rename(fname, &old)?;
+            p = Progress::default();
+        }
+        p.sched = Some(sched.to_string());
+        let mut interrupted: Vec<(u32, [u8; FP_LEN], u32)> = p
+            .entries
+            .iter()
+            .filter(|(_, e)| e.state == State::InProgress)
+            .map(|(id, e)| (*id, e.fp.unwrap(), e.fails.iter().map(|f| *f as u32).sum::<u32>() + 1))
+            .collect();
+        // popped from the end, so lowest ID first
+        interrupted.sort_unstable_by_key(|i| std::cmp::Reverse(i.0));
+        for (id, _, _) in &interrupted {
+            let e = p.entries.get_mut(id).unwrap();
+            e.state = State::Waiting;
+            e.fp = None;
+        }
+        let file = OpenOptions::new().append(true).create(true).open(fname)?;
+        let keep_interrupted = !interrupted.is_empty();
+        let mut j = Journal {
+            fname: fname.to_string(),
+            file,
+            progress: p,
+            num_records,
+            interrupted,
+            keep_interrupted,
+        };
+        // start from a clean file that says which schedule it is for. With
+        // interrupted measurements it already does, and is compacted once
+        // they have been popped.
+        if !keep_interrupted {
+            j.compact()?;
+        }
+        Ok(j)
+    }
+
+    pub(crate) fn num_finished(&self) -> usize {
+        self.progress
+            .entries
+            .values()
+            .filter(|e| e.state == State::Complete || e.state == State::Failed)
+            .count()
+    }
+
+    pub(crate) fn output(&self) -> Option<&str> {
+        self.progress.output.as_deref()
+    }
+
+    pub(crate) fn sched(&self) -> Option<&str> {
+        self.progress.sched.as_deref()
+    }
+
+    /// The next interrupted measurement. Once there are none left, which
+    /// means the caller is done with the last one, the journal forgets they
+    /// were ever started.
+    pub(crate) fn pop_interrupted(&mut self) -> Option<(u32, [u8; FP_LEN], u32)> {
+        let next = self.interrupted.pop();
+        if next.is_none() && self.keep_interrupted {
+            self.keep_interrupted = false;
+            if let Err(e) = self.compact() {
+                eprintln!("Could not compact journal {}: {}", self.fname, e);
+            }
+        }
+        next
+    }
+
+    /// What the journal says about the given measurement: whether it is
+    /// finished (Complete or Failed, otherwise Waiting) and how many times it
+    /// has failed for each reason
+    pub(crate) fn get(&self, id: u32) -> Option<(&State, [u8; NUM_FAIL_REASONS])> {
+        self.progress.entries.get(&id).map(|e| (&e.state, e.fails))
+    }
+
+    pub(crate) fn ids(&self) -> Vec<u32> {
+        self.progress.entries.keys().copied().collect()
+    }
+
+    /// Add a record. Errors are reported but otherwise ignored: losing the
+    /// journal only costs redoing measurements after a restart.
+    pub(crate) fn record(&mut self, rec: String) {
+        let ok = apply(&mut self.progress, &rec);
+        assert!(ok, "Made a bad journal record '{}'", rec);
+        if let Err(e) = self.file.write_all(format!("{}\n", rec).as_bytes()) {
+            eprintln!("Could not write to journal {}: {}", self.fname, e);
+        }
+        self.num_records += 1;
+        if !self.keep_interrupted && self.num_records > 2 * self.progress.entries.len() + COMPACT_SLACK {
+            if let Err(e) = self.compact() {
+                eprintln!("Could not compact journal {}: {}", self.fname, e);
+            }
+        }
+    }
+
+    /// Replace the file with one holding just the latest state of each
+    /// measurement. The new file is written next to it and renamed over it,
+    /// so there is always a whole journal on disk.
+    fn compact(&mut self) -> io::Result<()> {
+        let tmp = format!("{}.tmp", self.fname);
+        let mut num_records = 0;
+        {
+            let mut w = BufWriter::new(File::create(&tmp)?);
+            if let Some(sched) = &self.progress.sched {
+                writeln!(w, "sched {}", sched)?;
+                num_records += 1;
+            }
+            if let Some(out) = &self.progress.output {
+                writeln!(w, "out {}", out)?;
+                num_records += 1;
+            }
+            let mut ids: Vec<&u32> = self.progress.entries.keys().collect();
+            ids.sort_unstable();
+            for id in ids {
+                let e = &self.progress.entries[id];
+                for (reason, fails) in e.fails.iter().enumerate() {
+                    for _ in 0..*fails {
+                        writeln!(w, "retry {} {}", id, reason)?;
+                        num_records += 1;
+                    }
+                }
+                match e.state {
+                    State::Waiting => continue,
+                    State::InProgress => {
+                        writeln!(w, "start {} {}", id, String::from_utf8_lossy(&e.fp.unwrap()))?
+                    }
+                    State::Complete => writeln!(w, "done {}", id)?,
+                    State::Failed => writeln!(w, "failed {}", id)?,
+                }
+                num_records += 1;
+            }
+            w.into_inner()?.sync_all()?;
+        }
+        fs::rename(&tmp, &self.fname)?;
+        self.file = OpenOptions::new().append(true).open(&self.fname)?;
+        self.num_records = num_records;
+        Ok(())
+    }
+}
+
+/// Update p for one record. Returns false if it is malformed.
+fn apply(p: &mut Progress, rec: &str) -> bool {
+    let mut words = rec.split(' ');
+    let kind = words.next().unwrap_or("");
+    if kind == "out" || kind == "sched" {
+        let arg = rec[kind.len()..].trim_start();
+        if arg.is_empty() || (kind == "sched" && arg.splitn(3, ' ').count() < 3) {
+            return false;
+        }
+        *(if kind == "out" { &mut p.output } else { &mut p.sched }) = Some(arg.to_string());
+        return true;
+    }
+    let entries = &mut p.entries;
+    let id: u32 = match words.next().map(|w| w.parse()) {
+        Some(Ok(id)) if id > 0 => id,
+        _ => return false,
+    };
+    let arg = words.next();
+    if words.next().is_some() {
+        return false;
+    }
+    match (kind, arg) {
+        ("start", Some(fp)) if fp.len() == FP_LEN => {
+            let mut buf = [0; FP_LEN];
+            buf.copy_from_slice(fp.as_bytes());
+            let e = entries.entry(id).or_default();
+            e.state = State::InProgress;
+            e.fp = Some(buf);
+        }
+        ("retry", Some(reason)) => {
+            let reason: usize = match reason.parse() {
+                Ok(r) if r < NUM_FAIL_REASONS => r,
+                _ => return false,
+            };
+            let e = entries.entry(id).or_default();
+            e.state = State::Waiting;
+            e.fails[reason] = e.fails[reason].saturating_add(1);
+            e.fp = None;
+        }
+        ("done", None) | ("failed", None) => {
+            let e = entries.entry(id).or_default();
+            e.state = if kind == "done" { State::Complete } else { State::Failed };
+            e.fp = None;
+        }
+        _ => return false,
+    }
+    true
+}
+
+impl Sched {
+    /// Bring a measurement that was just loaded up to date with the journal
+    pub(crate) fn restore(&mut self, id: u32) {
+        let (state, fails) = match self.journal.as_ref().and_then(|j| j.get(id)) {
+            Some((state, fails)) => (
+                match state {
+                    State::Complete => State::Complete,
+                    State::Failed => State::Failed,
+                    _ => State::Waiting,
+                },
+                fails,
+            ),
+            None => return,
+        };
+        let m = match self.msms.get_mut(&id) {
+            Some(m) if m.state == State::Waiting => m,
+            _ => return,
+        };
+        m.fails = fails;
+        match state {
+            State::Complete => {
+                m.state = State::Complete;
+                self.num_complete += 1;
+                self.release_dependents(id, false);
+            }
+            State::Failed => {
+                m.state = State::Failed;
+                self.num_failed += 1;
+                self.release_dependents(id, self.config.require_success);
+            }
+            _ => {}
+        }
+    }
+
+    pub(crate) fn journal(&mut self, rec: String) {
+        if let Some(j) = self.journal.as_mut() {
+            j.record(rec);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const SCHED: &str = "3258 1600000000 fps.txt";
+    const FP: &str = "000000000000000000000000000000000000000A";
+
+    fn tmp(name: &str) -> String {
+        std::env::temp_dir()
+            .join(format!("ff-journal-{}-{}", std::process::id(), name))
+            .to_string_lossy()
+            .into_owned()
+    }
+
+    fn cleanup(fname: &str) {
+        for f in &[fname.to_string(), format!("{}.old", fname), format!("{}.tmp", fname)] {
+            let _ = fs::remove_file(f);
+        }
+    }
+
+    #[test]
+    fn reopen() {
+        let fname = tmp("reopen");
+        cleanup(&fname);
+        {
+            let mut j = Journal::open(&fname, SCHED).unwrap();
+            j.record("out o.msm.0".to_string());
+            j.record(format!("start 1 {}", FP));
+            j.record("done 1".to_string());
+            j.record(format!("start 2 {}", FP));
+            j.record("retry 2 1".to_string());
+            j.record("failed 3".to_string());
+            for id in &[9, 4, 7] {
+                j.record(format!("start {} {}", id, FP));
+            }
+        }
+        // killed part way through writing a record
+        let mut f = OpenOptions::new().append(true).open(&fname).unwrap();
+        f.write_all(b"start 5 0000").unwrap();
+        drop(f);
+        let mut fails = [0; NUM_FAIL_REASONS];
+        fails[1] = 1;
+        for pass in 0..3 {
+            let mut j = Journal::open(&fname, SCHED).unwrap();
+            assert_eq!(j.sched(), Some(SCHED));
+            assert_eq!(j.output(), Some("o.msm.0"));
+            assert_eq!(j.get(1), Some((&State::Complete, [0; NUM_FAIL_REASONS])));
+            assert_eq!(j.get(2), Some((&State::Waiting, fails)));
+            assert_eq!(j.get(3), Some((&State::Failed, [0; NUM_FAIL_REASONS])));
+            assert_eq!(j.get(5), None);
+            assert_eq!(j.num_finished(), 2);
+            if pass == 0 {
+                // killed again before taking the interrupted ones
+                assert!(j.pop_interrupted().is_some());
+                continue;
+            }
+            let mut interrupted = vec![];
+            while let Some((id, fp, attempt)) = j.pop_interrupted() {
+                assert_eq!(&fp[..], FP.as_bytes());
+                assert_eq!(attempt, 1);
+                interrupted.push(id);
+            }
+            // interrupted until they have all been taken: then the journal
+            // is rewritten without them, so they are run from scratch
+            if pass == 2 {
+                assert!(interrupted.is_empty());
+                assert_eq!(j.get(4), None);
+            } else {
+                assert_eq!(interrupted, vec![4, 7, 9]);
+            }
+        }
+        cleanup(&fname);
+    }
+
+    #[test]
+    fn other_sched() {
+        let fname = tmp("other_sched");
+        cleanup(&fname);
+        {
+            let mut j = Journal::open(&fname, SCHED).unwrap();
+            j.record("done 1".to_string());
+        }
+        let j = Journal::open(&fname, "3258 1600000001 fps.txt").unwrap();
+        assert_eq!(j.get(1), None);
+        assert_eq!(j.num_finished(), 0);
+        assert!(fs::metadata(format!("{}.old", fname)).is_ok());
+        cleanup(&fname);
+    }
+}
@@ -0,0 +1,178 @@
+//! JSON schedules, as output by our planner.
+//!
+//! The file is a list of sets. Each set maps relay fingerprints to the
+//! bandwidth, in bits/second, each class of measurer should use on that relay:
+//!
+//! ```text
+//! [ {"<fp>": {"<class>": <bw>, ...}, ...}, ... ]
+//! ```
+//!
+//! Each set is a wave: its measurements can't start until every measurement
+//! in the previous set is done. Measurements are given IDs counting up from 1
+//! in the order they appear, so reading the same file again gives the same
+//! IDs. The file is parsed as a stream straight into the Sched without ever
+//! holding the whole thing in memory.
+use super::{MeasurementSpec, Sched};
+use serde::de::{DeserializeSeed, Deserializer, MapAccess, SeqAccess, Visitor};
+use std::fmt;
+use std::fs::OpenOptions;
+use std::io::BufReader;
+
+/// Every measurement in a JSON schedule lasts this many seconds
+const DUR: u32 = 30;
+/// Connections to split evenly across a measurement's non-bg measurers
+const TOTAL_CONNS: u32 = 160;
+
+/// How many conns each of the given classes should open. bg always gets 1 and
+/// the rest split TOTAL_CONNS, rounding up so they get at least that many in
+/// total.
+fn split_conns(classes: &[String]) -> Vec<u32> {
+    let num_non_bg = classes.iter().filter(|c| *c != "bg").count().max(1) as u32;
+    let conn = (TOTAL_CONNS + num_non_bg - 1) / num_non_bg;
+    classes.iter().map(|c| if c == "bg" { 1 } else { conn }).collect()
+}
+
+struct JsonLoad<'a> {
+    sched: &'a mut Sched,
+    fname: &'a str,
+    next_id: u32,
+    /// The measurements in the previous wave, which everything in this one
+    /// depends on
+    prev_wave: Vec<u32>,
+    waves: usize,
+    added: usize,
+    bad: usize,
+}
+
+impl<'a> JsonLoad<'a> {
+    /// Add a whole wave of measurements, all of which share the same depends
+    fn wave<'de, A: MapAccess<'de>>(&mut self, mut map: A) -> Result<(), A::Error> {
+        let depends = self.sched.store_deps(self.prev_wave.clone());
+        let mut this_wave = vec![];
+        while let Some(fp) = map.next_key::<String>()? {
+            let ClassBws(class_bws) = map.next_value()?;
+            let id = self.next_id;
+            self.next_id += 1;
+            if self.sched.msms.contains_key(&id) {
+                // merging, and we already have it
+                this_wave.push(id);
+                continue;
+            }
+            let classes: Vec<String> = class_bws.iter().map(|(c, _)| c.clone()).collect();
+            let hosts = class_bws
+                .into_iter()
+                .zip(split_conns(&classes))
+                .map(|((class, bw), conns)| (class, (bw / 8.0).round() as u32, conns))
+                .collect();
+            // Leave depends empty so we don't copy the previous wave for
+            // every measurement in this one. We already stored it above.
+            match MeasurementSpec::new(id, fp, DUR, hosts, vec![]) {
+                Ok(spec) => {
+                    self.sched.insert_spec_with_deps(spec, depends);
+                    this_wave.push(id);
+                    self.added += 1;
+                }
+                Err(e) => {
+                    eprintln!("{}: measurement {}: {}. Skipping it", self.fname, id, e);
+                    self.bad += 1;
+                }
+            }
+        }
+        // A wave with nothing in it doesn't hold anything up
+        if !this_wave.is_empty() {
+            self.prev_wave = this_wave;
+            self.waves += 1;
+        }
+        Ok(())
+    }
+}
+
+/// The list of waves
+struct Waves<'l, 'a>(&'l mut JsonLoad<'a>);
+
+impl<'de, 'l, 'a> DeserializeSeed<'de> for Waves<'l, 'a> {
+    type Value = ();
+    fn deserialize<D: Deserializer<'de>>(self, d: D) -> Result<(), D::Error> {
+        d.deserialize_seq(self)
+    }
+}
+
+impl<'de, 'l, 'a> Visitor<'de> for Waves<'l, 'a> {
+    type Value = ();
+    fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str("a list of sets of fingerprints")
+    }
+    fn visit_seq<A: SeqAccess<'de>>(self, mut seq: A) -> Result<(), A::Error> {
+        while seq.next_element_seed(Wave(&mut *self.0))?.is_some() {}
+        Ok(())
+    }
+}
+
+/// One set of fingerprints
+struct Wave<'l, 'a>(&'l mut JsonLoad<'a>);
+
+impl<'de, 'l, 'a> DeserializeSeed<'de> for Wave<'l, 'a> {
+    type Value = ();
+    fn deserialize<D: Deserializer<'de>>(self, d: D) -> Result<(), D::Error> {
+        d.deserialize_map(self)
+    }
+}
+
+impl<'de, 'l, 'a> Visitor<'de> for Wave<'l, 'a> {
+    type Value = ();
+    fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str("a map from fingerprint to class bandwidths")
+    }
+    fn visit_map<A: MapAccess<'de>>(self, map: A) -> Result<(), A::Error> {
+        self.0.wave(map)
+    }
+}
+
+/// The classes measuring one relay and their bandwidths, in the order given
+struct ClassBws(Vec<(String, f64)>);
+
+impl<'de> serde::Deserialize<'de> for ClassBws {
+    fn deserialize<D: Deserializer<'de>>(d: D) -> Result<Self, D::Error> {
+        struct V;
+        impl<'de> Visitor<'de> for V {
+            type Value = ClassBws;
+            fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+                f.write_str("a map from class to bandwidth")
+            }
+            fn visit_map<A: MapAccess<'de>>(self, mut map: A) -> Result<ClassBws, A::Error> {
+                let mut v = vec![];
+                while let Some(entry) = map.next_entry()? {
+                    v.push(entry);
+                }
+                Ok(ClassBws(v))
+            }
+        }
+        d.deserialize_map(V)
+    }
+}
+
+/// Add the measurements in the JSON schedule fname to sched, skipping ones we
+/// already have and ones that don't make sense. If the file is malformed part
+/// way through, what came before is kept. Returns the number of measurements
+/// added, or an error if fname can't be opened.
+pub(crate) fn load(sched: &mut Sched, fname: &str) -> Result<usize, String> {
+    let file = OpenOptions::new()
+        .read(true)
+        .open(fname)
+        .map_err(|e| format!("Could not open {}: {}", fname, e))?;
+    let mut load = JsonLoad {
+        sched,
+        fname,
+        next_id: 1,
+        prev_wave: vec![],
+        waves: 0,
+        added: 0,
+        bad: 0,
+    };
+    let mut de = serde_json::Deserializer::from_reader(BufReader::new(file));
+    if let Err(e) = Waves(&mut load).deserialize(&mut de).and_then(|_| de.end()) {
+        eprintln!("{}: {}. Keeping what came before it", fname, e);
+    }
+    eprintln!("Read {} measurements in {} waves from {}, {} bad", load.next_id - 1, load.waves, fname, load.bad);
+    Ok(load.added)
+}
@@ -3,81 +3,358 @@ extern crate serde;
 #[macro_use]
 extern crate lazy_static;
 
+#[cfg(feature = "bench")]
+pub mod bench;
+mod binsched;
+mod capacity;
+mod journal;
+mod jsonsched;
+
 use libc::c_char;
 use serde::{Deserialize, Serialize};
-use std::collections::hash_map::RandomState;
-use std::collections::{HashMap, HashSet};
+use std::cmp::{Ordering, Reverse};
+use std::cell::Cell;
+use std::collections::{BinaryHeap, HashMap, HashSet, VecDeque};
 use std::ffi::{CStr, CString};
-use std::fs::OpenOptions;
-use std::io::{BufRead, BufReader};
-use std::iter::FromIterator;
+use std::fs::{File, OpenOptions};
+use std::io::{BufRead, BufReader, Lines};
 use std::mem;
+use std::ops::Range;
+use std::ptr;
 use std::sync::Mutex;
 use std::time::SystemTime;
 
+/// How many lines of a schedule to parse each time we load more of it
+const LOAD_CHUNK_LINES: usize = 10000;
+/// Length of a relay fingerprint in hex
+const FP_LEN: usize = 40;
+/// How many ready measurements with the same critical path rank to look
+/// through when picking the one whose measurer classes are least busy
+const TIE_WINDOW: usize = 32;
+
+/// Start the ready measurement with the longest chain of measurements
+/// waiting on it first
+pub const SCHED_POLICY_CRITICAL_PATH: u32 = 0;
+/// Start ready measurements in the order they became ready
+pub const SCHED_POLICY_FIFO: u32 = 1;
+
+/// Why a measurement failed, for sched_mark_failed(). Not enough measurers
+/// could be had.
+pub const SCHED_FAIL_NO_MEASURERS: u32 = 0;
+/// A measurer failed while setting up and couldn't be replaced
+pub const SCHED_FAIL_SETUP: u32 = 1;
+/// Something went wrong with the results while measuring
+pub const SCHED_FAIL_MEASURE: u32 = 2;
+/// It went past its failsafe stop, or nothing happened for too long
+pub const SCHED_FAIL_TIMEOUT: u32 = 3;
+const NUM_FAIL_REASONS: usize = 4;
+/// How many times a measurement is retried after failing for each reason,
+/// unless changed with sched_set_retry_limit(). Failing for lack of measurers
+/// wastes nothing and is likely to go away, while a measurement that timed
+/// out probably will again.
+const DEFAULT_RETRY_LIMITS: [u32; NUM_FAIL_REASONS] = [5, 3, 2, 1];
+/// Wait this long before the first retry, doubling for each one after, up to
+/// RETRY_BACKOFF_MAX_SECS
+const RETRY_BACKOFF_SECS: u64 = 10;
+const RETRY_BACKOFF_MAX_SECS: u64 = 600;
+
+/// A schedule of its own, so more than one coordinator can run in a process.
+/// The sched_* functions work on whichever one sched_ctx_use() last picked on
+/// the calling thread, or on a schedule shared by everything else that hasn't
+/// picked one.
+pub struct SchedCtx(Mutex<Sched>);
+
 lazy_static! {
-    static ref MSMS: Mutex<HashMap<u32, Measurement>> = Mutex::new(HashMap::new());
+    static ref MSMS: SchedCtx = SchedCtx(Mutex::new(Sched::default()));
+}
+
+thread_local! {
+    static CURRENT: Cell<*const SchedCtx> = Cell::new(ptr::null());
+}
+
+/// The schedule the calling thread is working on
+fn msms() -> &'static Mutex<Sched> {
+    let cur = CURRENT.with(|c| c.get());
+    if cur.is_null() {
+        &MSMS.0
+    } else {
+        // sched_ctx_free() stops it being used before freeing it
+        unsafe { &(*cur).0 }
+    }
+}
+
+/// All the measurements we know about, plus what we need to quickly find the
+/// next one that can start and to keep loading a large schedule a bit at a
+/// time.
+///
+/// Measurements don't own their fingerprint, hosts, or depends. Those live in
+/// the tables here and measurements refer to them by index. Lots of
+/// measurements share the same relay, the same set of hosts, or the same
+/// depends, so each is only stored once.
+#[derive(Default)]
+struct Sched {
+    msms: HashMap<u32, Measurement>,
+    config: Config,
+    /// IDs of Waiting measurements whose depends are all finished, with
+    /// SCHED_POLICY_FIFO. May contain IDs that are no longer Waiting; skip
+    /// those.
+    ready: VecDeque<u32>,
+    /// The same, with SCHED_POLICY_CRITICAL_PATH
+    ready_by_rank: BinaryHeap<Ready>,
+    /// Class index -> how many InProgress measurements use that class
+    class_busy: Vec<u32>,
+    /// Measurements waiting to be retried, by when they may be
+    retries: BinaryHeap<Reverse<(u64, u32)>>,
+    /// Measurement ID -> the measurers ("host:port") it failed with, which
+    /// it should avoid when retried
+    avoid: HashMap<u32, Vec<String>>,
+    /// Measurement ID -> indexes into groups of the DepGroups that depend on
+    /// it. The key may not be loaded yet.
+    dependents: HashMap<u32, Vec<u32>>,
+    groups: Vec<DepGroup>,
+    /// Depends -> index into groups of the live DepGroup for them
+    group_index: HashMap<Span, u32>,
+    num_complete: usize,
+    num_failed: usize,
+    loader: Option<Loader>,
+    fps: Vec<[u8; FP_LEN]>,
+    classes: Vec<String>,
+    hosts: Vec<Host>,
+    deps: Vec<u32>,
+    /// Reverse lookups so we can reuse existing table entries. Entries loaded
+    /// from a binary schedule aren't in these, so they won't be reused by
+    /// measurements added later from a text schedule.
+    fp_index: HashMap<[u8; FP_LEN], u32>,
+    class_index: HashMap<String, u32>,
+    host_lists: HashMap<Vec<Host>, Span>,
+    dep_lists: HashMap<Vec<u32>, Span>,
+    /// Where progress is saved, kept across sched_new()
+    journal: Option<journal::Journal>,
+    /// The schedule file, as journal::sched_ident() identifies it, as of the
+    /// last time it was loaded
+    source: Option<String>,
+    /// Relays' last results, for sizing their measurements. Kept across
+    /// sched_new().
+    capacity: Option<capacity::Capacities>,
+    /// Measurement ID -> the hosts it was started with, for InProgress
+    /// measurements the capacity cache gave different hosts than the
+    /// schedule did
+    sized: HashMap<u32, Span>,
+}
+
+/// Settings from C, kept across sched_new()
+#[derive(Clone)]
+struct Config {
+    policy: u32,
+    retry_limits: [u32; NUM_FAIL_REASONS],
+    /// Whether a measurement that fails for good fails everything that
+    /// depends on it, instead of letting it run anyway
+    require_success: bool,
+    /// Unix time to use instead of the system clock
+    now: Option<u64>,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            policy: SCHED_POLICY_CRITICAL_PATH,
+            retry_limits: DEFAULT_RETRY_LIMITS,
+            require_success: false,
+            now: None,
+        }
+    }
+}
+
+/// A schedule file we haven't finished reading yet
+struct Loader {
+    fname: String,
+    lines: Lines<BufReader<File>>,
+    line_num: usize,
+    bad_lines: usize,
+    /// IDs loaded from this file so far
+    seen: HashSet<u32>,
+    /// Whether we are adding to an existing schedule, in which case IDs we
+    /// already had before we started reading this file are skipped
+    merge: bool,
+}
+
+/// Measurements that have the exact same depends. Completion is counted once
+/// per group instead of once per measurement, so a wave of N measurements that
+/// all depend on the M measurements of the previous wave costs N+M instead of
+/// N*M.
+struct DepGroup {
+    depends: Span,
+    /// How many of depends are Complete or Failed
+    finished: u32,
+    /// One of depends Failed and we require success, so members can never
+    /// run
+    doomed: bool,
+    members: Vec<u32>,
+}
+
+/// A ready measurement and its critical path rank as of when it became
+/// ready. The heap pops the highest rank first, then the lowest ID.
+#[derive(PartialEq, Eq)]
+struct Ready {
+    rank: u64,
+    id: u32,
 }
+
+impl Ord for Ready {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.rank.cmp(&other.rank).then_with(|| other.id.cmp(&self.id))
+    }
+}
+
+impl PartialOrd for Ready {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+/// A run of entries in one of Sched's tables
+#[derive(Clone, Copy, PartialEq, Eq, Hash, Debug, Default, Serialize, Deserialize)]
+struct Span {
+    start: u32,
+    len: u32,
+}
+
+impl Span {
+    fn range(&self) -> Range<usize> {
+        self.start as usize..(self.start + self.len) as usize
+    }
+}
+
 //#[repr(C)]
 #[derive(Debug, Serialize, Deserialize)]
 pub struct Measurement {
     id: u32,
-    fp: String,
+    /// Index into Sched::fps
+    fp: u32,
     dur: u32,
     state: State,
-    hosts: Vec<Host>,
-    depends: Vec<u32>,
-    finished_depends: Vec<u32>,
+    /// Entries in Sched::hosts
+    hosts: Span,
+    /// Entries in Sched::deps
+    depends: Span,
     failsafe_stop: u64,
+    /// Seconds of measuring in the longest chain of measurements that starts
+    /// with this one and follows what depends on it, including its own dur.
+    /// Only this measurement's dur until the schedule is fully loaded.
+    #[serde(default)]
+    rank: u64,
+    /// How many times it has failed for each SCHED_FAIL_* reason
+    #[serde(default)]
+    fails: [u8; NUM_FAIL_REASONS],
+}
+
+impl Measurement {
+    fn attempts(&self) -> u32 {
+        self.fails.iter().map(|f| *f as u32).sum()
+    }
+}
+
+/// Whether there is a measurement with the given ID
+#[no_mangle]
+pub extern "C" fn sched_has(m_id: u32) -> bool {
+    msms().lock().unwrap().msms.contains_key(&m_id)
 }
 
 #[no_mangle]
 pub extern "C" fn sched_get_fp(m_id: u32) -> *const c_char {
-    CString::new(MSMS.lock().unwrap().get(&m_id).unwrap().fp.clone())
+    let sched = msms().lock().unwrap();
+    let m = sched.msms.get(&m_id).unwrap();
+    CString::new(&sched.fps[m.fp as usize][..])
         .expect("Unable to make fp cstring")
         .into_raw()
 }
 
 #[no_mangle]
 pub extern "C" fn sched_get_dur(m_id: u32) -> u32 {
-    MSMS.lock().unwrap().get(&m_id).unwrap().dur
+    msms().lock().unwrap().msms.get(&m_id).unwrap().dur
 }
 
 #[no_mangle]
 pub extern "C" fn sched_get_failsafe_stop(m_id: u32) -> u64 {
-    MSMS.lock().unwrap().get(&m_id).unwrap().failsafe_stop
+    msms().lock().unwrap().msms.get(&m_id).unwrap().failsafe_stop
 }
 
+/// Push the measurement's failsafe stop back to 1.5 times its dur from now.
+/// Returns the new failsafe stop.
 #[no_mangle]
-pub extern "C" fn sched_reset_failsafe_stop(m_id: u32) {
-    let mut msms = MSMS.lock().unwrap();
-    let mut m = msms.get_mut(&m_id).unwrap();
-    m.failsafe_stop = SystemTime::now()
-        .duration_since(SystemTime::UNIX_EPOCH)
-        .unwrap()
-        .as_secs() + (3 * m.dur / 2) as u64;
+pub extern "C" fn sched_reset_failsafe_stop(m_id: u32) -> u64 {
+    let mut sched = msms().lock().unwrap();
+    let now = sched.now();
+    let m = sched.msms.get_mut(&m_id).unwrap();
+    m.failsafe_stop = now + (3 * m.dur / 2) as u64;
+    m.failsafe_stop
+}
+
+/// Everything C needs to run a measurement, as handed out by
+/// sched_next_many(). The strings and arrays it points to live in the same
+/// buffer as it does.
+#[repr(C)]
+pub struct SchedMsm {
+    pub id: u32,
+    pub dur: u32,
+    pub failsafe_stop: u64,
+    /// NUL terminated relay fingerprint
+    pub fp: *mut c_char,
+    pub num_hosts: usize,
+    /// num_hosts each of the class, bw, and conns of each host
+    pub classes: *mut *mut c_char,
+    pub bws: *mut u32,
+    pub conns: *mut u32,
+    /// How many times this measurement has failed before
+    pub attempt: u32,
+    /// "host:port" of measurers it failed with before. Use others if there
+    /// are any.
+    pub num_avoid: usize,
+    pub avoid: *mut *mut c_char,
 }
 
 //#[repr(C)]
-#[derive(Debug, Serialize, Deserialize)]
+#[derive(Clone, Copy, PartialEq, Eq, Hash, Debug, Serialize, Deserialize)]
 pub struct Host {
-    class: String,
+    /// Index into Sched::classes
+    class: u32,
     bw: u32,
     conns: u32,
 }
 
 #[derive(PartialEq, Debug, Serialize, Deserialize)]
 pub enum State {
+    /// Not started yet, or failed and waiting to be retried
     Waiting,
     InProgress,
     Complete,
+    /// Failed and won't be retried
+    Failed,
 }
 
-impl Measurement {
-    fn new_from_string(s: String) -> Option<Self> {
+/// A measurement as written in a schedule, before it is added to a Sched
+struct MeasurementSpec {
+    id: u32,
+    fp: String,
+    dur: u32,
+    /// (class, bw, conns)
+    hosts: Vec<(String, u32, u32)>,
+    depends: Vec<u32>,
+}
+
+impl MeasurementSpec {
+    /// Parse one line of a schedule. Returns Ok(None) for comment and empty
+    /// lines, and an error describing what is wrong with invalid lines.
+    fn new_from_string(s: &str) -> Result<Option<Self>, String> {
         let s = s.trim();
         if s.is_empty() || s.starts_with('#') {
-            return None;
+            return Ok(None);
+        }
+        fn num<T: std::str::FromStr>(what: &str, s: &str) -> Result<T, String> {
+            s.parse().map_err(|_| format!("Invalid {} '{}'", what, s))
+        }
+        fn nums<T: std::str::FromStr>(what: &str, s: &str) -> Result<Vec<T>, String> {
+            s.split(',').map(|i| num(what, i)).collect()
         }
         let mut word_num = 0;
         let mut id = 0;
@@ -93,242 +370,1043 @@ impl Measurement {
                 continue;
             }
             match word_num {
-                0 => id = sub.parse().unwrap(),
+                0 => id = num("ID", sub)?,
                 1 => fp = sub.to_string(),
-                2 => dur = sub.parse().unwrap(),
+                2 => dur = num("duration", sub)?,
                 3 => host_class = sub.split(',').collect(),
-                4 => host_bw = sub.split(',').map(|i| i.parse::<u32>().unwrap()).collect(),
+                4 => host_bw = nums("bw", sub)?,
                 //4 => host_bw = sub.split(',').map(|i| i.parse::<u32>().unwrap() * 1000 * 1000 / 8).collect(),
-                5 => host_conns = sub.split(',').map(|i| i.parse().unwrap()).collect(),
+                5 => host_conns = nums("conns", sub)?,
                 6 => {
-                    depends = sub
-                        .split(',')
-                        .map(|i| i.parse().unwrap())
-                        .filter(|i| *i > 0)
-                        .collect()
+                    depends = nums("depend ID", sub)?;
+                    depends.retain(|i| *i > 0);
+                    depends.sort_unstable();
+                    depends.dedup();
                 }
-                _ => { panic!("Too many \"words\" on a line"); }
+                _ => { return Err("Too many \"words\" on a line".to_string()); }
             }
             word_num += 1;
         }
-        if id == 0 {
-            panic!("No measurement can have ID 0");
-        }
-        if depends.contains(&id) {
-            panic!("Measurement cannot depend on itself");
+        if word_num < 6 {
+            return Err("Too few \"words\" on a line".to_string());
         }
         if host_class.len() != host_bw.len() || host_class.len() != host_conns.len() {
-            panic!("Number of host classes, bws, and conns are not the same");
+            return Err("Number of host classes, bws, and conns are not the same".to_string());
         }
         let mut hosts = vec![];
         for i in 0..host_class.len() {
-            hosts.push(Host {
-                class: host_class[i].to_string(),
-                bw: host_bw[i],
-                conns: host_conns[i],
-            });
-        }
-        for h in hosts.iter() {
-            if h.class == "bg" && h.conns != 1 {
-                panic!("background host must only have 1 conn");
-            } else if h.class == "bg" && h.bw != 125000 {
-                panic!("background host bw must be exactly 125000 (bytes/second AKA 1 Mbit/s)");
-            }
+            hosts.push((host_class[i].to_string(), host_bw[i], host_conns[i]));
         }
-        if hosts.iter().filter(|h| h.class == "bg").count() > 1 {
-            panic!("can only have 0 or 1 'bg' tor clients");
+        MeasurementSpec::new(id, fp, dur, hosts, depends).map(Some)
+    }
+
+    /// Check that a measurement makes sense, however it was written
+    fn new(id: u32, fp: String, dur: u32, hosts: Vec<(String, u32, u32)>, depends: Vec<u32>) -> Result<Self, String> {
+        if !is_fp(fp.as_bytes()) {
+            return Err(format!("Invalid fingerprint '{}'", fp));
         }
-        Some(Measurement {
+        check_msm(id, hosts.iter().map(|(c, bw, conns)| (c.as_str(), *bw, *conns)), &depends)?;
+        Ok(MeasurementSpec {
             id,
-            fp,
+            fp: fp.to_ascii_uppercase(),
             dur,
-            state: State::Waiting,
             hosts,
             depends,
-            finished_depends: vec![],
-            failsafe_stop: 0,
         })
     }
 }
 
-#[no_mangle]
-pub extern "C" fn sched_new(fname: *const c_char) -> usize {
-    let fname = unsafe { CStr::from_ptr(fname).to_str() }
-        .expect("Got invalid string from C in sched_new()");
-    if fname.ends_with(".txt") {
-        sched_new_from_txt(fname);
-    } else if fname.ends_with(".json") {
-        sched_new_from_json(fname);
-    } else {
-        panic!("Do not know how to read the provided schedule of measurements. TXT or JSON please");
+/// The checks every measurement must pass, whatever format it was read from,
+/// given its ID, its hosts as (class, bw, conns), and its depends
+fn check_msm<'a>(id: u32, hosts: impl Iterator<Item = (&'a str, u32, u32)>, depends: &[u32]) -> Result<(), String> {
+    if id == 0 {
+        return Err("No measurement can have ID 0".to_string());
+    }
+    if depends.contains(&id) {
+        return Err("Measurement cannot depend on itself".to_string());
+    }
+    let mut num_bg = 0;
+    for (class, bw, conns) in hosts {
+        if class != "bg" {
+            continue;
+        }
+        if conns != 1 {
+            return Err("background host must only have 1 conn".to_string());
+        } else if bw != 125000 {
+            return Err("background host bw must be exactly 125000 (bytes/second AKA 1 Mbit/s)".to_string());
+        }
+        num_bg += 1;
     }
-    if sched_next_internal(false) == 0 {
-        panic!("No measurements with 0 depends exist");
+    if num_bg > 1 {
+        return Err("can only have 0 or 1 'bg' tor clients".to_string());
     }
-    sched_num()
+    Ok(())
+}
+
+fn is_fp(fp: &[u8]) -> bool {
+    fp.len() == FP_LEN && fp.iter().all(|c| c.is_ascii_hexdigit())
 }
 
-fn check_and_insert_measurements(measurements: Vec<Measurement>) {
-    let m_ids: HashSet<u32, RandomState> = HashSet::from_iter(measurements.iter().map(|m| m.id));
-    if m_ids.len() != measurements.len() {
-        panic!("Every measurement must have unique ID in sched_new()");
+impl Sched {
+    fn intern_fp(&mut self, fp: &str) -> u32 {
+        let mut key = [0u8; FP_LEN];
+        key.copy_from_slice(fp.as_bytes());
+        if let Some(idx) = self.fp_index.get(&key) {
+            return *idx;
+        }
+        let idx = self.fps.len() as u32;
+        self.fps.push(key);
+        self.fp_index.insert(key, idx);
+        idx
+    }
+
+    fn intern_class(&mut self, class: &str) -> u32 {
+        if let Some(idx) = self.class_index.get(class) {
+            return *idx;
+        }
+        let idx = self.classes.len() as u32;
+        self.classes.push(class.to_string());
+        self.class_index.insert(class.to_string(), idx);
+        idx
     }
-    let dep_ids: HashSet<u32, RandomState> =
-        HashSet::from_iter(measurements.iter().flat_map(|m| m.depends.iter()).copied());
-    for id in &dep_ids {
-        if !m_ids.contains(id) {
-            panic!("Depend ID not a measurement ID");
+
+    fn store_hosts(&mut self, hosts: Vec<Host>) -> Span {
+        if let Some(span) = self.host_lists.get(&hosts) {
+            return *span;
         }
+        let span = Span { start: self.hosts.len() as u32, len: hosts.len() as u32 };
+        self.hosts.extend_from_slice(&hosts);
+        self.host_lists.insert(hosts, span);
+        span
     }
-    {
-        let mut msms = MSMS.lock().unwrap();
-        for m in measurements {
-            //println!("{:?}", &m);
-            //println!("{}", serde_json::to_string(&m).unwrap());
-            //let m2: Measurement =
-            //    serde_json::from_str(&serde_json::to_string(&m).unwrap()).unwrap();
-            //println!("{:?}", m2);
-            msms.insert(m.id, m);
+
+    fn store_deps(&mut self, deps: Vec<u32>) -> Span {
+        if let Some(span) = self.dep_lists.get(&deps) {
+            return *span;
         }
+        let span = Span { start: self.deps.len() as u32, len: deps.len() as u32 };
+        self.deps.extend_from_slice(&deps);
+        self.dep_lists.insert(deps, span);
+        span
     }
-}
 
-fn sched_new_from_txt(fname: &str) {
-    let file = OpenOptions::new()
-        .read(true)
-        .open(fname)
-        .expect("Could not open file in sched_new_from_txt()");
-    let measurements: Vec<Measurement> = BufReader::new(&file)
-        .lines()
-        .map(|l| Measurement::new_from_string(l.unwrap()))
-        .filter(|m| m.is_some()) // if there was an invalid measurement, would have panic. None for comment/empty lines
-        .map(|m| m.unwrap())
-        .collect();
-    check_and_insert_measurements(measurements);
-}
-
-fn sched_new_from_json(fname: &str) {
-    let file = OpenOptions::new()
-        .read(true)
-        .open(fname)
-        .expect("Could not open file in sched_new_from_json()");
-    let aaron_sched: Vec<HashMap<String, HashMap<String, f64>>> =
-        serde_json::from_reader(file).unwrap();
-    let mut m_strings = vec![];
-    let mut next_msm_id = 1;
-    let mut last_m_id_set_str = "0".to_string();
-    for set in aaron_sched.iter() {
-        let mut new_m_id_set = vec![];
-        for fp in set.keys() {
-            let mut classes = vec![];
-            let mut bws = vec![];
-            let mut conns = vec![];
-            for (cls, bw) in set.get(fp).unwrap() {
-                classes.push(cls.clone());
-                bws.push(((bw / 8.0).round() as u32).to_string());
+    /// Add a measurement read from a text schedule
+    fn insert_spec(&mut self, mut spec: MeasurementSpec) {
+        let depends = self.store_deps(mem::replace(&mut spec.depends, vec![]));
+        self.insert_spec_with_deps(spec, depends);
+    }
+
+    /// Add a measurement whose depends are already stored, ignoring
+    /// spec.depends
+    fn insert_spec_with_deps(&mut self, spec: MeasurementSpec, depends: Span) {
+        let fp = self.intern_fp(&spec.fp);
+        let hosts = spec
+            .hosts
+            .iter()
+            .map(|(class, bw, conns)| Host { class: self.intern_class(class), bw: *bw, conns: *conns })
+            .collect();
+        let hosts = self.store_hosts(hosts);
+        self.insert(Measurement {
+            id: spec.id,
+            fp,
+            dur: spec.dur,
+            state: State::Waiting,
+            hosts,
+            depends,
+            failsafe_stop: 0,
+            rank: spec.dur as u64,
+            fails: [0; NUM_FAIL_REASONS],
+        });
+    }
+
+    /// Add a measurement whose fp, hosts, and depends are already in our
+    /// tables. Its depends don't have to be loaded yet. If they are all
+    /// already complete, it is ready to start right away.
+    fn insert(&mut self, mut m: Measurement) {
+        assert!(!self.msms.contains_key(&m.id));
+        if m.depends.len == 0 {
+            let id = m.id;
+            self.msms.insert(id, m);
+            self.push_ready(id);
+            self.restore(id);
+            return;
+        }
+        let g = match self.group_index.get(&m.depends) {
+            Some(g) => *g,
+            None => {
+                let g = self.groups.len() as u32;
+                let mut finished = 0;
+                let mut doomed = false;
+                for i in m.depends.range() {
+                    let dep = self.deps[i];
+                    match self.msms.get(&dep).map(|d| &d.state) {
+                        Some(State::Complete) => finished += 1,
+                        Some(State::Failed) => {
+                            finished += 1;
+                            doomed |= self.config.require_success;
+                        }
+                        _ => {}
+                    }
+                    self.dependents.entry(dep).or_insert_with(Vec::new).push(g);
+                }
+                self.groups.push(DepGroup { depends: m.depends, finished, doomed, members: vec![] });
+                self.group_index.insert(m.depends, g);
+                g
             }
-            let has_bg = classes.contains(&"bg".to_string());
-            let conn = if has_bg {
-                let mut conn = 160 / ((classes.len()-1) as u32);
-                if conn * ((classes.len()-1) as u32) < 160 {
-                    conn += 1;
+        };
+        let group = &mut self.groups[g as usize];
+        group.members.push(m.id);
+        let ready = group.finished == group.depends.len && !group.doomed;
+        if group.doomed {
+            m.state = State::Failed;
+            self.num_failed += 1;
+        }
+        let id = m.id;
+        self.msms.insert(id, m);
+        if ready {
+            self.push_ready(id);
+        }
+        self.restore(id);
+    }
+
+    fn now(&self) -> u64 {
+        self.config
+            .now
+            .unwrap_or_else(|| SystemTime::now().duration_since(SystemTime::UNIX_EPOCH).unwrap().as_secs())
+    }
+
+    fn push_ready(&mut self, id: u32) {
+        if self.config.policy == SCHED_POLICY_CRITICAL_PATH {
+            let rank = self.msms[&id].rank;
+            self.ready_by_rank.push(Ready { rank, id });
+        } else {
+            self.ready.push_back(id);
+        }
+    }
+
+    fn is_waiting(&self, id: u32) -> bool {
+        self.msms.get(&id).map_or(false, |m| m.state == State::Waiting)
+    }
+
+    /// How busy the classes of measurer the given measurement needs are
+    fn class_load(&self, id: u32) -> u32 {
+        let m = &self.msms[&id];
+        self.hosts[m.hosts.range()]
+            .iter()
+            .map(|h| self.class_busy.get(h.class as usize).copied().unwrap_or(0))
+            .sum()
+    }
+
+    /// Take the ready measurement that should start next, if any. With
+    /// SCHED_POLICY_CRITICAL_PATH, of the first few with the highest rank we
+    /// take the one whose classes have the fewest measurements in progress,
+    /// so measurements that can run side by side without fighting over the
+    /// same measurers tend to.
+    fn pop_ready(&mut self) -> Option<u32> {
+        if self.config.policy != SCHED_POLICY_CRITICAL_PATH {
+            while let Some(id) = self.ready.pop_front() {
+                if self.is_waiting(id) {
+                    return Some(id);
                 }
-                conn
-            } else {
-                let mut conn = 160 / ((classes.len()) as u32);
-                if conn * ((classes.len()) as u32) < 160 {
-                    conn += 1;
+            }
+            return None;
+        }
+        let mut ties: Vec<u32> = vec![];
+        let mut rank = 0;
+        while ties.len() < TIE_WINDOW {
+            match self.ready_by_rank.peek() {
+                Some(r) if ties.is_empty() || r.rank == rank => {}
+                _ => break,
+            }
+            let r = self.ready_by_rank.pop().unwrap();
+            if self.is_waiting(r.id) {
+                rank = r.rank;
+                ties.push(r.id);
+            }
+        }
+        // ties are in heap order, so min_by_key() keeps the lowest ID among
+        // equally loaded ones
+        let best = *ties.iter().min_by_key(|id| self.class_load(**id))?;
+        for id in ties {
+            if id != best {
+                self.ready_by_rank.push(Ready { rank, id });
+            }
+        }
+        Some(best)
+    }
+
+    /// When next_ready() may next have something: now if it would already,
+    /// when the first retry is due if only retries are left, or 0 if nothing
+    /// is waiting to be retried either
+    fn next_retry_at(&mut self) -> u64 {
+        let now = self.now();
+        // forget retries of measurements that have been started or finished
+        // since
+        while let Some(Reverse((_, id))) = self.retries.peek().copied() {
+            if self.is_waiting(id) {
+                break;
+            }
+            self.retries.pop();
+        }
+        if self.loader.is_some()
+            || self.ready.iter().any(|id| self.is_waiting(*id))
+            || self.ready_by_rank.iter().any(|r| self.is_waiting(r.id))
+        {
+            return now;
+        }
+        match self.retries.peek() {
+            Some(Reverse((at, _))) => (*at).max(now),
+            None => 0,
+        }
+    }
+
+    /// Take the next ready measurement, loading more of the schedule if
+    /// nothing we have read so far is ready
+    fn next_ready(&mut self) -> Option<u32> {
+        let now = self.now();
+        while let Some(Reverse((at, id))) = self.retries.peek().copied() {
+            if at > now {
+                break;
+            }
+            self.retries.pop();
+            if self.is_waiting(id) {
+                self.push_ready(id);
+            }
+        }
+        loop {
+            if let Some(id) = self.pop_ready() {
+                return Some(id);
+            }
+            if !self.load_chunk() {
+                return None;
+            }
+        }
+    }
+
+    /// Take the next ready measurement and mark it InProgress
+    fn start_next(&mut self) -> Option<u32> {
+        let id = self.next_ready()?;
+        let now = self.now();
+        let sized = self.sized_hosts(id);
+        let m = self.msms.get_mut(&id).unwrap();
+        m.state = State::InProgress;
+        m.failsafe_stop = now + (3 * m.dur / 2) as u64;
+        let hosts = match sized {
+            Some(hosts) => {
+                self.sized.insert(id, hosts);
+                hosts
+            }
+            None => m.hosts,
+        };
+        if self.journal.is_some() {
+            let fp = String::from_utf8_lossy(&self.fps[m.fp as usize]).into_owned();
+            self.journal(format!("start {} {}", id, fp));
+        }
+        for h in &self.hosts[hosts.range()] {
+            let c = h.class as usize;
+            if self.class_busy.len() <= c {
+                self.class_busy.resize(c + 1, 0);
+            }
+            self.class_busy[c] += 1;
+        }
+        Some(id)
+    }
+
+    /// The hosts the given measurement has, or was started with if it is
+    /// InProgress
+    fn hosts_of(&self, m: &Measurement) -> Span {
+        self.sized.get(&m.id).copied().unwrap_or(m.hosts)
+    }
+
+    /// An InProgress measurement has stopped. Its measurers are free again.
+    fn stop(&mut self, m_id: u32) -> &mut Measurement {
+        let hosts = match self.msms.get(&m_id) {
+            Some(m) => self.hosts_of(m),
+            None => panic!("Told that a measurement ID that doesn't exist is done"),
+        };
+        self.sized.remove(&m_id);
+        for h in &self.hosts[hosts.range()] {
+            self.class_busy[h.class as usize] -= 1;
+        }
+        let the_m = self.msms.get_mut(&m_id).unwrap();
+        assert_eq!(the_m.state, State::InProgress);
+        the_m
+    }
+
+    fn mark_done(&mut self, m_id: u32) {
+        self.stop(m_id).state = State::Complete;
+        self.num_complete += 1;
+        self.journal(format!("done {}", m_id));
+        self.avoid.remove(&m_id);
+        self.release_dependents(m_id, false);
+    }
+
+    /// Retry the measurement after a backoff if it hasn't failed for reason
+    /// too many times already, otherwise fail it for good. Returns true if it
+    /// will be retried.
+    fn mark_failed(&mut self, m_id: u32, reason: u32, measurers: Vec<String>) -> bool {
+        let limit = self.config.retry_limits[reason as usize];
+        let now = self.now();
+        let the_m = self.stop(m_id);
+        the_m.fails[reason as usize] = the_m.fails[reason as usize].saturating_add(1);
+        if the_m.fails[reason as usize] as u32 <= limit {
+            the_m.state = State::Waiting;
+            let shift = (the_m.attempts() - 1).min(16);
+            let at = now + (RETRY_BACKOFF_SECS << shift).min(RETRY_BACKOFF_MAX_SECS);
+            self.retries.push(Reverse((at, m_id)));
+            let avoid = self.avoid.entry(m_id).or_insert_with(Vec::new);
+            for m in measurers {
+                if !avoid.contains(&m) {
+                    avoid.push(m);
                 }
-                conn
+            }
+            self.journal(format!("retry {} {}", m_id, reason));
+            return true;
+        }
+        the_m.state = State::Failed;
+        self.num_failed += 1;
+        self.journal(format!("failed {}", m_id));
+        self.avoid.remove(&m_id);
+        self.release_dependents(m_id, self.config.require_success);
+        false
+    }
+
+    /// The given measurement is finished for good. Dependents waiting only on
+    /// it become ready, unless it failed and doom is set, in which case they
+    /// and everything after them fail too.
+    fn release_dependents(&mut self, m_id: u32, doom: bool) {
+        // (finished measurement, whether its dependents are doomed)
+        let mut todo = vec![(m_id, doom)];
+        while let Some((id, doom)) = todo.pop() {
+            let gs = match self.dependents.get(&id) {
+                Some(gs) => gs.clone(),
+                None => continue,
             };
-            for cls in classes.iter() {
-                if cls == "bg" {
-                    conns.push(1);
+            for g in gs {
+                let group = &mut self.groups[g as usize];
+                group.finished += 1;
+                let members = if doom && !group.doomed {
+                    group.doomed = true;
+                    group.members.clone()
+                } else if group.finished == group.depends.len && !group.doomed {
+                    group.members.clone()
                 } else {
-                    conns.push(conn);
+                    continue;
+                };
+                for member in members {
+                    // may have been dropped while loading
+                    if !self.is_waiting(member) {
+                        continue;
+                    }
+                    if doom {
+                        eprintln!("Measurement {} depends on {}, which failed. Failing it too", member, id);
+                        self.msms.get_mut(&member).unwrap().state = State::Failed;
+                        self.num_failed += 1;
+                        todo.push((member, true));
+                    } else {
+                        self.push_ready(member);
+                    }
                 }
             }
-            if has_bg {
-                assert!(conns.iter().sum::<u32>() >= 161);
-            } else {
-                assert!(conns.iter().sum::<u32>() >= 160);
+        }
+    }
+
+    /// Lay out SchedMsms for the given measurements, followed by their
+    /// host arrays, fingerprints, and the names of the classes they use, in
+    /// one malloc()ed buffer
+    fn describe(&self, ids: &[u32]) -> *mut SchedMsm {
+        let msms: Vec<&Measurement> = ids.iter().map(|id| &self.msms[id]).collect();
+        let spans: Vec<Span> = msms.iter().map(|m| self.hosts_of(m)).collect();
+        let num_hosts: usize = spans.iter().map(|h| h.len as usize).sum();
+        let no_avoid = vec![];
+        let avoids: Vec<&Vec<String>> = ids.iter().map(|id| self.avoid.get(id).unwrap_or(&no_avoid)).collect();
+        let num_avoid: usize = avoids.iter().map(|a| a.len()).sum();
+        // Class -> offset into strs. Each class is only copied once.
+        let mut class_at: HashMap<u32, usize> = HashMap::new();
+        let mut strs: Vec<u8> = vec![];
+        for span in spans.iter() {
+            for h in &self.hosts[span.range()] {
+                class_at.entry(h.class).or_insert_with(|| {
+                    let at = strs.len();
+                    strs.extend_from_slice(self.classes[h.class as usize].as_bytes());
+                    strs.push(0);
+                    at
+                });
             }
-            let s = format!(
-                "{m_id} {fp} {dur} {cls} {bw} {conn} {dep}",
-                m_id = next_msm_id,
-                fp = fp,
-                dur = 30,
-                cls = classes.join(","),
-                bw = bws.join(","),
-                conn = conns
-                    .into_iter()
-                    .map(|n| n.to_string())
-                    .collect::<Vec<String>>()
-                    .join(","),
-                dep = last_m_id_set_str,
-            );
-            //println!("{:?} {:?}", classes, bws);
-            println!("{}", s);
-            m_strings.push(s);
-            new_m_id_set.push(next_msm_id);
-            next_msm_id += 1;
-        }
-        last_m_id_set_str = new_m_id_set
-            .iter()
-            .map(|id| id.to_string())
-            .collect::<Vec<String>>()
-            .join(",");
-    }
-    let measurements: Vec<Measurement> = m_strings
-        .into_iter()
-        .map(Measurement::new_from_string)
-        .filter(|m| m.is_some()) // if there was an invalid measurement, would have panic. None for comment/empty lines
-        .map(|m| m.unwrap())
-        .collect();
-    check_and_insert_measurements(measurements);
-    panic!("Running from JSON fps is not supported. Use the plain text output above instead use that as input instead.");
+        }
+        let mut avoid_at = vec![];
+        for addr in avoids.iter().flat_map(|a| a.iter()) {
+            avoid_at.push(strs.len());
+            strs.extend_from_slice(addr.as_bytes());
+            strs.push(0);
+        }
+        let classes_at = msms.len() * mem::size_of::<SchedMsm>();
+        let avoids_at = classes_at + num_hosts * mem::size_of::<*mut c_char>();
+        let bws_at = avoids_at + num_avoid * mem::size_of::<*mut c_char>();
+        let conns_at = bws_at + num_hosts * mem::size_of::<u32>();
+        let fps_at = conns_at + num_hosts * mem::size_of::<u32>();
+        let strs_at = fps_at + msms.len() * (FP_LEN + 1);
+        unsafe {
+            let buf = libc::malloc(strs_at + strs.len()) as *mut u8;
+            assert!(!buf.is_null(), "Unable to allocate measurement descriptors");
+            ptr::copy_nonoverlapping(strs.as_ptr(), buf.add(strs_at), strs.len());
+            let descs = buf as *mut SchedMsm;
+            let classes = buf.add(classes_at) as *mut *mut c_char;
+            let avoid = buf.add(avoids_at) as *mut *mut c_char;
+            let bws = buf.add(bws_at) as *mut u32;
+            let conns = buf.add(conns_at) as *mut u32;
+            let mut h_i = 0;
+            let mut a_i = 0;
+            for (i, m) in msms.iter().enumerate() {
+                let fp = buf.add(fps_at + i * (FP_LEN + 1));
+                ptr::copy_nonoverlapping(self.fps[m.fp as usize].as_ptr(), fp, FP_LEN);
+                *fp.add(FP_LEN) = 0;
+                descs.add(i).write(SchedMsm {
+                    id: m.id,
+                    dur: m.dur,
+                    failsafe_stop: m.failsafe_stop,
+                    fp: fp as *mut c_char,
+                    num_hosts: spans[i].len as usize,
+                    classes: classes.add(h_i),
+                    bws: bws.add(h_i),
+                    conns: conns.add(h_i),
+                    attempt: m.attempts(),
+                    num_avoid: avoids[i].len(),
+                    avoid: avoid.add(a_i),
+                });
+                for _ in avoids[i].iter() {
+                    avoid.add(a_i).write(buf.add(strs_at + avoid_at[a_i]) as *mut c_char);
+                    a_i += 1;
+                }
+                for h in &self.hosts[spans[i].range()] {
+                    classes.add(h_i).write(buf.add(strs_at + class_at[&h.class]) as *mut c_char);
+                    bws.add(h_i).write(h.bw);
+                    conns.add(h_i).write(h.conns);
+                    h_i += 1;
+                }
+            }
+            descs
+        }
+    }
+
+    /// Work out every measurement's critical path rank from its dur and what
+    /// depends on it, and re-sort the ready measurements by it. A cycle in
+    /// the depends is broken wherever we happen to find it; nothing in it can
+    /// ever become ready anyway.
+    fn compute_ranks(&mut self) {
+        #[derive(Clone, Copy)]
+        enum Node {
+            Msm(u32),
+            Group(u32),
+        }
+        let mut ranks: HashMap<u32, u64> = HashMap::with_capacity(self.msms.len());
+        let mut group_ranks: Vec<Option<u64>> = vec![None; self.groups.len()];
+        // Started but not finished. Reaching one of these again means a cycle.
+        let mut open: HashSet<u32> = HashSet::new();
+        let mut open_groups = vec![false; self.groups.len()];
+        // Iterative so a long chain of depends can't overflow the stack
+        let mut stack: Vec<(Node, bool)> = vec![];
+        for start in self.msms.keys() {
+            stack.push((Node::Msm(*start), false));
+            while let Some((node, expanded)) = stack.pop() {
+                match node {
+                    Node::Msm(id) => {
+                        if ranks.contains_key(&id) {
+                            continue;
+                        }
+                        let gs = self.dependents.get(&id).map_or(&[][..], |gs| &gs[..]);
+                        if expanded {
+                            let tail = gs.iter().filter_map(|g| group_ranks[*g as usize]).max().unwrap_or(0);
+                            ranks.insert(id, self.msms[&id].dur as u64 + tail);
+                            open.remove(&id);
+                        } else if open.insert(id) {
+                            stack.push((node, true));
+                            stack.extend(gs.iter().map(|g| (Node::Group(*g), false)));
+                        }
+                    }
+                    Node::Group(g) => {
+                        let gi = g as usize;
+                        if group_ranks[gi].is_some() {
+                            continue;
+                        }
+                        // may have been dropped while loading
+                        let members = self.groups[gi].members.iter().filter(|id| self.msms.contains_key(id));
+                        if expanded {
+                            group_ranks[gi] = Some(members.filter_map(|id| ranks.get(id)).max().copied().unwrap_or(0));
+                            open_groups[gi] = false;
+                        } else if !open_groups[gi] {
+                            open_groups[gi] = true;
+                            stack.push((node, true));
+                            stack.extend(members.map(|id| (Node::Msm(*id), false)));
+                        }
+                    }
+                }
+            }
+        }
+        for (id, rank) in ranks {
+            self.msms.get_mut(&id).unwrap().rank = rank;
+        }
+        self.rebuild_ready();
+    }
+
+    /// Move every ready measurement into the queue for the current policy
+    fn rebuild_ready(&mut self) {
+        let mut ids: Vec<u32> = self.ready.drain(..).chain(self.ready_by_rank.drain().map(|r| r.id)).collect();
+        // so FIFO order is at least deterministic after switching from
+        // SCHED_POLICY_CRITICAL_PATH
+        ids.sort_unstable();
+        ids.dedup();
+        for id in ids {
+            if self.is_waiting(id) {
+                self.push_ready(id);
+            }
+        }
+    }
+
+    /// Start reading fname. For a text schedule we only read the first chunk
+    /// of it now (or more, until we find at least one measurement) and the
+    /// rest as we are asked to load more. Returns the number of measurements
+    /// added, or an error if fname can't be read at all, in which case the
+    /// schedule is left as it was.
+    fn start_load(&mut self, fname: &str, merge: bool) -> Result<usize, String> {
+        // can't interleave two files
+        while self.load_chunk() {}
+        let before = self.msms.len();
+        if fname.ends_with(".txt") {
+            let file = OpenOptions::new()
+                .read(true)
+                .open(fname)
+                .map_err(|e| format!("Could not open {}: {}", fname, e))?;
+            self.loader = Some(Loader {
+                fname: fname.to_string(),
+                lines: BufReader::new(file).lines(),
+                line_num: 0,
+                bad_lines: 0,
+                seen: HashSet::new(),
+                merge,
+            });
+            while self.msms.len() == before && self.load_chunk() {}
+        } else if fname.ends_with(".json") {
+            jsonsched::load(self, fname)?;
+            self.finish_load(fname, merge);
+        } else if fname.ends_with(".bin") {
+            binsched::load(self, fname, merge)
+                .map_err(|e| format!("Could not load binary schedule {}: {}", fname, e))?;
+            self.finish_load(fname, merge);
+        } else {
+            return Err(format!(
+                "Do not know how to read the schedule of measurements in {}. TXT, JSON, or BIN please",
+                fname
+            ));
+        }
+        let ident = journal::sched_ident(fname);
+        if self.journal.as_ref().and_then(|j| j.sched()) != Some(ident.as_str()) {
+            self.journal(format!("sched {}", ident));
+        }
+        self.source = Some(ident);
+        Ok(self.msms.len() - before)
+    }
+
+    /// Parse up to LOAD_CHUNK_LINES more lines of the schedule we are
+    /// loading. Bad lines are reported and skipped. Returns true if there is
+    /// more to load.
+    fn load_chunk(&mut self) -> bool {
+        let mut loader = match self.loader.take() {
+            None => return false,
+            Some(l) => l,
+        };
+        for _ in 0..LOAD_CHUNK_LINES {
+            let line = match loader.lines.next() {
+                None => {
+                    eprintln!("Read {} lines from {}, {} bad", loader.line_num, loader.fname, loader.bad_lines);
+                    self.finish_load(&loader.fname, loader.merge);
+                    return false;
+                }
+                Some(Ok(l)) => l,
+                Some(Err(e)) => {
+                    eprintln!("{}: error reading after line {}: {}", loader.fname, loader.line_num, e);
+                    self.finish_load(&loader.fname, loader.merge);
+                    return false;
+                }
+            };
+            loader.line_num += 1;
+            let spec = match MeasurementSpec::new_from_string(&line) {
+                Ok(Some(spec)) => spec,
+                Ok(None) => continue,
+                Err(e) => {
+                    eprintln!("{}:{}: {}. Skipping '{}'", loader.fname, loader.line_num, e, line);
+                    loader.bad_lines += 1;
+                    continue;
+                }
+            };
+            if !loader.seen.insert(spec.id) {
+                eprintln!("{}:{}: Every measurement must have unique ID. Skipping '{}'", loader.fname, loader.line_num, line);
+                loader.bad_lines += 1;
+                continue;
+            }
+            if self.msms.contains_key(&spec.id) {
+                if !loader.merge {
+                    panic!("Measurement {} already loaded while not merging", spec.id);
+                }
+                continue;
+            }
+            self.insert_spec(spec);
+        }
+        self.loader = Some(loader);
+        true
+    }
+
+    /// The whole file has been read, so now we can tell which depends will
+    /// never exist. Measurements that depend on them can never run, so they
+    /// (and anything that depends on them) are dropped.
+    fn finish_load(&mut self, fname: &str, merge: bool) {
+        // (measurement to drop, the depend it can't have)
+        let mut doomed: Vec<(u32, u32)> = vec![];
+        for (dep, gs) in self.dependents.iter() {
+            if !self.msms.contains_key(dep) {
+                for g in gs {
+                    doomed.extend(self.groups[*g as usize].members.iter().map(|id| (*id, *dep)));
+                }
+            }
+        }
+        while let Some((id, dep)) = doomed.pop() {
+            if let Some(m) = self.msms.remove(&id) {
+                // only a journal from a different schedule could have
+                // finished it
+                match m.state {
+                    State::Complete => self.num_complete -= 1,
+                    State::Failed => self.num_failed -= 1,
+                    _ => assert_eq!(m.state, State::Waiting),
+                }
+                eprintln!("{}: measurement {} depends on {}, which will never run. Dropping it", fname, id, dep);
+                if let Some(gs) = self.dependents.get(&id) {
+                    for g in gs {
+                        doomed.extend(self.groups[*g as usize].members.iter().map(|d| (*d, id)));
+                    }
+                }
+            }
+        }
+        let missing: Vec<u32> = self
+            .dependents
+            .keys()
+            .filter(|dep| !self.msms.contains_key(dep))
+            .copied()
+            .collect();
+        for dep in missing {
+            // These groups can never finish. Forget them so a measurement
+            // added later with the same depends gets a fresh group, and is
+            // dropped the same way if they are still missing.
+            for g in self.dependents.remove(&dep).unwrap() {
+                let span = self.groups[g as usize].depends;
+                if self.group_index.get(&span) == Some(&g) {
+                    self.group_index.remove(&span);
+                }
+            }
+        }
+        if self.config.policy == SCHED_POLICY_CRITICAL_PATH {
+            self.compute_ranks();
+        }
+        eprintln!("Done loading {}. {} measurements known", fname, self.msms.len());
+        if !merge && !self.msms.is_empty() && self.msms.values().all(|m| m.depends.len > 0) {
+            panic!("No measurements with 0 depends exist");
+        }
+    }
+}
+
+/// A new, empty schedule for sched_ctx_use(). Free it with sched_ctx_free().
+#[no_mangle]
+pub extern "C" fn sched_ctx_new() -> *mut SchedCtx {
+    Box::into_raw(Box::new(SchedCtx(Mutex::new(Sched::default()))))
+}
+
+/// Have the sched_* functions called from this thread work on ctx from now
+/// on, or on the shared schedule if ctx is NULL
+#[no_mangle]
+pub extern "C" fn sched_ctx_use(ctx: *mut SchedCtx) {
+    CURRENT.with(|c| c.set(ctx));
+}
+
+#[no_mangle]
+pub extern "C" fn sched_ctx_free(ctx: *mut SchedCtx) {
+    if ctx.is_null() {
+        return;
+    }
+    CURRENT.with(|c| {
+        if c.get() == ctx as *const SchedCtx {
+            c.set(ptr::null());
+        }
+    });
+    drop(unsafe { Box::from_raw(ctx) });
+}
+
+#[no_mangle]
+pub extern "C" fn sched_new(fname: *const c_char) -> usize {
+    let fname = unsafe { CStr::from_ptr(fname).to_str() }
+        .expect("Got invalid string from C in sched_new()");
+    let mut sched = msms().lock().unwrap();
+    let config = sched.config.clone();
+    let journal = sched.journal.take();
+    let capacity = sched.capacity.take();
+    *sched = Sched { config, journal, capacity, ..Sched::default() };
+    sched.start_load(fname, false).unwrap_or_else(|e| {
+        eprintln!("{}", e);
+        0
+    })
+}
+
+/// Save the schedule's progress to the journal in fname from now on, first
+/// reading whatever progress it already has. Measurements it says are
+/// finished are finished again as soon as they are loaded, along with what
+/// that means for those that depend on them. Ones that were interrupted are
+/// run again; see sched_journal_pop_interrupted(). A journal for a different
+/// schedule file, or for one that has changed since, is moved aside and a new
+/// one started. Call after sched_new(). The journal is kept across
+/// sched_new(). Returns false if it can't be opened.
+#[no_mangle]
+pub extern "C" fn sched_journal_open(fname: *const c_char) -> bool {
+    let fname = unsafe { CStr::from_ptr(fname).to_str() }
+        .expect("Got invalid string from C in sched_journal_open()");
+    let mut sched = msms().lock().unwrap();
+    let source = sched.source.clone().unwrap_or_default();
+    let j = match journal::Journal::open(fname, &source) {
+        Ok(j) => j,
+        Err(e) => {
+            eprintln!("Could not open journal {}: {}", fname, e);
+            return false;
+        }
+    };
+    eprintln!("Journal {} has {} finished measurements", fname, j.num_finished());
+    let ids = j.ids();
+    sched.journal = Some(j);
+    for id in ids {
+        sched.restore(id);
+    }
+    true
+}
+
+/// Note in the journal that results are being written to fname
+#[no_mangle]
+pub extern "C" fn sched_journal_set_output(fname: *const c_char) {
+    let fname = unsafe { CStr::from_ptr(fname).to_str() }
+        .expect("Got invalid string from C in sched_journal_set_output()");
+    msms().lock().unwrap().journal(format!("out {}", fname));
+}
+
+/// Copy the name of the file the journal says results were last written to
+/// into buf, which is len bytes. Returns false if there is no journal, it
+/// doesn't name one, or the name doesn't fit.
+#[no_mangle]
+pub extern "C" fn sched_journal_output(buf: *mut c_char, len: usize) -> bool {
+    let sched = msms().lock().unwrap();
+    let out = match sched.journal.as_ref().and_then(|j| j.output()) {
+        Some(out) if out.len() < len => out,
+        _ => return false,
+    };
+    unsafe {
+        ptr::copy_nonoverlapping(out.as_ptr() as *const c_char, buf, out.len());
+        *buf.add(out.len()) = 0;
+    }
+    true
+}
+
+/// Take one of the measurements that were running when the journal was last
+/// written to, which will be run again. Its fp is copied into out_fp, which
+/// must have room for 41 bytes, and the attempt that was interrupted into
+/// out_attempt. Returns its ID, or 0 if there are no more. Make sure whatever
+/// is done about one is on disk before asking for the next: once this returns
+/// 0, the journal forgets they were interrupted.
+#[no_mangle]
+pub extern "C" fn sched_journal_pop_interrupted(out_fp: *mut c_char, out_attempt: *mut u32) -> u32 {
+    let mut sched = msms().lock().unwrap();
+    match sched.journal.as_mut().and_then(|j| j.pop_interrupted()) {
+        None => 0,
+        Some((id, fp, attempt)) => {
+            unsafe {
+                ptr::copy_nonoverlapping(fp.as_ptr() as *const c_char, out_fp, FP_LEN);
+                *out_fp.add(FP_LEN) = 0;
+                *out_attempt = attempt;
+            }
+            id
+        }
+    }
+}
+
+/// Size measurements of relays in the capacity cache in fname by their last
+/// result instead of giving them all of the schedule's hosts, and keep the
+/// cache up to date with sched_capacity_learn(). The cache is kept across
+/// sched_new(). Returns false if it can't be read.
+#[no_mangle]
+pub extern "C" fn sched_capacity_open(fname: *const c_char) -> bool {
+    let fname = unsafe { CStr::from_ptr(fname).to_str() }
+        .expect("Got invalid string from C in sched_capacity_open()");
+    match capacity::Capacities::open(fname) {
+        Ok(c) => {
+            eprintln!("Capacity cache {} has {} relays", fname, c.len());
+            msms().lock().unwrap().capacity = Some(c);
+            true
+        }
+        Err(e) => {
+            eprintln!("Could not open capacity cache {}: {}", fname, e);
+            false
+        }
+    }
+}
+
+/// The given measurement succeeded with result bw. Remember it as its relay's
+/// capacity, if there is a capacity cache.
+#[no_mangle]
+pub extern "C" fn sched_capacity_learn(m_id: u32, bw: u64) {
+    msms().lock().unwrap().learn_capacity(m_id, bw);
+}
+
+/// Write the capacity cache to its file if it has changed. Returns false if
+/// that fails.
+#[no_mangle]
+pub extern "C" fn sched_capacity_save() -> bool {
+    let mut sched = msms().lock().unwrap();
+    match sched.capacity.as_mut().map(|c| c.save()) {
+        Some(Err(e)) => {
+            eprintln!("Could not save capacity cache: {}", e);
+            false
+        }
+        _ => true,
+    }
+}
+
+/// Choose the order ready measurements are handed out by sched_next(): one of
+/// the SCHED_POLICY_* constants. The default is SCHED_POLICY_CRITICAL_PATH.
+/// May be called at any time, and is kept across sched_new(). Returns false if
+/// policy isn't one we know.
+#[no_mangle]
+pub extern "C" fn sched_set_policy(policy: u32) -> bool {
+    if policy != SCHED_POLICY_FIFO && policy != SCHED_POLICY_CRITICAL_PATH {
+        return false;
+    }
+    let mut sched = msms().lock().unwrap();
+    if sched.config.policy == policy {
+        return true;
+    }
+    sched.config.policy = policy;
+    if policy == SCHED_POLICY_CRITICAL_PATH && sched.loader.is_none() {
+        sched.compute_ranks();
+    } else {
+        sched.rebuild_ready();
+    }
+    true
+}
+
+/// Read the schedule again and add any measurements with IDs we haven't seen
+/// before to the live schedule. Measurements we already know about keep
+/// whatever state they are in, even if their line in the file changed. New
+/// measurements may depend on old ones, and ones that depend on an already
+/// complete measurement take that into account. Like sched_new(), only the
+/// start of the file is read now and the rest as sched_load_more() is called.
+/// Returns the number of measurements added so far. If the file can't be read
+/// the error is logged and the live schedule is kept as it is.
+#[no_mangle]
+pub extern "C" fn sched_merge(fname: *const c_char) -> usize {
+    let fname = unsafe { CStr::from_ptr(fname).to_str() }
+        .expect("Got invalid string from C in sched_merge()");
+    msms().lock().unwrap().start_load(fname, true).unwrap_or_else(|e| {
+        eprintln!("{}. Keeping the current schedule", e);
+        0
+    })
+}
+
+/// Load another chunk of the schedule file, if we are still reading one.
+/// Returns true if there is still more to load.
+#[no_mangle]
+pub extern "C" fn sched_load_more() -> bool {
+    msms().lock().unwrap().load_chunk()
+}
+
+/// Whether we are still reading a schedule file
+#[no_mangle]
+pub extern "C" fn sched_loading() -> bool {
+    msms().lock().unwrap().loader.is_some()
+}
+
+/// Read a text or JSON schedule and write it out in the binary format that
+/// can be loaded quickly with a .bin file name. Bad lines are skipped just
+/// like when running the schedule. Returns true on success.
+#[no_mangle]
+pub extern "C" fn sched_convert(in_fname: *const c_char, out_fname: *const c_char) -> bool {
+    let in_fname = unsafe { CStr::from_ptr(in_fname).to_str() }
+        .expect("Got invalid string from C in sched_convert()");
+    let out_fname = unsafe { CStr::from_ptr(out_fname).to_str() }
+        .expect("Got invalid string from C in sched_convert()");
+    let mut sched = Sched::default();
+    if let Err(e) = sched.start_load(in_fname, false) {
+        eprintln!("{}", e);
+        return false;
+    }
+    while sched.load_chunk() {}
+    match binsched::write(&sched, out_fname) {
+        Ok(()) => {
+            eprintln!("Wrote {} measurements to {}", sched.msms.len(), out_fname);
+            true
+        }
+        Err(e) => {
+            eprintln!("Could not write {}: {}", out_fname, e);
+            false
+        }
+    }
 }
 
 #[no_mangle]
 pub extern "C" fn sched_finished() -> bool {
-    sched_num_incomplete() == 0
+    let sched = msms().lock().unwrap();
+    sched.loader.is_none() && sched.num_complete + sched.num_failed == sched.msms.len()
 }
 
 #[no_mangle]
 pub extern "C" fn sched_num() -> usize {
-    MSMS.lock().unwrap().len()
+    msms().lock().unwrap().msms.len()
 }
 
 #[no_mangle]
 pub extern "C" fn sched_num_complete() -> usize {
-    MSMS.lock()
-        .unwrap()
-        .values()
-        .filter(|m| m.state == State::Complete)
-        .count()
+    msms().lock().unwrap().num_complete
 }
 
 #[no_mangle]
 pub extern "C" fn sched_num_incomplete() -> usize {
-    MSMS.lock()
-        .unwrap()
-        .values()
-        .filter(|m| m.state != State::Complete)
-        .count()
+    let sched = msms().lock().unwrap();
+    sched.msms.len() - sched.num_complete - sched.num_failed
+}
+
+/// How many measurements have failed for good
+#[no_mangle]
+pub extern "C" fn sched_num_failed() -> usize {
+    msms().lock().unwrap().num_failed
 }
 
 fn sched_next_internal(mark: bool) -> u32 {
-    let mut msms = MSMS.lock().unwrap();
-    for m in msms.values_mut() {
-        if m.state == State::Waiting && m.depends.len() == m.finished_depends.len() {
-            if mark {
-                m.state = State::InProgress;
-                m.failsafe_stop = SystemTime::now().duration_since(SystemTime::UNIX_EPOCH).unwrap().as_secs() + (3 * m.dur / 2) as u64;
+    let mut sched = msms().lock().unwrap();
+    if mark {
+        return sched.start_next().unwrap_or(0);
+    }
+    match sched.next_ready() {
+        None => 0,
+        Some(id) => {
+            // put it back where it was
+            if sched.config.policy == SCHED_POLICY_CRITICAL_PATH {
+                sched.push_ready(id);
+            } else {
+                sched.ready.push_front(id);
             }
-            return m.id;
+            id
         }
     }
-    0
+}
+
+/// The Unix time a measurement may next be started: now (or earlier) if one
+/// can be started already, when the first measurement waiting to be retried is
+/// due if that is all that is left, or 0 if there is nothing to start. For
+/// knowing how long to wait when nothing is running.
+#[no_mangle]
+pub extern "C" fn sched_next_retry_at() -> u64 {
+    msms().lock().unwrap().next_retry_at()
 }
 
 #[no_mangle]
@@ -336,19 +1414,87 @@ pub extern "C" fn sched_next() -> u32 {
     sched_next_internal(true)
 }
 
+/// Start up to max ready measurements at once, in the same order
+/// sched_next() would. *out_msms is set to an array of that many SchedMsm,
+/// in a single buffer that also holds everything they point to. free() it
+/// when done with all of them. Returns how many were started; if none,
+/// *out_msms is set to NULL.
+#[no_mangle]
+pub extern "C" fn sched_next_many(max: usize, out_msms: *mut *mut SchedMsm) -> usize {
+    let mut sched = msms().lock().unwrap();
+    let mut ids = vec![];
+    while ids.len() < max {
+        match sched.start_next() {
+            Some(id) => ids.push(id),
+            None => break,
+        }
+    }
+    let msms = if ids.is_empty() { ptr::null_mut() } else { sched.describe(&ids) };
+    unsafe {
+        *out_msms = msms;
+    }
+    ids.len()
+}
+
 #[no_mangle]
 pub extern "C" fn sched_mark_done(m_id: u32) {
-    let mut msms = MSMS.lock().unwrap();
-    if !msms.contains_key(&m_id) {
-        panic!("Told that a measurement ID that doesn't exist is done");
+    msms().lock().unwrap().mark_done(m_id);
+}
+
+/// The given InProgress measurement failed for reason, one of the
+/// SCHED_FAIL_* constants, with the num_measurers measurers ("host:port") in
+/// measurers. If it hasn't failed for that reason too many times, it will be
+/// started again after a backoff, preferring other measurers. Returns true if
+/// so. Otherwise it has failed for good, and returns false.
+#[no_mangle]
+pub extern "C" fn sched_mark_failed(
+    m_id: u32,
+    reason: u32,
+    measurers: *const *const c_char,
+    num_measurers: usize,
+) -> bool {
+    assert!((reason as usize) < NUM_FAIL_REASONS, "Unknown failure reason {}", reason);
+    let measurers = (0..num_measurers)
+        .map(|i| unsafe { CStr::from_ptr(*measurers.add(i)) }.to_string_lossy().into_owned())
+        .collect();
+    msms().lock().unwrap().mark_failed(m_id, reason, measurers)
+}
+
+/// Retry measurements that fail for reason at most limit times. Returns false
+/// if reason isn't one of the SCHED_FAIL_* constants.
+#[no_mangle]
+pub extern "C" fn sched_set_retry_limit(reason: u32, limit: u32) -> bool {
+    if reason as usize >= NUM_FAIL_REASONS {
+        return false;
     }
-    let the_m = msms.get_mut(&m_id).unwrap();
-    assert_eq!(the_m.state, State::InProgress);
-    the_m.state = State::Complete;
-    for m in msms.values_mut() {
-        if m.depends.contains(&m_id) {
-            m.finished_depends.push(m_id);
-        }
+    msms().lock().unwrap().config.retry_limits[reason as usize] = limit;
+    true
+}
+
+/// Whether measurements that depend on one that failed for good fail too
+/// (true), or run anyway (false, the default)
+#[no_mangle]
+pub extern "C" fn sched_set_require_success(require: bool) {
+    msms().lock().unwrap().config.require_success = require;
+}
+
+/// Use now, in seconds since the epoch, as the current time instead of the
+/// system clock, for simulating a schedule
+#[no_mangle]
+pub extern "C" fn sched_set_now(now: u64) {
+    msms().lock().unwrap().config.now = Some(now);
+}
+
+/// sched_mark_done() each of the count measurement IDs in m_ids
+#[no_mangle]
+pub extern "C" fn sched_mark_done_many(m_ids: *const u32, count: usize) {
+    if count == 0 {
+        return;
+    }
+    let m_ids = unsafe { std::slice::from_raw_parts(m_ids, count) };
+    let mut sched = msms().lock().unwrap();
+    for m_id in m_ids {
+        sched.mark_done(*m_id);
     }
 }
 
@@ -359,23 +1505,24 @@ pub extern "C" fn sched_get_hosts(
     out_bws: *mut *mut u32,
     out_conns: *mut *mut u32,
 ) -> usize {
-    let msms = MSMS.lock().unwrap();
-    let m = msms.get(&m_id).unwrap();
+    let sched = msms().lock().unwrap();
+    let m = sched.msms.get(&m_id).unwrap();
+    let hosts = &sched.hosts[sched.hosts_of(m).range()];
     let mut classes = vec![];
     let mut bws = vec![];
     let mut conns = vec![];
-    for h in &m.hosts {
+    for h in hosts {
         classes.push(
-            CString::new(h.class.clone())
+            CString::new(sched.classes[h.class as usize].clone())
                 .expect("Unable to make host cstring")
                 .into_raw(),
         );
         bws.push(h.bw);
         conns.push(h.conns);
     }
-    assert_eq!(classes.len(), m.hosts.len());
-    assert_eq!(bws.len(), m.hosts.len());
-    assert_eq!(conns.len(), m.hosts.len());
+    assert_eq!(classes.len(), hosts.len());
+    assert_eq!(bws.len(), hosts.len());
+    assert_eq!(conns.len(), hosts.len());
     classes.shrink_to_fit();
     bws.shrink_to_fit();
     conns.shrink_to_fit();
@@ -390,7 +1537,28 @@ pub extern "C" fn sched_get_hosts(
     mem::forget(classes);
     mem::forget(bws);
     mem::forget(conns);
-    m.hosts.len()
+    hosts.len()
+}
+
+/// The IDs of the measurements the given one depends on. Returns how many
+/// there are. Give them back to sched_free_depends() when done.
+#[no_mangle]
+pub extern "C" fn sched_get_depends(m_id: u32, out_depends: *mut *mut u32) -> usize {
+    let sched = msms().lock().unwrap();
+    let m = sched.msms.get(&m_id).unwrap();
+    let deps = sched.deps[m.depends.range()].to_vec().into_boxed_slice();
+    let len = deps.len();
+    unsafe {
+        *out_depends = Box::into_raw(deps) as *mut u32;
+    }
+    len
+}
+
+#[no_mangle]
+pub extern "C" fn sched_free_depends(depends: *mut u32, count: usize) {
+    unsafe {
+        drop(Box::from_raw(std::ptr::slice_from_raw_parts_mut(depends, count)));
+    }
 }
 
 #[no_mangle]
@@ -0,0 +1,631 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <glib.h>
+#include "sim.h"
+#include "torclient.h"
+#include "sched.h"
+
+/*
+ * Simulate running a schedule, to predict how long it will take and how busy
+ * the measurers will be, without any tor clients and without waiting.
+ *
+ * The sched crate decides what can run, exactly as it does for real. The
+ * coordinator is modelled as it works in flashflow.c:
+ *
+ * - Each time around the main loop it starts at most one new measurement. It
+ *   goes around whenever a measurer replies, at least every second while
+ *   anything is measuring (results arrive every second), and otherwise every
+ *   SIM_IDLE_PASS_SECS.
+ * - Starting a measurement takes a free measurer slot of each class it needs,
+ *   on the host with the most capacity to spare for the bw it wants from that
+ *   class, connecting to each in turn. Connecting blocks the coordinator for
+ *   a round trip, and a measurer that can't be connected to is skipped for
+ *   the next free one. If there aren't enough measurers the measurement
+ *   fails.
+ * - Its measurers then go through AUTHENTICATE, TESTSPEED <fp>, and
+ *   RESETCONF. Each takes a round trip, plus building circuits for TESTSPEED,
+ *   and every measurer must be done with one before any moves to the next.
+ * - A measurer failing a step is replaced with the first free one of the same
+ *   class, connecting to which blocks the coordinator again. The substitute
+ *   goes through the steps so far on its own while the rest wait for it. A
+ *   measurement with no substitute to be had, or that has already had
+ *   SIM_MAX_SUBSTITUTES, fails.
+ * - Then all of them measure for the measurement's duration.
+ * - A failed measurement goes back to the sched crate, which may retry it
+ *   after a backoff, preferring measurers other than the ones it failed with.
+ *
+ * Time is virtual. It jumps from one event to the next, and the sched crate
+ * is told what time it is so retries come due in virtual time too.
+ */
+
+// like EV_TIMEOUT in flashflow.c
+#define SIM_IDLE_PASS_SECS 3.0
+// results arrive this often while measuring
+#define SIM_MEASURING_PASS_SECS 1.0
+#define SIM_MAX_CLASSES 32
+// like MAX_SUBSTITUTES in flashflow.c
+#define SIM_MAX_SUBSTITUTES 3
+
+enum sim_step {
+    sim_step_auth = 0,
+    sim_step_connect_target,
+    sim_step_set_bw,
+    sim_step_measure,
+    sim_step_done,
+};
+
+struct sim_params {
+    double rtt;
+    double jitter;
+    double circ;
+    double fail;
+    double timeline_interval;
+    const char *timeline_fname;
+};
+
+struct sim_msm {
+    unsigned id;
+    // how many times it has been started before
+    unsigned attempt;
+    enum sim_step step;
+    unsigned num_metas;
+    int *metas;
+    // replies still to come for the current step
+    unsigned pending;
+    unsigned num_substitutes;
+    int failed;
+    double start, measure_start, end;
+};
+
+struct sim_event {
+    double t;
+    unsigned m_id;
+    unsigned attempt;
+    enum sim_step step;
+    // which of the measurement's measurers this is from
+    unsigned k;
+    int ok;
+};
+
+/* A min heap of events by time */
+struct sim_heap {
+    struct sim_event *events;
+    size_t len, cap;
+};
+
+struct sim {
+    struct sim_params p;
+    double now;
+    struct sim_heap heap;
+    struct ctrl_sock_meta *metas;
+    int num_metas;
+    // class of each meta as an index into classes
+    int *meta_class;
+    char *classes[SIM_MAX_CLASSES];
+    int num_classes;
+    unsigned class_total[SIM_MAX_CLASSES];
+    unsigned class_busy[SIM_MAX_CLASSES];
+    double class_busy_secs[SIM_MAX_CLASSES];
+    double *meta_busy_since;
+    // m_id -> struct sim_msm
+    GHashTable *msms;
+    unsigned num_measuring;
+    unsigned long passes, num_success, num_failed, num_no_measurers, num_substitutes;
+    unsigned long num_retries;
+    FILE *timeline;
+    double next_sample;
+};
+
+static void
+sim_msm_free(struct sim_msm *m) {
+    free(m->metas);
+    free(m);
+}
+
+static void
+sim_heap_push(struct sim_heap *h, struct sim_event e) {
+    if (h->len == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 256;
+        h->events = realloc(h->events, h->cap * sizeof(struct sim_event));
+    }
+    size_t i = h->len++;
+    while (i > 0 && h->events[(i-1)/2].t > e.t) {
+        h->events[i] = h->events[(i-1)/2];
+        i = (i-1)/2;
+    }
+    h->events[i] = e;
+}
+
+static struct sim_event
+sim_heap_pop(struct sim_heap *h) {
+    assert(h->len);
+    struct sim_event top = h->events[0];
+    struct sim_event last = h->events[--h->len];
+    size_t i = 0;
+    while (1) {
+        size_t c = 2*i + 1;
+        if (c >= h->len)
+            break;
+        if (c + 1 < h->len && h->events[c+1].t < h->events[c].t)
+            c++;
+        if (last.t <= h->events[c].t)
+            break;
+        h->events[i] = h->events[c];
+        i = c;
+    }
+    if (h->len)
+        h->events[i] = last;
+    return top;
+}
+
+static double
+sim_rand(void) {
+    return (double)rand() / RAND_MAX;
+}
+
+static double
+sim_rtt(const struct sim *sim) {
+    const double rtt = sim->p.rtt + sim->p.jitter * (2 * sim_rand() - 1);
+    return rtt > 0 ? rtt : 0;
+}
+
+static int
+sim_class_idx(struct sim *sim, const char *class) {
+    for (int i = 0; i < sim->num_classes; i++) {
+        if (!strcmp(sim->classes[i], class))
+            return i;
+    }
+    return -1;
+}
+
+/* Write timeline rows for every sample time up to now. Nothing changes
+ * between events, so the busy counts as they are now hold for all of them. */
+static void
+sim_advance(struct sim *sim, const double t) {
+    assert(t >= sim->now);
+    while (sim->timeline && sim->next_sample <= t) {
+        fprintf(sim->timeline, "%.0f", sim->next_sample);
+        for (int c = 0; c < sim->num_classes; c++)
+            fprintf(sim->timeline, ",%u", sim->class_busy[c]);
+        fprintf(sim->timeline, ",%u\n", sim->num_measuring);
+        sim->next_sample += sim->p.timeline_interval;
+    }
+    sim->now = t;
+}
+
+static void
+sim_busy_meta(struct sim *sim, const int i, const unsigned m_id, const unsigned bw) {
+    sim->metas[i].current_m_id = m_id;
+    tc_reserve_capacity(&sim->metas[i], m_id, bw);
+    sim->class_busy[sim->meta_class[i]]++;
+    sim->meta_busy_since[i] = sim->now;
+}
+
+static void
+sim_idle_meta(struct sim *sim, const int i) {
+    sim->metas[i].current_m_id = 0;
+    tc_release_capacity(&sim->metas[i]);
+    sim->class_busy[sim->meta_class[i]]--;
+    sim->class_busy_secs[sim->meta_class[i]] += sim->now - sim->meta_busy_since[i];
+}
+
+static void
+sim_take_meta(struct sim *sim, struct sim_msm *m, const int i, const unsigned bw) {
+    sim_busy_meta(sim, i, m->id, bw);
+    m->metas[m->num_metas++] = i;
+}
+
+static void
+sim_release_metas(struct sim *sim, struct sim_msm *m) {
+    for (unsigned k = 0; k < m->num_metas; k++)
+        sim_idle_meta(sim, m->metas[k]);
+    m->num_metas = 0;
+}
+
+/* Connect to the first free measurer of class c with bw to spare for m_id
+ * that we can, the way tc_next_available() does. Returns -1 if there isn't
+ * one. */
+static int
+sim_connect_free(
+        struct sim *sim, const int c, const unsigned m_id, const unsigned bw,
+        char *const avoid[], const size_t num_avoid) {
+    int *order = malloc(sim->num_metas * sizeof(int));
+    const size_t n = tc_candidates(
+        sim->num_metas, sim->metas, sim->classes[c], m_id, bw, avoid, num_avoid, order);
+    int found = -1;
+    for (size_t k = 0; k < n && found < 0; k++) {
+        // connecting blocks the coordinator
+        sim_advance(sim, sim->now + sim_rtt(sim));
+        if (sim_rand() >= sim->p.fail)
+            found = order[k];
+    }
+    free(order);
+    return found;
+}
+
+/* If failed, hand m back to the sched crate the way measurement_failed()
+ * does, along with the measurers it had */
+static void
+sim_finish(struct sim *sim, struct sim_msm *m, const unsigned fail_reason, const int failed) {
+    char **addrs = NULL;
+    size_t num_addrs = 0;
+    if (failed) {
+        addrs = calloc(m->num_metas ? m->num_metas : 1, sizeof(char *));
+        for (unsigned k = 0; k < m->num_metas; k++) {
+            const struct ctrl_sock_meta *meta = &sim->metas[m->metas[k]];
+            addrs[num_addrs++] = g_strdup_printf("%s:%s", meta->host, meta->port);
+        }
+    }
+    if (m->step == sim_step_measure)
+        sim->num_measuring--;
+    sim_release_metas(sim, m);
+    m->failed = failed;
+    m->step = sim_step_done;
+    m->end = sim->now;
+    if (!failed) {
+        sched_mark_done(m->id);
+        sim->num_success++;
+    } else if (sched_mark_failed(m->id, fail_reason, (const char *const *)addrs, num_addrs)) {
+        sim->num_retries++;
+    } else {
+        sim->num_failed++;
+    }
+    for (size_t i = 0; i < num_addrs; i++)
+        g_free(addrs[i]);
+    free(addrs);
+}
+
+/* Send every measurer of m what it needs for the step m is on */
+static void
+sim_send_step(struct sim *sim, struct sim_msm *m) {
+    const double dur = m->step == sim_step_measure ? sched_get_dur(m->id) : 0;
+    m->pending = m->num_metas;
+    for (unsigned k = 0; k < m->num_metas; k++) {
+        struct sim_event e;
+        e.m_id = m->id;
+        e.attempt = m->attempt;
+        e.step = m->step;
+        e.k = k;
+        e.ok = m->step == sim_step_measure || sim_rand() >= sim->p.fail;
+        e.t = sim->now + sim_rtt(sim);
+        if (m->step == sim_step_connect_target)
+            e.t += sim->p.circ;
+        else if (m->step == sim_step_measure)
+            e.t += dur;
+        sim_heap_push(&sim->heap, e);
+    }
+}
+
+/* Start measurement d the way find_and_connect_metas() does */
+static void
+sim_start(struct sim *sim, const struct SchedMsm *d) {
+    struct sim_msm *m = g_hash_table_lookup(sim->msms, GUINT_TO_POINTER(d->id));
+    if (!m) {
+        m = calloc(1, sizeof(struct sim_msm));
+        m->id = d->id;
+        m->metas = calloc(d->num_hosts ? d->num_hosts : 1, sizeof(int));
+        g_hash_table_insert(sim->msms, GUINT_TO_POINTER(d->id), m);
+    }
+    // a retry starts over from scratch
+    m->attempt = d->attempt;
+    m->step = sim_step_auth;
+    m->num_substitutes = 0;
+    m->failed = 0;
+    m->start = sim->now;
+    m->measure_start = m->end = 0;
+    int found_all = 1;
+    for (size_t h = 0; h < d->num_hosts && found_all; h++) {
+        const int c = sim_class_idx(sim, d->classes[h]);
+        const int i = c < 0 ? -1 : sim_connect_free(sim, c, m->id, d->bws[h], d->avoid, d->num_avoid);
+        if ((found_all = i >= 0))
+            sim_take_meta(sim, m, i, d->bws[h]);
+    }
+    if (!found_all) {
+        sim->num_no_measurers++;
+        sim_finish(sim, m, SCHED_FAIL_NO_MEASURERS, 1);
+        return;
+    }
+    m->step = sim_step_auth;
+    sim_send_step(sim, m);
+}
+
+/* m's k'th measurer failed the step m is on. Replace it the way
+ * substitute_meta() does, and have the substitute catch up on its own.
+ * Returns false if there is no substitute. */
+static int
+sim_substitute(struct sim *sim, struct sim_msm *m, const unsigned k) {
+    if (m->num_substitutes >= SIM_MAX_SUBSTITUTES)
+        return 0;
+    const int failed = m->metas[k];
+    const unsigned bw = sim->metas[failed].bw;
+    const int sub = sim_connect_free(sim, sim->meta_class[failed], m->id, bw, NULL, 0);
+    if (sub < 0)
+        return 0;
+    m->num_substitutes++;
+    sim->num_substitutes++;
+    sim_idle_meta(sim, failed);
+    sim_busy_meta(sim, sub, m->id, bw);
+    m->metas[k] = sub;
+    struct sim_event e;
+    e.m_id = m->id;
+    e.attempt = m->attempt;
+    e.step = m->step;
+    e.k = k;
+    e.ok = 1;
+    e.t = sim->now;
+    for (enum sim_step step = sim_step_auth; step <= m->step; step++) {
+        e.t += sim_rtt(sim);
+        if (step == sim_step_connect_target)
+            e.t += sim->p.circ;
+        e.ok = e.ok && sim_rand() >= sim->p.fail;
+    }
+    sim_heap_push(&sim->heap, e);
+    return 1;
+}
+
+static void
+sim_handle(struct sim *sim, const struct sim_event *e) {
+    struct sim_msm *m = g_hash_table_lookup(sim->msms, GUINT_TO_POINTER(e->m_id));
+    // a reply for a measurement, or an attempt at one, that has already failed
+    if (!m || m->attempt != e->attempt || m->step != e->step)
+        return;
+    if (!e->ok) {
+        if (!sim_substitute(sim, m, e->k))
+            sim_finish(sim, m, SCHED_FAIL_SETUP, 1);
+        return;
+    }
+    if (--m->pending)
+        return;
+    if (m->step == sim_step_measure) {
+        sim_finish(sim, m, 0, 0);
+        return;
+    }
+    m->step++;
+    if (m->step == sim_step_measure) {
+        m->measure_start = sim->now;
+        sim->num_measuring++;
+    }
+    sim_send_step(sim, m);
+}
+
+/* One time around the coordinator's main loop. Returns true if it started a
+ * measurement. */
+static int
+sim_pass(struct sim *sim) {
+    struct SchedMsm *d;
+    sim->passes++;
+    sched_set_now((uint64_t)sim->now);
+    if (sched_next_many(1, &d) > 0) {
+        sim_start(sim, d);
+        free(d);
+        return 1;
+    }
+    return 0;
+}
+
+static struct sim_msm *
+sim_msm(const struct sim *sim, const unsigned m_id) {
+    return g_hash_table_lookup(sim->msms, GUINT_TO_POINTER(m_id));
+}
+
+/* Walk back from the last measurement to finish through whichever of its
+ * depends finished last, and report where the time on that path went */
+static void
+sim_report_critical_path(const struct sim *sim) {
+    GHashTableIter iter;
+    gpointer k, v;
+    struct sim_msm *last = NULL;
+    g_hash_table_iter_init(&iter, sim->msms);
+    while (g_hash_table_iter_next(&iter, &k, &v)) {
+        struct sim_msm *m = v;
+        if (!last || m->end > last->end)
+            last = m;
+    }
+    if (!last)
+        return;
+    unsigned *path = NULL;
+    size_t path_len = 0, path_cap = 0;
+    double waiting = 0, setup = 0, measuring = 0;
+    for (struct sim_msm *m = last; m;) {
+        uint32_t *deps;
+        const size_t num_deps = sched_get_depends(m->id, &deps);
+        struct sim_msm *pred = NULL;
+        for (size_t i = 0; i < num_deps; i++) {
+            struct sim_msm *d = sim_msm(sim, deps[i]);
+            if (d && (!pred || d->end > pred->end))
+                pred = d;
+        }
+        sched_free_depends(deps, num_deps);
+        if (path_len == path_cap) {
+            path_cap = path_cap ? path_cap * 2 : 64;
+            path = realloc(path, path_cap * sizeof(unsigned));
+        }
+        path[path_len++] = m->id;
+        waiting += m->start - (pred ? pred->end : 0);
+        if (m->measure_start > 0) {
+            setup += m->measure_start - m->start;
+            measuring += m->end - m->measure_start;
+        } else {
+            setup += m->end - m->start;
+        }
+        m = pred;
+    }
+    printf("Critical path: %lu measurements ending at %.0fs: %.0fs measuring, "
+        "%.0fs setting up, %.0fs waiting to be started\n",
+        path_len, last->end, measuring, setup, waiting);
+    printf("  ");
+    for (size_t i = path_len; i-- > 0;) {
+        // just the ends of a long path
+        if (path_len > 20 && i == path_len - 11) {
+            printf("... ");
+            i = 10;
+        }
+        printf("%u%s", path[i], i ? " -> " : "\n");
+    }
+    free(path);
+}
+
+static void
+sim_report(const struct sim *sim, const double real_secs) {
+    // failed without being started because a depend failed for good
+    const unsigned long num_doomed = sched_num_failed() - sim->num_failed;
+    printf("Simulated %lu measurements in %.3fs: %lu succeeded, %lu failed "
+        "(%lu attempts for lack of measurers, %lu never started), "
+        "%lu measurers substituted, %lu retries\n",
+        sim->num_success + sim->num_failed + num_doomed, real_secs,
+        sim->num_success, sim->num_failed + num_doomed, sim->num_no_measurers,
+        num_doomed, sim->num_substitutes, sim->num_retries);
+    printf("Predicted total time: %.0fs (%.2fh) over %lu main loops\n",
+        sim->now, sim->now / 3600, sim->passes);
+    for (int c = 0; c < sim->num_classes; c++) {
+        const double avail = sim->class_total[c] * sim->now;
+        printf("Class %s: %u measurers, %.1f%% busy\n",
+            sim->classes[c], sim->class_total[c],
+            avail > 0 ? 100 * sim->class_busy_secs[c] / avail : 0);
+    }
+    sim_report_critical_path(sim);
+}
+
+static void
+sim_usage(void) {
+    const char *s = \
+    "arguments: sim [options] <fingerprint_file> <client_file>\n"
+    "\n"
+    "-r ms      round trip time to each measurer (default 50)\n"
+    "-j ms      round trip times vary by up to this much either way (default 10)\n"
+    "-c ms      time for a measurer to build circuits to a relay (default 500)\n"
+    "-f frac    chance each connection and command to a measurer fails (default 0)\n"
+    "-s seed    random seed (default 1)\n"
+    "-t file    write how many measurers of each class are busy over time to file\n"
+    "-i secs    how often to write to the -t file (default 60)\n"
+    "-p policy  order to start ready measurements in: critical-path (default)\n"
+    "           or fifo\n"
+    "-l n       retry each failed measurement at most n times, whatever it\n"
+    "           failed for\n"
+    "-R         fail measurements that depend on one that failed for good\n";
+    LOG("%s", s);
+}
+
+int
+sim_main(int argc, char *argv[]) {
+    struct sim sim;
+    int opt;
+    unsigned seed = 1;
+    memset(&sim, 0, sizeof(sim));
+    sim.p.rtt = 0.050;
+    sim.p.jitter = 0.010;
+    sim.p.circ = 0.500;
+    sim.p.timeline_interval = 60;
+    while ((opt = getopt(argc, argv, "r:j:c:f:s:t:i:p:l:R")) != -1) {
+        switch (opt) {
+        case 'r': sim.p.rtt = atof(optarg) / 1000; break;
+        case 'j': sim.p.jitter = atof(optarg) / 1000; break;
+        case 'c': sim.p.circ = atof(optarg) / 1000; break;
+        case 'f': sim.p.fail = atof(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 't': sim.p.timeline_fname = optarg; break;
+        case 'i': sim.p.timeline_interval = atof(optarg); break;
+        case 'p':
+            if (!strcmp(optarg, "critical-path")) {
+                sched_set_policy(SCHED_POLICY_CRITICAL_PATH);
+            } else if (!strcmp(optarg, "fifo")) {
+                sched_set_policy(SCHED_POLICY_FIFO);
+            } else {
+                sim_usage();
+                return -1;
+            }
+            break;
+        case 'l':
+            for (unsigned r = 0; r <= SCHED_FAIL_TIMEOUT; r++)
+                sched_set_retry_limit(r, strtoul(optarg, NULL, 10));
+            break;
+        case 'R': sched_set_require_success(1); break;
+        default: sim_usage(); return -1;
+        }
+    }
+    if (argc - optind != 2 || sim.p.timeline_interval <= 0 ||
+            sim.p.fail < 0 || sim.p.fail > 1) {
+        sim_usage();
+        return -1;
+    }
+    const char *fp_fname = argv[optind];
+    const char *client_fname = argv[optind + 1];
+    srand(seed);
+    sim.metas = calloc(MAX_NUM_CTRL_SOCKS, sizeof(struct ctrl_sock_meta));
+    if ((sim.num_metas = tc_client_file_read(client_fname, sim.metas)) < 1) {
+        LOG("Error reading %s or it was empty\n", client_fname);
+        return -1;
+    }
+    sim.meta_class = calloc(sim.num_metas, sizeof(int));
+    sim.meta_busy_since = calloc(sim.num_metas, sizeof(double));
+    for (int i = 0; i < sim.num_metas; i++) {
+        int c = sim_class_idx(&sim, sim.metas[i].class);
+        if (c < 0) {
+            if (sim.num_classes == SIM_MAX_CLASSES) {
+                LOG("More than %d classes of measurer in %s\n", SIM_MAX_CLASSES, client_fname);
+                return -1;
+            }
+            c = sim.num_classes++;
+            sim.classes[c] = sim.metas[i].class;
+        }
+        sim.meta_class[i] = c;
+        sim.class_total[c]++;
+    }
+    if (!sched_new(fp_fname)) {
+        LOG("Empty sched from %s or error\n", fp_fname);
+        return -1;
+    }
+    if (sim.p.timeline_fname) {
+        if (!(sim.timeline = fopen(sim.p.timeline_fname, "w"))) {
+            perror("Unable to open timeline file");
+            return -1;
+        }
+        fprintf(sim.timeline, "t");
+        for (int c = 0; c < sim.num_classes; c++)
+            fprintf(sim.timeline, ",%s", sim.classes[c]);
+        fprintf(sim.timeline, ",measuring\n");
+    }
+    sim.msms = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)sim_msm_free);
+    struct timespec real_start, real_end;
+    clock_gettime(CLOCK_MONOTONIC, &real_start);
+    unsigned long idle_passes = 0;
+    sim_pass(&sim);
+    while (!sched_finished()) {
+        // the main loop comes around for the next reply, or on its own if
+        // that's sooner
+        const double next_pass = sim.now +
+            (sim.num_measuring ? SIM_MEASURING_PASS_SECS : SIM_IDLE_PASS_SECS);
+        if (sim.heap.len && sim.heap.events[0].t <= next_pass) {
+            struct sim_event e = sim_heap_pop(&sim.heap);
+            sim_advance(&sim, e.t > sim.now ? e.t : sim.now);
+            sim_handle(&sim, &e);
+            idle_passes = 0;
+        } else {
+            sim_advance(&sim, next_pass);
+            if (!sim.heap.len && ++idle_passes > 1000) {
+                LOG("Nothing running and nothing can start. Giving up.\n");
+                break;
+            }
+        }
+        if (sim_pass(&sim))
+            idle_passes = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &real_end);
+    sim_advance(&sim, sim.now);
+    if (sim.timeline)
+        fclose(sim.timeline);
+    sim_report(&sim, (real_end.tv_sec - real_start.tv_sec) +
+        (real_end.tv_nsec - real_start.tv_nsec) / 1e9);
+    g_hash_table_destroy(sim.msms);
+    free(sim.heap.events);
+    for (int i = 0; i < sim.num_metas; i++)
+        free_ctrl_sock_meta(sim.metas[i]);
+    free(sim.metas);
+    free(sim.meta_class);
+    free(sim.meta_busy_since);
+    return 0;
+}
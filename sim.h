@@ -0,0 +1,5 @@
+#ifndef FF_SIM_H
+#define FF_SIM_H
+#include "common.h"
+int sim_main(int argc, char *argv[]);
+#endif /* !defined(FF_SIM_H) */
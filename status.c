@@ -0,0 +1,246 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "status.h"
+#include "results.h"
+
+/*
+ * Answers anyone who connects to a Unix socket with a snapshot of what the
+ * coordinator is doing, as one JSON object, then hangs up. Everything happens
+ * from the coordinator's own loop and nothing blocks: the socket is
+ * non-blocking, and a snapshot that doesn't fit in the socket's buffer is sent
+ * a bit more each time around the loop.
+ *
+ * The coordinator writes most of the snapshot. We add recent throughput, which
+ * we keep in one bucket per second from the result events as they happen, so
+ * a snapshot costs the same however long the coordinator has been running.
+ */
+
+// connections we are still sending a snapshot to
+#define ST_MAX_CONNS 64
+// give up on a connection that hasn't read its snapshot after this long
+#define ST_CONN_TIMEOUT_SECS 10
+
+struct st_conn {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t sent;
+    time_t since;
+};
+
+struct st_bucket {
+    // the second this bucket is for. Buckets for other seconds are stale.
+    time_t sec;
+    // bw summed over every measurement's complete seconds
+    long bw;
+    unsigned seconds;
+    unsigned done;
+    unsigned failed;
+};
+
+struct st_server {
+    int fd;
+    char *path;
+    struct st_conn conns[ST_MAX_CONNS];
+    int num_conns;
+    struct st_bucket buckets[ST_WINDOW_SECS];
+};
+
+/**
+ * Listen for connections on a Unix socket at path, replacing whatever is
+ * there. Returns NULL on error.
+ */
+struct st_server *
+st_new(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG("Status socket path %s is too long\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        LOG("Unable to make status socket: %s\n", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, ST_MAX_CONNS) < 0) {
+        LOG("Unable to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    struct st_server *st = calloc(1, sizeof(struct st_server));
+    st->fd = fd;
+    st->path = strdup(path);
+    return st;
+}
+
+/**
+ * The listening socket, to wait on with the event loop
+ */
+int
+st_fd(const struct st_server *st) {
+    return st->fd;
+}
+
+static struct st_bucket *
+st_bucket_now(struct st_server *st) {
+    const time_t now = time(NULL);
+    struct st_bucket *b = &st->buckets[now % ST_WINDOW_SECS];
+    if (b->sec != now) {
+        memset(b, 0, sizeof(*b));
+        b->sec = now;
+    }
+    return b;
+}
+
+static void
+st_count(const struct res_event *ev, void *arg) {
+    struct st_server *st = arg;
+    switch (ev->kind) {
+        case res_second:
+            st_bucket_now(st)->bw += ev->bw + ev->bg_bw;
+            st_bucket_now(st)->seconds++;
+            break;
+        case res_done:
+            if (ev->ok) {
+                st_bucket_now(st)->done++;
+            } else {
+                st_bucket_now(st)->failed++;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Count the results on bus toward recent throughput
+ */
+void
+st_watch_results(struct st_server *st, struct res_bus *bus) {
+    res_bus_add_callback(bus, st_count, st);
+}
+
+/**
+ * Write s to f as a JSON string
+ */
+void
+st_json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void
+st_write_throughput(const struct st_server *st, FILE *f) {
+    const time_t now = time(NULL);
+    long bw = 0;
+    unsigned seconds = 0, done = 0, failed = 0;
+    for (int i = 0; i < ST_WINDOW_SECS; i++) {
+        const struct st_bucket *b = &st->buckets[i];
+        if (b->sec > now - ST_WINDOW_SECS && b->sec <= now) {
+            bw += b->bw;
+            seconds += b->seconds;
+            done += b->done;
+            failed += b->failed;
+        }
+    }
+    fprintf(f, "\"throughput\":{\"window_secs\":%d,\"bw_per_sec\":%ld,"
+        "\"results_per_sec\":%.2f,\"done\":%u,\"failed\":%u}",
+        ST_WINDOW_SECS, bw / ST_WINDOW_SECS, (double)seconds / ST_WINDOW_SECS, done, failed);
+}
+
+static void
+st_conn_close(struct st_server *st, const int i) {
+    close(st->conns[i].fd);
+    free(st->conns[i].buf);
+    st->conns[i] = st->conns[--st->num_conns];
+}
+
+/**
+ * Send as much of each waiting snapshot as the sockets will take, and hang up
+ * on those that are done or have been waiting too long
+ */
+static void
+st_flush(struct st_server *st) {
+    const time_t now = time(NULL);
+    for (int i = 0; i < st->num_conns; i++) {
+        struct st_conn *c = &st->conns[i];
+        int gone = 0;
+        while (c->sent < c->len) {
+            const ssize_t n = send(c->fd, c->buf + c->sent, c->len - c->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0) {
+                gone = 1;
+                break;
+            }
+            c->sent += n;
+        }
+        if (gone || c->sent == c->len || now - c->since > ST_CONN_TIMEOUT_SECS)
+            st_conn_close(st, i--);
+    }
+}
+
+/**
+ * Accept everyone waiting to connect and give each a snapshot: whatever
+ * write_fn writes to the FILE it is given (JSON object members, without the
+ * braces) followed by recent throughput. Also carries on sending snapshots
+ * from before. Call every time around the main loop.
+ */
+void
+st_serve(struct st_server *st, st_write_fn write_fn, void *arg) {
+    int fd;
+    while ((fd = accept(st->fd, NULL, NULL)) >= 0) {
+        if (st->num_conns == ST_MAX_CONNS || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            LOG("Too many status connections or unable to make one non-blocking. Hanging up on it\n");
+            close(fd);
+            continue;
+        }
+        struct st_conn *c = &st->conns[st->num_conns++];
+        FILE *f = open_memstream(&c->buf, &c->len);
+        fputc('{', f);
+        write_fn(f, arg);
+        fputc(',', f);
+        st_write_throughput(st, f);
+        fputs("}\n", f);
+        fclose(f);
+        c->fd = fd;
+        c->sent = 0;
+        c->since = time(NULL);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG("Error accepting status connection: %s\n", strerror(errno));
+    }
+    st_flush(st);
+}
+
+void
+st_free(struct st_server *st) {
+    if (!st)
+        return;
+    while (st->num_conns)
+        st_conn_close(st, 0);
+    close(st->fd);
+    unlink(st->path);
+    free(st->path);
+    free(st);
+}
@@ -0,0 +1,16 @@
+#ifndef FF_STATUS_H
+#define FF_STATUS_H
+#include <stdio.h>
+#include "common.h"
+// how far back recent throughput goes
+#define ST_WINDOW_SECS 60
+struct st_server;
+struct res_bus;
+typedef void (*st_write_fn)(FILE *f, void *arg);
+struct st_server *st_new(const char *path);
+int st_fd(const struct st_server *st);
+void st_watch_results(struct st_server *st, struct res_bus *bus);
+void st_serve(struct st_server *st, st_write_fn write_fn, void *arg);
+void st_json_str(FILE *f, const char *s);
+void st_free(struct st_server *st);
+#endif /* !defined(FF_STATUS_H) */
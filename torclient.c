@@ -5,10 +5,38 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <time.h>
 #include <assert.h>
 
 #include "common.h"
 #include "torclient.h"
+#include "converge.h"
+#include "evloop.h"
+#include "results.h"
+#include "trace.h"
+
+// If set, all control socket I/O from this thread goes through this instead
+// of straight to the socket
+static __thread struct evloop *tc_ev = NULL;
+
+void
+tc_set_evloop(struct evloop *ev) {
+    tc_ev = ev;
+}
+
+static ssize_t
+tc_recv(const struct ctrl_sock_meta *meta, void *buf, const size_t len) {
+    if (tc_ev)
+        return ev_recv(tc_ev, meta->fd, buf, len);
+    return recv(meta->fd, buf, len, 0);
+}
+
+static ssize_t
+tc_send(const struct ctrl_sock_meta *meta, const char *msg) {
+    if (tc_ev)
+        return ev_send(tc_ev, meta->fd, msg, strlen(msg));
+    return send(meta->fd, msg, strlen(msg), 0);
+}
 
 /**
  * Change the state of the given meta, and assert on invalid state changes.
@@ -119,6 +147,14 @@ tc_change_state_(struct ctrl_sock_meta *meta, enum csm_state new_state, const ch
 tc_good_state_change:
     LOG("Changing from %s to %s on %s at %s@%s:%d\n", csm_st_str(old_state), csm_st_str(new_state), desc_meta(meta), func, file, line);
     meta->state = new_state;
+    if (tr_on()) {
+        if (!meta->trace_track) {
+            char name[256];
+            snprintf(name, sizeof(name), "%s %s:%s#%u", meta->class, meta->host, meta->port, meta->slot);
+            meta->trace_track = tr_track(name);
+        }
+        tr_event(tr_meta_state, meta->trace_track, meta->current_m_id, old_state, new_state, 0);
+    }
     return;
 tc_bad_state_change:
     LOG("Invalid new_state=%s when old_state=%s on %s at %s@%s:%d\n", csm_st_str(new_state), csm_st_str(old_state), desc_meta(meta), func, file, line);
@@ -128,9 +164,11 @@ tc_bad_state_change:
 
 /**
  * Read all the lines from fname and store tor client info in the given
- * ctrl_sock_meta array, which should be MAX_NUM_CTRL_SOCKS in size. Returns
- * the number of lines with data parsed successfully (no empty lines, no
- * comments). The fd in each struct is not valid yet. Returns -1 on error.
+ * ctrl_sock_meta array, which should be MAX_NUM_CTRL_SOCKS in size. Each line
+ * is "class host port pw [capacity [slots]]". A line with more than one slot
+ * gets one meta per slot, all sharing the host's capacity (in the same units
+ * as the bws in the schedule, 0 for no limit). Returns the number of metas
+ * filled in. The fd in each struct is not valid yet. Returns -1 on error.
  */
 int
 tc_client_file_read(const char *fname, struct ctrl_sock_meta metas[]) {
@@ -143,21 +181,27 @@ tc_client_file_read(const char *fname, struct ctrl_sock_meta metas[]) {
     size_t cap = 0;
     ssize_t bytes_read;
     int count = 0;
+    int line_num = 0;
     while (count < MAX_NUM_CTRL_SOCKS) {
+        errno = 0;
         bytes_read = getline(&line, &cap, fd);
         if (bytes_read < 0) {
             if (errno) {
                 perror("Error getting line from client file");
             }
-            return count;
+            break;
         }
+        line_num++;
         if (!bytes_read || line[0] == '#')
             continue;
-        char *token, *head, *tofree;
+        char *token, *head, *tofree, *end;
         char *class = NULL, *host = NULL, *port = NULL, *pw = NULL;
+        unsigned long long capacity = 0;
+        unsigned long num_slots = 1;
         int token_num = 0;
+        int bad = 0;
         tofree = head = strdup(line);
-        while ((token = strsep(&head, " \n"))) {
+        while (!bad && (token = strsep(&head, " \n"))) {
             if (!strlen(token))
                 continue;
             switch (token_num) {
@@ -165,35 +209,125 @@ tc_client_file_read(const char *fname, struct ctrl_sock_meta metas[]) {
                 case 1: host = strdup(token); break;
                 case 2: port = strdup(token); break;
                 case 3: pw = strdup(token); break;
+                case 4:
+                    capacity = strtoull(token, &end, 10);
+                    bad = *end || token[0] == '-';
+                    break;
+                case 5:
+                    num_slots = strtoul(token, &end, 10);
+                    bad = *end || token[0] == '-' || !num_slots;
+                    break;
                 default:
-                    free(class);
-                    free(host);
-                    free(port);
-                    free(pw);
+                    bad = 1;
                     break;
             }
             token_num++;
         }
-        if (!class || !host || !port || !pw || token_num != 4)
-            continue;
         free(tofree);
+        if (bad || (token_num > 0 && token_num < 4)) {
+            LOG("%s:%d: expected 'class host port pw [capacity [slots]]' with a whole "
+                "number for capacity and at least 1 slot. Skipping it\n",
+                fname, line_num);
+        }
+        if (bad || token_num < 4) {
+            free(class);
+            free(host);
+            free(port);
+            free(pw);
+            continue;
+        }
         int is_bg = !strncmp(class, "bg", 2);
-        LOG("read client config class='%s' host='%s' port='%s' pw='%s' is_bg='%d'\n", class, host, port, pw, is_bg);
-        metas[count].fd = -1;
-        metas[count].state = csm_st_invalid;
-        metas[count].class = class;
-        metas[count].host = host;
-        metas[count].port = port;
-        metas[count].pw = pw;
-        metas[count].is_bg = is_bg;
-        metas[count].current_m_id = 0;
-        count++;
+        LOG("read client config class='%s' host='%s' port='%s' pw='%s' is_bg='%d' capacity=%llu slots=%lu\n",
+            class, host, port, pw, is_bg, capacity, num_slots);
+        struct ctrl_sock_host *shared = calloc(1, sizeof(struct ctrl_sock_host));
+        shared->capacity = capacity;
+        shared->num_slots = num_slots;
+        shared->slot_m_ids = calloc(num_slots, sizeof(unsigned));
+        for (unsigned slot = 0; slot < num_slots && count < MAX_NUM_CTRL_SOCKS; slot++) {
+            metas[count].fd = -1;
+            metas[count].state = csm_st_invalid;
+            metas[count].class = slot ? strdup(class) : class;
+            metas[count].host = slot ? strdup(host) : host;
+            metas[count].port = slot ? strdup(port) : port;
+            metas[count].pw = slot ? strdup(pw) : pw;
+            metas[count].is_bg = is_bg;
+            metas[count].current_m_id = 0;
+            metas[count].slot = slot;
+            metas[count].bw = 0;
+            metas[count].stopping = 0;
+            metas[count].stopping_failsafe = 0;
+            metas[count].shared = shared;
+            shared->refs++;
+            count++;
+        }
     }
     free(line);
     fclose(fd);
     return count;
 }
 
+/**
+ * Re-read the client file and append any tor clients we don't already know
+ * about (by class, host, and port) to the end of the given metas array, which
+ * currently holds num_metas valid entries. Existing metas are left untouched,
+ * even if their line has since been removed from the file, as they may be in
+ * the middle of a measurement. Returns the new number of valid metas, or -1 on
+ * error.
+ */
+int
+tc_client_file_merge(const char *fname, struct ctrl_sock_meta metas[], const int num_metas) {
+    struct ctrl_sock_meta *new_metas = calloc(MAX_NUM_CTRL_SOCKS, sizeof(struct ctrl_sock_meta));
+    int num_new_metas;
+    int count = num_metas;
+    if ((num_new_metas = tc_client_file_read(fname, new_metas)) < 0) {
+        free(new_metas);
+        return -1;
+    }
+    for (int i = 0; i < num_new_metas; i++) {
+        int known = 0;
+        struct ctrl_sock_host *known_host = NULL;
+        for (int j = 0; j < num_metas; j++) {
+            if (!strcmp(new_metas[i].class, metas[j].class) &&
+                    !strcmp(new_metas[i].host, metas[j].host) &&
+                    !strcmp(new_metas[i].port, metas[j].port)) {
+                known_host = metas[j].shared;
+                if (new_metas[i].slot == metas[j].slot) {
+                    known = 1;
+                    break;
+                }
+            }
+        }
+        if (known || count >= MAX_NUM_CTRL_SOCKS) {
+            if (!known)
+                LOG("Already know about %d tor clients. Ignoring new one %s:%s\n",
+                    count, new_metas[i].host, new_metas[i].port);
+            free_ctrl_sock_meta(new_metas[i]);
+            continue;
+        }
+        if (known_host) {
+            // a new slot on a host we already know about, which shares its
+            // capacity with the host's other slots
+            struct ctrl_sock_host *shared = new_metas[i].shared;
+            if (!--shared->refs) {
+                free(shared->slot_m_ids);
+                free(shared);
+            }
+            if (new_metas[i].slot >= known_host->num_slots) {
+                known_host->slot_m_ids = realloc(known_host->slot_m_ids, (new_metas[i].slot + 1) * sizeof(unsigned));
+                for (unsigned s = known_host->num_slots; s <= new_metas[i].slot; s++)
+                    known_host->slot_m_ids[s] = 0;
+                known_host->num_slots = new_metas[i].slot + 1;
+            }
+            new_metas[i].shared = known_host;
+            known_host->refs++;
+        }
+        LOG("Adding new tor client %s\n", desc_meta(&new_metas[i]));
+        metas[count++] = new_metas[i];
+    }
+    free(new_metas);
+    return count;
+}
+
 /**
  * build a socket to tor's control port
  * returns -1 if error, otherwise socket
@@ -238,7 +372,6 @@ int
 tc_auth_socket(struct ctrl_sock_meta *meta) {
     tc_assert_state(meta, csm_st_connected);
     char msg[80];
-    int s = meta->fd;
     const char *ctrl_pw = meta->pw;
     tc_assert_state(meta, csm_st_connected);
     if (!ctrl_pw)
@@ -247,7 +380,7 @@ tc_auth_socket(struct ctrl_sock_meta *meta) {
         perror("Error snprintf auth message");
         return 0;
     }
-    if (send(s, msg, strlen(msg), 0) < 0) {
+    if (tc_send(meta, msg) < 0) {
         perror("Error sending auth message");
         return 0;
     }
@@ -265,7 +398,7 @@ tc_authed_socket(struct ctrl_sock_meta *meta) {
     char buf[READ_BUF_LEN];
     int len;
     const char *good_resp = "250 OK";
-    if ((len = recv(meta->fd, buf, READ_BUF_LEN, 0)) < 0) {
+    if ((len = tc_recv(meta, buf, READ_BUF_LEN)) < 0) {
         perror("Error receiving auth response");
         return 0;
     }
@@ -293,7 +426,7 @@ tc_tell_connect(struct ctrl_sock_meta *meta, const char *fp, const unsigned conn
         LOG("Error making msg in tc_tell_connect()");
         return 0;
     }
-    if (send(meta->fd, msg, strlen(msg), 0) < 0) {
+    if (tc_send(meta, msg) < 0) {
         perror("Error sending msg in tc_tell_connect()");
         return 0;
     }
@@ -310,7 +443,7 @@ tc_connected_socket(struct ctrl_sock_meta *meta) {
     char buf[READ_BUF_LEN];
     int len;
     const char *good_resp = "250 SPEEDTESTING";
-    if ((len = recv(meta->fd, buf, READ_BUF_LEN, 0)) < 0) {
+    if ((len = tc_recv(meta, buf, READ_BUF_LEN)) < 0) {
         perror("Error receiving connect-to-target response");
         return 0;
     }
@@ -335,7 +468,7 @@ tc_set_bw_rate(struct ctrl_sock_meta *meta, const unsigned bw) {
         perror("Error snprintf RESETCONF bw rate/burst");
         return 0;
     }
-    if (send(meta->fd, msg, strlen(msg), 0) < 0) {
+    if (tc_send(meta, msg) < 0) {
         perror("Error sending RESETCONF bw rate/burst message");
         return 0;
     }
@@ -349,7 +482,7 @@ tc_did_set_bw_rate(struct ctrl_sock_meta *meta) {
     char buf[READ_BUF_LEN];
     int len;
     const char *good_resp = "250 OK";
-    if ((len = recv(meta->fd, buf, READ_BUF_LEN, 0)) < 0) {
+    if ((len = tc_recv(meta, buf, READ_BUF_LEN)) < 0) {
         perror("Error receiving did-set-bw response");
         return 0;
     }
@@ -362,33 +495,53 @@ tc_did_set_bw_rate(struct ctrl_sock_meta *meta) {
     return 1;
 }
 
+/**
+ * Tell the num_metas metas to measure for dur secs, as close to all at once as
+ * we can. The command is made once and sent to each with nothing in between,
+ * then all sent at once if the event loop queues them. Logging and state
+ * changes wait until they have all gone out. *skew_us is set to how long that
+ * took, from the first send to the last. Returns how many were told; if fewer
+ * than num_metas, the one after them couldn't be.
+ */
 int
-tc_start_measurement(struct ctrl_sock_meta *meta, const unsigned dur) {
-    LOG("Telling %s to measure for %u secs\n", desc_meta(meta), dur);
-    const int buf_size = 80;
-    char msg[buf_size];
-    if (snprintf(msg, buf_size, "TESTSPEED %d\n", dur) < 0) {
-        LOG("Error making msg in tc_start_measurement()\n");
+tc_start_measurements(struct ctrl_sock_meta *metas[], const int num_metas, const unsigned dur, long *skew_us) {
+    char msg[80];
+    struct timespec first, last;
+    int n, err = 0;
+    if (snprintf(msg, sizeof(msg), "TESTSPEED %u\n", dur) < 0) {
+        LOG("Error making msg in tc_start_measurements()\n");
         return 0;
     }
-    if (send(meta->fd, msg, strlen(msg), 0) < 0) {
-        perror("Error sending tc_start_measurement() message");
-        return 0;
+    assert(clock_gettime(CLOCK_MONOTONIC, &first) == 0);
+    for (n = 0; n < num_metas; n++) {
+        if (tc_send(metas[n], msg) < 0) {
+            err = errno;
+            break;
+        }
     }
-    tc_change_state(meta, csm_st_measuring);
-    return 1;
+    if (tc_ev)
+        ev_flush(tc_ev);
+    assert(clock_gettime(CLOCK_MONOTONIC, &last) == 0);
+    *skew_us = (last.tv_sec - first.tv_sec) * 1000000L + (last.tv_nsec - first.tv_nsec) / 1000;
+    for (int i = 0; i < n; i++) {
+        LOG("Told %s to measure for %u secs\n", desc_meta(metas[i]), dur);
+        tc_change_state(metas[i], csm_st_measuring);
+    }
+    if (n < num_metas) {
+        LOG("Error sending tc_start_measurements() message to %s: %s\n", desc_meta(metas[n]), strerror(err));
+    }
+    return n;
 }
 
+/**
+ * Read what the meta has sent of its results and emit each line on bus, as a
+ * res_sample if it's one second's bw and a res_line otherwise
+ */
 int
-tc_output_result(struct ctrl_sock_meta *meta, unsigned m_id, const char *fp, FILE *out_fd) {
+tc_output_result(struct ctrl_sock_meta *meta, unsigned m_id, const char *fp, const struct res_bus *bus) {
     char buf[READ_BUF_LEN];
     int len;
-    struct timeval t;
-    if (gettimeofday(&t, NULL) < 0) {
-        perror("Error getting the time");
-        return 0;
-    }
-    if ((len = recv(meta->fd, buf, READ_BUF_LEN, 0)) < 0) {
+    if ((len = tc_recv(meta, buf, READ_BUF_LEN)) < 0) {
         perror("Error reading result response");
         return 0;
     }
@@ -402,17 +555,38 @@ tc_output_result(struct ctrl_sock_meta *meta, unsigned m_id, const char *fp, FIL
         buf[j] = '\0';
     }
     char *token, *head, *tofree;
+    char measurer[RES_MEASURER_LEN];
+    snprintf(measurer, sizeof(measurer), "%s;%s:%s", meta->class, meta->host, meta->port);
+    // everything read at once gets the same time
+    struct res_event ev, sec_ev;
+    struct cv_sec sec;
+    res_event_init(&ev, res_line, m_id, fp, measurer);
     tofree = head = strdup(buf);
     while ((token = strsep(&head, "\r\n"))) {
         if (!strlen(token))
             continue;
-        fprintf(
-            out_fd,
-            TS_FMT " %u %s %s;%s:%s %s\n",
-            t.tv_sec, t.tv_usec,
-            m_id, fp,
-            meta->class, meta->host, meta->port,
-            token);
+        int sec_done = 0;
+        if (sscanf(token, "650 SPEEDTESTING %ld %ld", &ev.ts, &ev.bw) == 2) {
+            ev.kind = res_sample;
+            sec_done = cv_add(m_id, ev.ts, ev.bw, meta->is_bg, &sec);
+        } else {
+            ev.kind = res_line;
+            ev.ts = ev.bw = 0;
+        }
+        ev.line = token;
+        res_emit(bus, &ev);
+        if (sec_done) {
+            // this was the last measurer to report the second
+            sec_ev = ev;
+            sec_ev.kind = res_second;
+            snprintf(sec_ev.measurer, sizeof(sec_ev.measurer), "coord");
+            sec_ev.ts = sec.ts;
+            sec_ev.bw = sec.bw;
+            sec_ev.bg_bw = sec.bg_bw;
+            sec_ev.n = sec.num_hosts;
+            sec_ev.line = NULL;
+            res_emit(bus, &sec_ev);
+        }
     }
     free(tofree);
     const char *done_resp = "650 SPEEDTESTING END";
@@ -422,28 +596,187 @@ tc_output_result(struct ctrl_sock_meta *meta, unsigned m_id, const char *fp, FIL
     return 1;
 }
 
+/**
+ * Stop measuring with the given meta before its TESTSPEED duration is up.
+ * There's no command to end a TESTSPEED early, so its tor client keeps
+ * measuring until the duration is up no matter what we do. The meta is done
+ * as far as its measurement is concerned, but it keeps its connection and the
+ * bw reserved on its host, and isn't available to another measurement, until
+ * tc_drain_stopped() sees the TESTSPEED end. If that hasn't happened by the
+ * time failsafe_stop, the measurement's failsafe stop time, has passed, the
+ * caller should give up on it.
+ */
+void
+tc_stop_measurement(struct ctrl_sock_meta *meta, const uint64_t failsafe_stop) {
+    tc_assert_state(meta, csm_st_measuring);
+    LOG("Stopping %s early\n", desc_meta(meta));
+    tc_change_state(meta, csm_st_done);
+    meta->stopping = 1;
+    meta->stopping_failsafe = failsafe_stop;
+}
+
+/**
+ * Read and throw away what a meta stopped with tc_stop_measurement() has
+ * sent. Returns 1 while its TESTSPEED is still going, or 0 once it's over or
+ * the connection is gone, when we should be finished with it.
+ */
+int
+tc_drain_stopped(struct ctrl_sock_meta *meta) {
+    char buf[READ_BUF_LEN];
+    int len;
+    assert(meta->stopping);
+    if ((len = tc_recv(meta, buf, READ_BUF_LEN - 1)) <= 0) {
+        LOG("%s went away before its TESTSPEED was over\n", desc_meta(meta));
+        return 0;
+    }
+    buf[len] = '\0';
+    if (strstr(buf, "650 SPEEDTESTING END")) {
+        LOG("%s has finished the TESTSPEED it was stopped early from\n", desc_meta(meta));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Whether the meta is one of the num_addrs measurers given as "host:port"
+ */
+int
+tc_meta_is_one_of(const struct ctrl_sock_meta *meta, char *const addrs[], const size_t num_addrs) {
+    const size_t host_len = strlen(meta->host);
+    for (size_t i = 0; i < num_addrs; i++) {
+        if (!strncmp(addrs[i], meta->host, host_len) && addrs[i][host_len] == ':' &&
+                !strcmp(addrs[i] + host_len + 1, meta->port))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Bw the meta's host has left to give to measurements
+ */
+uint64_t
+tc_spare_capacity(const struct ctrl_sock_meta *meta) {
+    if (!meta->shared || !meta->shared->capacity)
+        return UINT64_MAX;
+    return meta->shared->capacity - meta->shared->used;
+}
+
+/**
+ * Give bw of the meta's host to measurement m_id until tc_release_capacity()
+ */
+void
+tc_reserve_capacity(struct ctrl_sock_meta *meta, const unsigned m_id, const unsigned bw) {
+    assert(!meta->bw);
+    if (!meta->shared)
+        return;
+    meta->bw = bw;
+    meta->shared->used += bw;
+    meta->shared->slot_m_ids[meta->slot] = m_id;
+}
+
+void
+tc_release_capacity(struct ctrl_sock_meta *meta) {
+    if (!meta->shared)
+        return;
+    meta->shared->used -= meta->bw;
+    meta->shared->slot_m_ids[meta->slot] = 0;
+    meta->bw = 0;
+}
+
+/**
+ * Whether another of the meta's host's slots is already in measurement m_id
+ */
+static int
+tc_host_in(const struct ctrl_sock_meta *meta, const unsigned m_id) {
+    if (!meta->shared)
+        return 0;
+    for (unsigned s = 0; s < meta->shared->num_slots; s++) {
+        if (meta->shared->slot_m_ids[s] == m_id)
+            return 1;
+    }
+    return 0;
+}
+
+struct tc_candidate {
+    int idx;
+    int avoided;
+    uint64_t spare;
+};
+
+static int
+tc_candidate_cmp(const void *a_, const void *b_) {
+    const struct tc_candidate *a = a_, *b = b_;
+    if (a->avoided != b->avoided)
+        return a->avoided - b->avoided;
+    if (a->spare != b->spare)
+        return a->spare > b->spare ? -1 : 1;
+    return a->idx - b->idx;
+}
+
+/**
+ * Fill out with the indexes of the idle metas of the given class whose host
+ * has bw to spare for measurement m_id and isn't in it already, in the order
+ * to try them: ones in avoid ("host:port", num_avoid of them) last, and
+ * otherwise those on the hosts with the most spare capacity first. out should
+ * be num_metas in size. Returns how many there are.
+ */
+size_t
+tc_candidates(
+        const int num_metas, struct ctrl_sock_meta metas[], const char *class,
+        const unsigned m_id, const unsigned bw,
+        char *const avoid[], const size_t num_avoid, int out[]) {
+    struct tc_candidate *c = malloc((num_metas ? num_metas : 1) * sizeof(struct tc_candidate));
+    size_t n = 0;
+    for (int i = 0; i < num_metas; i++) {
+        if (strcmp(metas[i].class, class) || metas[i].current_m_id || metas[i].stopping)
+            continue;
+        const uint64_t spare = tc_spare_capacity(&metas[i]);
+        if (spare < bw || tc_host_in(&metas[i], m_id))
+            continue;
+        c[n].idx = i;
+        c[n].avoided = tc_meta_is_one_of(&metas[i], avoid, num_avoid);
+        c[n].spare = spare;
+        n++;
+    }
+    qsort(c, n, sizeof(struct tc_candidate), tc_candidate_cmp);
+    for (size_t i = 0; i < n; i++)
+        out[i] = c[i].idx;
+    free(c);
+    return n;
+}
+
 /** 
- * Finds and returns the index of the next available meta with the given class.
- * "Available" means it isn't used in a measurement, we just now tried
- * connecting to it successfully, and we were able to auth to it. We leave it
- * in the authed and ready-to-go state.
+ * Finds and returns the index of the next available meta with the given class
+ * for measurement m_id, which wants bw from it. "Available" means it isn't
+ * used in a measurement, its host has bw to spare and isn't in the
+ * measurement already, and we just now tried connecting to it successfully.
+ * The bw is reserved on its host until we're finished with it.
+ *
+ * Metas are tried in the order tc_candidates() gives.
  * 
  * If none is available, returns -1.
  */
 int
-tc_next_available(const int num_metas, struct ctrl_sock_meta metas[], const char *class) {
-    for (int i = 0; i < num_metas; i++) {
-        if (!strcmp(metas[i].class, class) && !metas[i].current_m_id) {
-            LOG("Trying to make socket for %s\n", desc_meta(&metas[i]));
-            if (tc_make_socket(&metas[i]) < 0) {
-                //LOG("Unable to open socket to %s:%s\n", metas[i].host, metas[i].port);
-                continue;
-            }
-            LOG("Connected to %s\n", desc_meta(&metas[i]));
-            return i;
+tc_next_available(
+        const int num_metas, struct ctrl_sock_meta metas[], const char *class,
+        const unsigned m_id, const unsigned bw,
+        char *const avoid[], const size_t num_avoid) {
+    int *order = malloc((num_metas ? num_metas : 1) * sizeof(int));
+    const size_t n = tc_candidates(num_metas, metas, class, m_id, bw, avoid, num_avoid, order);
+    int found = -1;
+    for (size_t k = 0; k < n && found < 0; k++) {
+        const int i = order[k];
+        LOG("Trying to make socket for %s\n", desc_meta(&metas[i]));
+        if (tc_make_socket(&metas[i]) < 0) {
+            //LOG("Unable to open socket to %s:%s\n", metas[i].host, metas[i].port);
+            continue;
         }
+        LOG("Connected to %s\n", desc_meta(&metas[i]));
+        tc_reserve_capacity(&metas[i], m_id, bw);
+        found = i;
     }
-    return -1;
+    free(order);
+    return found;
 }
 
 void
@@ -455,10 +788,15 @@ int
 tc_finished_with_meta(struct ctrl_sock_meta *meta) {
     LOG("Finished with %s\n", desc_meta(meta));
     tc_change_state(meta, csm_st_invalid);
+    tc_release_capacity(meta);
+    meta->stopping = 0;
+    meta->stopping_failsafe = 0;
     if (meta->fd >= 0) {
         LOG("closing fd for %s\n", desc_meta(meta));
         // https://stackoverflow.com/questions/4160347/close-vs-shutdown-socket
         //shutdown(meta->fd, SHUT_RDWR);
+        if (tc_ev)
+            ev_forget(tc_ev, meta->fd);
         close(meta->fd);
         meta->fd = -1;
     }
@@ -2,16 +2,33 @@
 #define FF_CLIENTFILE_H
 #include "common.h"
 #define MAX_NUM_CTRL_SOCKS 4096
+struct evloop;
+void tc_set_evloop(struct evloop *ev);
 int tc_client_file_read(const char *fname, struct ctrl_sock_meta metas[]);
+int tc_client_file_merge(const char *fname, struct ctrl_sock_meta metas[], const int num_metas);
 int tc_auth_socket(struct ctrl_sock_meta *meta);
 int tc_authed_socket(struct ctrl_sock_meta *meta);
 int tc_tell_connect(struct ctrl_sock_meta *meta, const char *fp, const unsigned conns);
 int tc_connected_socket(struct ctrl_sock_meta *meta);
 int tc_set_bw_rate(struct ctrl_sock_meta *meta, const unsigned bw);
 int tc_did_set_bw_rate(struct ctrl_sock_meta *meta);
-int tc_start_measurement(struct ctrl_sock_meta *meta, const unsigned dur);
-int tc_output_result(struct ctrl_sock_meta *meta, const unsigned m_id, const char *fp, FILE *out_fd);
-int tc_next_available(const int num_metas, struct ctrl_sock_meta metas[], const char *class);
+int tc_start_measurements(struct ctrl_sock_meta *metas[], const int num_metas, const unsigned dur, long *skew_us);
+struct res_bus;
+int tc_output_result(struct ctrl_sock_meta *meta, const unsigned m_id, const char *fp, const struct res_bus *bus);
+void tc_stop_measurement(struct ctrl_sock_meta *meta, const uint64_t failsafe_stop);
+int tc_drain_stopped(struct ctrl_sock_meta *meta);
+int tc_meta_is_one_of(const struct ctrl_sock_meta *meta, char *const addrs[], const size_t num_addrs);
+uint64_t tc_spare_capacity(const struct ctrl_sock_meta *meta);
+void tc_reserve_capacity(struct ctrl_sock_meta *meta, const unsigned m_id, const unsigned bw);
+void tc_release_capacity(struct ctrl_sock_meta *meta);
+size_t tc_candidates(
+    const int num_metas, struct ctrl_sock_meta metas[], const char *class,
+    const unsigned m_id, const unsigned bw,
+    char *const avoid[], const size_t num_avoid, int out[]);
+int tc_next_available(
+    const int num_metas, struct ctrl_sock_meta metas[], const char *class,
+    const unsigned m_id, const unsigned bw,
+    char *const avoid[], const size_t num_avoid);
 int tc_finished_with_meta(struct ctrl_sock_meta *meta);
 void tc_mark_failed(struct ctrl_sock_meta *meta);
 void tc_assert_state_(const struct ctrl_sock_meta *meta, const enum csm_state state, const char *func, const char *file, const int line);
@@ -0,0 +1,351 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <glib.h>
+#include "trace.h"
+
+/*
+ * A trace of where a coordinator's time goes: every measurer state change,
+ * every measurement phase, and every time the event loop wakes up, each with
+ * the monotonic time it happened. Records are fixed size and go to a buffer
+ * that is written to the trace file whenever it fills and before the event
+ * loop waits, so tracing costs a clock read and a copy per event plus one
+ * write per wait, and a coordinator that is killed loses at most what it did
+ * since it last waited. Turn it into Chrome trace JSON, which Perfetto and
+ * chrome://tracing open, with tr_to_json().
+ *
+ * The file is a header (TR_MAGIC, TR_VERSION, and the size of a record as u32s
+ * in host byte order) followed by struct tr_rec records. A tr_name record is
+ * followed by as many records' worth of bytes as it takes to hold the name.
+ */
+
+#define TR_MAGIC "FFTRACE"
+#define TR_VERSION 1
+#define TR_BUF_RECS 4096
+#define TR_MAX_NAME_LEN 255
+// where each kind of event goes in the JSON
+#define TR_PID_COORD 1
+#define TR_PID_MEASURERS 2
+#define TR_PID_MSMS 3
+
+struct tr_rec {
+    // CLOCK_MONOTONIC
+    uint64_t t_ns;
+    uint32_t m_id;
+    uint32_t b;
+    uint32_t c;
+    // the measurer, from tr_track(), or 0
+    uint16_t track;
+    uint8_t kind;
+    uint8_t a;
+};
+
+struct tr_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+};
+
+struct tr_buf {
+    FILE *f;
+    char *fname;
+    struct tr_rec recs[TR_BUF_RECS];
+    size_t num_recs;
+    uint16_t num_tracks;
+    int failed;
+};
+
+// The trace the calling thread's events go to, if any
+static __thread struct tr_buf *tr_cur = NULL;
+
+/**
+ * Start a trace in fname. Returns NULL if it can't be written.
+ */
+struct tr_buf *
+tr_new(const char *fname) {
+    FILE *f = fopen(fname, "wb");
+    if (!f) {
+        LOG("Unable to open trace file %s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+    struct tr_header h = { .magic = TR_MAGIC, .version = TR_VERSION, .rec_size = sizeof(struct tr_rec) };
+    if (fwrite(&h, sizeof(h), 1, f) != 1) {
+        LOG("Unable to write to trace file %s: %s\n", fname, strerror(errno));
+        fclose(f);
+        return NULL;
+    }
+    struct tr_buf *tr = calloc(1, sizeof(struct tr_buf));
+    tr->f = f;
+    tr->fname = strdup(fname);
+    return tr;
+}
+
+/**
+ * Send the calling thread's events to tr from now on, or nowhere if NULL
+ */
+void
+tr_use(struct tr_buf *tr) {
+    tr_cur = tr;
+}
+
+/**
+ * Whether the calling thread's events are being traced
+ */
+int
+tr_on(void) {
+    return tr_cur != NULL;
+}
+
+static void
+tr_flush(struct tr_buf *tr) {
+    if (tr->num_recs && !tr->failed &&
+            (fwrite(tr->recs, sizeof(struct tr_rec), tr->num_recs, tr->f) != tr->num_recs || fflush(tr->f))) {
+        LOG("Unable to write to trace file %s: %s. No longer tracing\n", tr->fname, strerror(errno));
+        tr->failed = 1;
+    }
+    tr->num_recs = 0;
+}
+
+static struct tr_rec *
+tr_next_rec(struct tr_buf *tr) {
+    if (tr->num_recs == TR_BUF_RECS)
+        tr_flush(tr);
+    return &tr->recs[tr->num_recs++];
+}
+
+/**
+ * Write the calling thread's buffered events now, such as before a long wait
+ */
+void
+tr_sync(void) {
+    if (tr_cur)
+        tr_flush(tr_cur);
+}
+
+void
+tr_event(const enum tr_kind kind, const uint16_t track, const unsigned m_id,
+        const uint8_t a, const uint32_t b, const uint32_t c) {
+    struct timespec now;
+    if (!tr_cur)
+        return;
+    assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    struct tr_rec *r = tr_next_rec(tr_cur);
+    r->t_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    r->m_id = m_id;
+    r->b = b;
+    r->c = c;
+    r->track = track;
+    r->kind = kind;
+    r->a = a;
+}
+
+/**
+ * A new track, such as one measurer, for tr_event(). Returns 0 (no track) if
+ * not tracing or out of tracks.
+ */
+uint16_t
+tr_track(const char *name) {
+    if (!tr_cur || tr_cur->num_tracks == UINT16_MAX)
+        return 0;
+    const uint16_t track = ++tr_cur->num_tracks;
+    size_t len = strlen(name);
+    if (len > TR_MAX_NAME_LEN)
+        len = TR_MAX_NAME_LEN;
+    tr_event(tr_name, track, 0, 0, len, 0);
+    for (size_t off = 0; off < len; off += sizeof(struct tr_rec)) {
+        struct tr_rec *r = tr_next_rec(tr_cur);
+        memset(r, 0, sizeof(*r));
+        memcpy(r, name + off, len - off < sizeof(*r) ? len - off : sizeof(*r));
+    }
+    return track;
+}
+
+void
+tr_free(struct tr_buf *tr) {
+    if (!tr)
+        return;
+    if (tr_cur == tr)
+        tr_cur = NULL;
+    tr_flush(tr);
+    fclose(tr->f);
+    free(tr->fname);
+    free(tr);
+}
+
+/*
+ * Converting to JSON
+ */
+
+static const char *
+tr_phase_str(const unsigned phase) {
+    switch (phase) {
+        case tr_ph_start: return "authing";
+        case tr_ph_authed: return "connecting";
+        case tr_ph_connected: return "setting_bw";
+        case tr_ph_measuring: return "measuring";
+        case tr_ph_done: return "done";
+        case tr_ph_failed: return "failed";
+        default: return "unknown";
+    }
+}
+
+// what a track (measurer) or measurement has been doing since when
+struct tr_open {
+    uint64_t since;
+    unsigned m_id;
+    unsigned what;
+    int open;
+};
+
+static void
+tr_json_name(FILE *out, const int pid, const unsigned tid, const char *key, const char *name) {
+    fprintf(out, ",\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"name\":\"%s\",\"args\":{\"name\":\"", pid, tid, key);
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*name >= 0x20)
+            fputc(*name, out);
+    }
+    fputs("\"}}", out);
+}
+
+static void
+tr_json_slice(FILE *out, const int pid, const unsigned tid, const char *name,
+        const uint64_t t0, const uint64_t from, const uint64_t to, const unsigned m_id) {
+    fprintf(out, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"m_id\":%u}}", pid, tid, name, (from - t0) / 1000.0, (to - from) / 1000.0, m_id);
+}
+
+/* Close off whatever o has been doing as of t */
+static void
+tr_json_close(FILE *out, const int pid, const unsigned tid, struct tr_open *o, const uint64_t t0, const uint64_t t) {
+    if (!o->open)
+        return;
+    if (pid == TR_PID_MEASURERS)
+        tr_json_slice(out, pid, tid, csm_st_str(o->what), t0, o->since, t, o->m_id);
+    else
+        tr_json_slice(out, pid, tid, tr_phase_str(o->what), t0, o->since, t, o->m_id);
+    o->open = 0;
+}
+
+/**
+ * Write the trace in in_fname to out_fname as Chrome trace JSON: one track per
+ * measurer with a slice for each state it was in, one per measurement with a
+ * slice for each phase, and the coordinator's waits in the event loop.
+ * Measurements are tracked by ID, and retries show up on the same track.
+ * Returns 0, or -1 if in_fname can't be read or out_fname written.
+ */
+int
+tr_to_json(const char *in_fname, const char *out_fname) {
+    FILE *in = fopen(in_fname, "rb");
+    if (!in) {
+        LOG("Unable to open trace %s: %s\n", in_fname, strerror(errno));
+        return -1;
+    }
+    struct tr_header h;
+    if (fread(&h, sizeof(h), 1, in) != 1 ||
+            memcmp(h.magic, TR_MAGIC, sizeof(h.magic)) ||
+            h.version != TR_VERSION || h.rec_size != sizeof(struct tr_rec)) {
+        LOG("%s is not a trace we can read\n", in_fname);
+        fclose(in);
+        return -1;
+    }
+    FILE *out = fopen(out_fname, "w");
+    if (!out) {
+        LOG("Unable to open %s: %s\n", out_fname, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    fprintf(out, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"coordinator\"}}", TR_PID_COORD);
+    fprintf(out, ",\n{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"measurers\"}}", TR_PID_MEASURERS);
+    fprintf(out, ",\n{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"measurements\"}}", TR_PID_MSMS);
+    tr_json_name(out, TR_PID_COORD, 1, "thread_name", "event loop");
+    // indexed by track
+    struct tr_open *tracks = calloc(UINT16_MAX + 1, sizeof(struct tr_open));
+    // m_id -> struct tr_open
+    GHashTable *msms = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    uint64_t t0 = 0, t = 0;
+    unsigned long num_recs = 0;
+    struct tr_rec r;
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        if (!num_recs++)
+            t0 = r.t_ns;
+        t = r.t_ns;
+        switch (r.kind) {
+            case tr_name: {
+                char name[TR_MAX_NAME_LEN + 1] = { 0 };
+                char part[sizeof(struct tr_rec)];
+                // b is from the file, so keep no more of the name than fits
+                // and skip the rest of its records
+                const size_t len = r.b < TR_MAX_NAME_LEN ? r.b : TR_MAX_NAME_LEN;
+                for (size_t got = 0; got < r.b && fread(part, sizeof(part), 1, in) == 1; got += sizeof(part)) {
+                    if (got < len)
+                        memcpy(name + got, part, len - got < sizeof(part) ? len - got : sizeof(part));
+                }
+                name[len] = '\0';
+                tr_json_name(out, TR_PID_MEASURERS, r.track, "thread_name", name);
+                break;
+            }
+            case tr_meta_state: {
+                struct tr_open *o = &tracks[r.track];
+                tr_json_close(out, TR_PID_MEASURERS, r.track, o, t0, t);
+                // only while it's busy with something
+                if (r.b != csm_st_invalid && r.b != csm_st_done && r.b != csm_st_failed) {
+                    o->since = t;
+                    o->m_id = r.m_id;
+                    o->what = r.b;
+                    o->open = 1;
+                }
+                break;
+            }
+            case tr_msm_phase: {
+                struct tr_open *o = g_hash_table_lookup(msms, GUINT_TO_POINTER(r.m_id));
+                if (!o) {
+                    o = calloc(1, sizeof(struct tr_open));
+                    g_hash_table_insert(msms, GUINT_TO_POINTER(r.m_id), o);
+                }
+                tr_json_close(out, TR_PID_MSMS, r.m_id, o, t0, t);
+                if (r.a == tr_ph_done || r.a == tr_ph_failed) {
+                    fprintf(out, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"name\":\"%s\",\"ts\":%.3f}",
+                        TR_PID_MSMS, r.m_id, tr_phase_str(r.a), (t - t0) / 1000.0);
+                    g_hash_table_remove(msms, GUINT_TO_POINTER(r.m_id));
+                } else {
+                    o->since = t;
+                    o->m_id = r.m_id;
+                    o->what = r.a;
+                    o->open = 1;
+                }
+                break;
+            }
+            case tr_wakeup: {
+                const uint64_t waited = r.c * 1000ULL;
+                const uint64_t from = waited < t - t0 ? t - waited : t0;
+                fprintf(out, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"name\":\"ev_wait\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"ready\":%u}}", TR_PID_COORD, (from - t0) / 1000.0, (t - from) / 1000.0, r.b);
+                break;
+            }
+            default:
+                LOG("Unknown trace record kind %u. Skipping it\n", r.kind);
+                break;
+        }
+    }
+    // whatever was still going on when the trace ended
+    for (unsigned i = 0; i <= UINT16_MAX; i++)
+        tr_json_close(out, TR_PID_MEASURERS, i, &tracks[i], t0, t);
+    GHashTableIter iter;
+    gpointer k, v;
+    g_hash_table_iter_init(&iter, msms);
+    while (g_hash_table_iter_next(&iter, &k, &v))
+        tr_json_close(out, TR_PID_MSMS, GPOINTER_TO_UINT(k), v, t0, t);
+    fputs("\n]}\n", out);
+    free(tracks);
+    g_hash_table_destroy(msms);
+    fclose(in);
+    const int err = fclose(out);
+    LOG("Wrote %lu trace records from %s to %s\n", num_recs, in_fname, out_fname);
+    return err ? -1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef FF_TRACE_H
+#define FF_TRACE_H
+#include <stdint.h>
+#include "common.h"
+enum tr_kind {
+    // a measurer's state changed. a: old csm_state, b: new csm_state
+    tr_meta_state = 1,
+    // a measurement reached a new phase. a: enum tr_phase
+    tr_msm_phase,
+    // the event loop stopped waiting. b: fds ready, c: usecs waited
+    tr_wakeup,
+    // names track; the name follows in the next records
+    tr_name,
+};
+enum tr_phase {
+    // handed out by the sched, measurers being found and authed
+    tr_ph_start = 0,
+    // every measurer authed, connecting to the relay
+    tr_ph_authed,
+    // every measurer connected to the relay, setting bws
+    tr_ph_connected,
+    // every measurer told to start
+    tr_ph_measuring,
+    tr_ph_done,
+    tr_ph_failed,
+};
+struct tr_buf;
+struct tr_buf *tr_new(const char *fname);
+void tr_use(struct tr_buf *tr);
+int tr_on(void);
+uint16_t tr_track(const char *name);
+void tr_event(const enum tr_kind kind, const uint16_t track, const unsigned m_id,
+    const uint8_t a, const uint32_t b, const uint32_t c);
+void tr_sync(void);
+void tr_free(struct tr_buf *tr);
+int tr_to_json(const char *in_fname, const char *out_fname);
+#endif /* !defined(FF_TRACE_H) */
@@ -1,12 +1,13 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <math.h>
 #include <glib.h>
+#include <zlib.h>
 #include "common.h"
 #include "v3bw.h"
 #include "rotatefd.h"
 
 #define NUM_MSMS_IN_MSM_INFO 60
-#define SECS_REQUIRED 25
 #define MIN_BW 20
 
 static int
@@ -36,17 +37,38 @@ struct msm_info {
     long first;
     long msms[NUM_MSMS_IN_MSM_INFO];
     size_t used;
+    // msms came from the coordinator's per second totals instead of each
+    // measurer's results, which were left out of the file
+    int from_secs;
+    // the coordinator stopped the measurement early because its result had
+    // already settled, so don't hold it to SECS_REQUIRED
+    int converged;
+    // the median and number of seconds the coordinator worked out when the
+    // measurement finished, which win over msms. result is -1 if none.
+    long result;
+    size_t result_secs;
+    // coordinator's time of the last line about it, for merging runs
+    long last_seen;
 };
 
 static struct msm_info *
-msm_info_init(const char *fp, long first, long bw) {
+msm_info_init(const char *fp) {
     // it's important that the memory is zero-initialized: the msms array needs
     // to start at zero.
     struct msm_info *msm = calloc(1, sizeof(struct msm_info));
     msm->fp = strdup(fp);
-    msm->first = first;
-    msm->msms[0] = bw;
-    msm->used = 1;
+    msm->result = -1;
+    return msm;
+}
+
+static struct msm_info *
+msm_info_get(GHashTable *ht, const char *key, const char *fp) {
+    struct msm_info *msm = g_hash_table_lookup(ht, key);
+    if (!msm) {
+        LOG("Inserting %s into ht\n", key);
+        msm = msm_info_init(fp);
+        g_hash_table_insert(ht, strdup(key), msm);
+    }
     return msm;
 }
 
@@ -60,6 +82,8 @@ msm_info_free(struct msm_info *msm) {
 static void
 msm_info_add(struct msm_info *msm, long ts, long bw) {
     assert(msm);
+    if (!msm->used)
+        msm->first = ts;
     if (ts < msm->first) {
         // we could try harder if we really wanted. But let's not do so until
         // it becomes a problem.
@@ -101,6 +125,38 @@ msm_info_add(struct msm_info *msm, long ts, long bw) {
     }
 }
 
+/* Add what one attempt at measuring the relay got, src, to everything dst has
+ * from the run so far */
+static void
+msm_info_fold(struct msm_info *dst, const struct msm_info *src) {
+    if (src->used && dst->used && src->from_secs != dst->from_secs) {
+        LOG("Already have %s for %s. Ignoring %lus of %s\n",
+                dst->from_secs ? "second totals" : "measurer results", dst->fp,
+                src->used, src->from_secs ? "second totals" : "measurer results");
+    } else {
+        for (size_t i = 0; i < src->used; i++)
+            msm_info_add(dst, src->first + i, src->msms[i]);
+        if (src->used)
+            dst->from_secs = src->from_secs;
+    }
+    dst->converged |= src->converged;
+    if (src->result >= 0) {
+        dst->result = src->result;
+        dst->result_secs = src->result_secs;
+    }
+    if (src->last_seen > dst->last_seen)
+        dst->last_seen = src->last_seen;
+}
+
+/* What has been read of one run's msm_out file */
+struct v3bw_read {
+    // fp -> msm_info of every attempt that is over
+    GHashTable *ht;
+    // m_id -> msm_info of the attempt at it that is still going, which a
+    // RETRY line throws away and a RESULT line folds into ht
+    GHashTable *attempts;
+};
+
 static int
 is_fp(const char *word) {
     if (!(strlen(word) == 40)) return 0;
@@ -147,17 +203,182 @@ array_len(void **arr) {
     return count;
 }
 
+/* Add what one line of a msm_out file says to rd */
+static void
+read_line_to_ht(struct v3bw_read *rd, char *line) {
+    trim_newlines(line);
+    gchar **words = g_strsplit(line, " ", 9);
+    if (array_len((void **)words) == 6 && !strcmp(words[4], "CONVERGED")) {
+        // <ts> <m_id> <fp> coord CONVERGED <secs>
+        struct msm_info *m = g_hash_table_lookup(rd->attempts, words[1]);
+        if (m) {
+            LOG("%s converged after %ss\n", words[2], words[5]);
+            m->converged = 1;
+        } else {
+            LOG("Got converged line before any results. Ignoring line '%s'\n", line);
+        }
+        g_strfreev(words);
+        return;
+    }
+    if (array_len((void **)words) == 7 && !strcmp(words[4], "START")) {
+        // <ts> <m_id> <fp> coord START <measurers> <skew_us>
+        // Nothing to do with the relay's bw
+        g_strfreev(words);
+        return;
+    }
+    if (array_len((void **)words) == 6 && !strcmp(words[4], "RETRY")) {
+        // <ts> <m_id> <fp> coord RETRY <failed attempt>
+        // The attempt failed and will be made again, so whatever it
+        // managed to report before failing doesn't count
+        LOG("Attempt %s at %s failed and will be retried\n", words[5], words[2]);
+        g_hash_table_remove(rd->attempts, words[1]);
+        g_strfreev(words);
+        return;
+    }
+    if (array_len((void **)words) == 8 && !strcmp(words[4], "SEC") && is_fp(words[2])) {
+        // <ts> <m_id> <fp> coord SEC <sec> <bw> <bg_bw>
+        // The relay's total for a second, written instead of each
+        // measurer's share of it
+        const long sec = as_nonnegative_long(words[5]);
+        const long bw = as_nonnegative_long(words[6]);
+        const long bg_bw = as_nonnegative_long(words[7]);
+        if (sec < 0 || bw < 0 || bg_bw < 0) {
+            LOG("Unexpected second totals. Ignoring line '%s'\n", line);
+            g_strfreev(words);
+            return;
+        }
+        struct msm_info *m = msm_info_get(rd->attempts, words[1], words[2]);
+        if (m->used && !m->from_secs) {
+            LOG("Already have measurer results for %s. Ignoring line '%s'\n", words[2], line);
+        } else {
+            m->from_secs = 1;
+            msm_info_add(m, sec, bw + bg_bw);
+            m->last_seen = atol(words[0]);
+        }
+        g_strfreev(words);
+        return;
+    }
+    if (array_len((void **)words) == 7 && !strcmp(words[4], "RESULT") && is_fp(words[2])) {
+        // <ts> <m_id> <fp> coord RESULT <median> <secs>
+        const long med = as_nonnegative_long(words[5]);
+        const long secs = as_nonnegative_long(words[6]);
+        if (med < 0 || secs < 0) {
+            LOG("Unexpected result. Ignoring line '%s'\n", line);
+            g_strfreev(words);
+            return;
+        }
+        struct msm_info *m = msm_info_get(rd->attempts, words[1], words[2]);
+        m->result = med;
+        m->result_secs = secs;
+        m->last_seen = atol(words[0]);
+        // That's the last line about the attempt
+        msm_info_fold(msm_info_get(rd->ht, words[2], words[2]), m);
+        g_hash_table_remove(rd->attempts, words[1]);
+        g_strfreev(words);
+        return;
+    }
+    if (array_len((void **)words) != 9) {
+        LOG("Expect 9 words on valid msm line. Ignoring line '%s'\n", line);
+        g_strfreev(words);
+        return;
+    }
+    if (strncmp(words[4], "650", 3) != 0) {
+        LOG("Expected '650' but got '%s'. Ignoring line '%s'\n", words[4], line);
+        g_strfreev(words);
+        return;
+    }
+    if (strncmp(words[5], "SPEEDTESTING", 12) != 0) {
+        LOG("Expected 'SPEEDTESTING' but got '%s'. Ignoring line '%s'\n", words[5], line);
+        g_strfreev(words);
+        return;
+    }
+    char *fp = NULL;;
+    long ts;
+    long bwdown;
+    for (int i = 0; words[i] != NULL; i++) {
+        const char *word = words[i];
+        if  (i == 2) {
+            if (!is_fp(word)) {
+                LOG("Expected fp, got '%s', so ignoring line '%s'\n", word, line);
+                break;
+            }
+            fp = (char *)word;
+            //LOG("fp is %s\n", fp);
+        } else if (i == 6) {
+            if ((ts = as_nonnegative_long(word)) < 0) {
+                // We expect it to fail on BEGIN and END lines, so refrain for logging about that.
+                if (strncmp(word, "BEGIN", strlen("BEGIN")) != 0
+                        && strncmp(word, "END", strlen("END")) != 0)
+                    LOG("Unexpected timestamp, got '%s', so ignoring line '%s'\n", word, line);
+                break;
+            }
+            //LOG("ts is %ld\n", ts);
+        } else if (i == 7) {
+            if ((bwdown = as_nonnegative_long(word)) < 0) {
+                LOG("Unexpected bwdown, got '%s', so ignoring line '%s'\n", word, line);
+                break;
+            }
+            //LOG("bwdown is %ld\n", bwdown);
+        }
+    }
+    if (fp == NULL || ts < 0 || bwdown < 0) {
+        g_strfreev(words);
+        return;
+    }
+    LOG("Read line with fp=%s ts=%ld bwdown=%ld\n", fp, ts, bwdown);
+    struct msm_info *m = msm_info_get(rd->attempts, words[1], fp);
+    if (m->from_secs) {
+        LOG("Already have second totals for %s. Ignoring line '%s'\n", fp, line);
+    } else {
+        msm_info_add(m, ts, bwdown);
+        m->last_seen = atol(words[0]);
+    }
+    g_strfreev(words);
+}
+
 static GHashTable *
-read_input_to_ht(FILE *in) {
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t bytes_read;
-    GHashTable *ht = g_hash_table_new_full(
+v3bw_ht_new(void) {
+    return g_hash_table_new_full(
         g_str_hash,
         g_str_equal,
         free,
         (GDestroyNotify)msm_info_free
     );
+}
+
+static void
+v3bw_read_init(struct v3bw_read *rd) {
+    rd->ht = v3bw_ht_new();
+    rd->attempts = v3bw_ht_new();
+}
+
+/* Count the attempts the run ended in the middle of, such as those in a file
+ * from before RESULT lines, as over */
+static void
+v3bw_read_finish(struct v3bw_read *rd) {
+    GHashTableIter iter;
+    gpointer k, v;
+    g_hash_table_iter_init(&iter, rd->attempts);
+    while (g_hash_table_iter_next(&iter, &k, &v)) {
+        const struct msm_info *m = v;
+        msm_info_fold(msm_info_get(rd->ht, m->fp, m->fp), m);
+    }
+    g_hash_table_destroy(rd->attempts);
+    rd->attempts = NULL;
+}
+
+static void
+v3bw_read_free(struct v3bw_read *rd) {
+    if (rd->attempts)
+        g_hash_table_destroy(rd->attempts);
+    g_hash_table_destroy(rd->ht);
+}
+
+static void
+read_stream_to_ht(FILE *in, struct v3bw_read *rd) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t bytes_read;
     while (1) {
         bytes_read = getline(&line, &cap, in);
         if (bytes_read < 0) {
@@ -169,111 +390,232 @@ read_input_to_ht(FILE *in) {
             LOG("Read empty line. Trying to loop again.\n");
             continue;
         }
-        trim_newlines(line);
-        gchar **words = g_strsplit(line, " ", 9);
-        if (array_len((void **)words) != 9) {
-            LOG("Expect 9 words on valid msm line. Ignoring line '%s'\n", line);
-            g_strfreev(words);
-            continue;
-        }
-        if (strncmp(words[4], "650", 3) != 0) {
-            LOG("Expected '650' but got '%s'. Ignoring line '%s'\n", words[4], line);
-            g_strfreev(words);
-            continue;
-        }
-        if (strncmp(words[5], "SPEEDTESTING", 12) != 0) {
-            LOG("Expected 'SPEEDTESTING' but got '%s'. Ignoring line '%s'\n", words[5], line);
-            g_strfreev(words);
-            continue;
-        }
-        char *fp = NULL;;
-        long ts;
-        long bwdown;
-        for (int i = 0; words[i] != NULL; i++) {
-            const char *word = words[i];
-            if  (i == 2) {
-                if (!is_fp(word)) {
-                    LOG("Expected fp, got '%s', so ignoring line '%s'\n", word, line);
-                    break;
-                }
-                fp = (char *)word;
-                //LOG("fp is %s\n", fp);
-            } else if (i == 6) {
-                if ((ts = as_nonnegative_long(word)) < 0) {
-                    // We expect it to fail on BEGIN and END lines, so refrain for logging about that.
-                    if (strncmp(word, "BEGIN", strlen("BEGIN")) != 0
-                            && strncmp(word, "END", strlen("END")) != 0)
-                        LOG("Unexpected timestamp, got '%s', so ignoring line '%s'\n", word, line);
-                    break;
-                }
-                //LOG("ts is %ld\n", ts);
-            } else if (i == 7) {
-                if ((bwdown = as_nonnegative_long(word)) < 0) {
-                    LOG("Unexpected bwdown, got '%s', so ignoring line '%s'\n", word, line);
-                    break;
-                }
-                //LOG("bwdown is %ld\n", bwdown);
-            }
+        read_line_to_ht(rd, line);
+        //break;
+    }
+    free(line);
+}
+
+/* Add one file of a rotated msm_out file to the struct v3bw_read arg */
+static int
+read_segment_to_ht(const char *fname, int gz, void *arg) {
+    struct v3bw_read *rd = arg;
+    LOG("Reading msm data from %s\n", fname);
+    if (!gz) {
+        FILE *in = fopen(fname, "r");
+        if (!in) {
+            perror("Unable to open in file for v3bw generate");
+            return -1;
         }
-        if (fp == NULL || ts < 0 || bwdown < 0) {
-            g_strfreev(words);
+        read_stream_to_ht(in, rd);
+        fclose(in);
+        return 0;
+    }
+    gzFile in = gzopen(fname, "rb");
+    if (!in) {
+        perror("Unable to open compressed in file for v3bw generate");
+        return -1;
+    }
+    size_t cap = 1024, len = 0;
+    char *line = malloc(cap);
+    while (gzgets(in, line + len, cap - len)) {
+        len += strlen(line + len);
+        if (line[len-1] != '\n' && !gzeof(in)) {
+            // didn't get the whole line
+            line = realloc(line, cap *= 2);
             continue;
         }
-        LOG("Read line with fp=%s ts=%ld bwdown=%ld\n", fp, ts, bwdown);
-        if (!g_hash_table_contains(ht, fp)) {
-            LOG("Inserting %s into ht\n", fp);
-            g_hash_table_insert(ht, strdup(fp), msm_info_init(fp, ts, bwdown));
-        } else {
-            struct msm_info *m = g_hash_table_lookup(ht, fp);
-            assert(m);
-            msm_info_add(m, ts, bwdown);
-        }
-        g_strfreev(words);
-        //break;
+        read_line_to_ht(rd, line);
+        len = 0;
     }
     free(line);
-    return ht;
+    gzclose(in);
+    return 0;
+}
+
+/* The relay's bw according to the measurement, or MIN_BW (and *valid set to
+ * 0) if it doesn't have enough seconds of results */
+static long
+msm_info_bw(const struct msm_info *msm, int *valid) {
+    long med = calc_median(msm->msms, msm->used);
+    size_t secs = msm->used;
+    if (msm->result >= 0) {
+        med = msm->result;
+        secs = msm->result_secs;
+    }
+    *valid = 1;
+    if (secs < SECS_REQUIRED && !msm->converged) {
+        LOG("%s saw only %lus of data, so outputting min bw %d\n", msm->fp, secs, MIN_BW);
+        med = MIN_BW;
+        *valid = 0;
+    }
+    return med;
 }
 
 static int
-_v3bw_generate(FILE *in, FILE *out) {
+_v3bw_generate(GHashTable *ht, FILE *out) {
     GHashTableIter iter;
     gpointer k, v;
-    GHashTable *ht = read_input_to_ht(in);
-    if (!ht) return -1;
+    int valid;
     fprintf(out, "%lu\n", time(NULL));
     g_hash_table_iter_init(&iter, ht);
     while (g_hash_table_iter_next(&iter, &k, &v)) {
         char *fp = (char *)k;
         struct msm_info *msm = (struct msm_info *)v;
-        long med = calc_median(msm->msms, msm->used);
-        if (msm->used < SECS_REQUIRED) {
-            LOG("%s saw only %lus of data, so outputting min bw %d\n", fp, msm->used, MIN_BW);
-            med = MIN_BW;
-        }
+        const long med = msm_info_bw(msm, &valid);
         fprintf(out, "node_id=$%s\tbw=%ld\n", fp, med);
         LOG("%s saw %lu Mbit/s\n", fp, med * 8 / 1000 / 1000);
     }
-    g_hash_table_destroy(ht);
     return 0;
 }
 
+/**
+ * Write a v3bw file from the msm_out file in_fname, along with any files it
+ * was rotated into while it was being written. Waits for those still being
+ * compressed first, as they move from one name to another while that goes on.
+ */
 int
 v3bw_generate(const char *in_fname, const char *out_fname) {
-    FILE *in_fd;
     struct rotate_fd *out_rfd;
-    if (!(in_fd = fopen(in_fname, "r"))) {
-        perror("Unable to open in file for v3bw generate");
+    struct v3bw_read rd;
+    int num_segs;
+    rfd_gz_wait();
+    v3bw_read_init(&rd);
+    if ((num_segs = rfd_for_each_segment(in_fname, read_segment_to_ht, &rd)) < 0) {
+        v3bw_read_free(&rd);
         return -1;
     }
+    v3bw_read_finish(&rd);
     if (!(out_rfd = rfd_open(out_fname))) {
         perror("Unable to open out file for v3bw generate");
-        fclose(in_fd);
+        v3bw_read_free(&rd);
         return -2;
     }
-    LOG("Reading msm data from %s and writing v3bw to %s\n", in_fname, out_rfd->fname);
-    int ret = _v3bw_generate(in_fd, out_rfd->fd);
-    fclose(in_fd);
+    LOG("Read msm data from %d files of %s and writing v3bw to %s\n", num_segs, in_fname, out_rfd->fname);
+    int ret = _v3bw_generate(rd.ht, out_rfd->fd);
+    v3bw_read_free(&rd);
     rfd_close(out_rfd);
     return ret;
 }
+
+/* What the runs merged so far say about one relay */
+struct v3bw_merged {
+    // v3bw_newest: the newest valid result and when it was
+    long bw;
+    long when;
+    // v3bw_decay: each valid result and when it was, to be weighted once we
+    // know the newest time of all
+    long *bws;
+    long *whens;
+    size_t num, cap;
+    int any_valid;
+};
+
+static void
+v3bw_merged_free(struct v3bw_merged *m) {
+    free(m->bws);
+    free(m->whens);
+    free(m);
+}
+
+/* Fold one run's results, in ht, into merged */
+static void
+v3bw_merge_run(GHashTable *merged, GHashTable *ht, const enum v3bw_policy policy, long *newest) {
+    GHashTableIter iter;
+    gpointer k, v;
+    int valid;
+    g_hash_table_iter_init(&iter, ht);
+    while (g_hash_table_iter_next(&iter, &k, &v)) {
+        const struct msm_info *msm = v;
+        const long bw = msm_info_bw(msm, &valid);
+        struct v3bw_merged *m = g_hash_table_lookup(merged, k);
+        if (!m) {
+            m = calloc(1, sizeof(struct v3bw_merged));
+            m->bw = MIN_BW;
+            m->when = -1;
+            g_hash_table_insert(merged, strdup(k), m);
+        }
+        if (!valid)
+            continue;
+        if (msm->last_seen > *newest)
+            *newest = msm->last_seen;
+        m->any_valid = 1;
+        if (policy == v3bw_newest) {
+            if (msm->last_seen >= m->when) {
+                m->bw = bw;
+                m->when = msm->last_seen;
+            }
+            continue;
+        }
+        if (m->num == m->cap) {
+            m->cap = m->cap ? m->cap * 2 : 4;
+            m->bws = realloc(m->bws, m->cap * sizeof(long));
+            m->whens = realloc(m->whens, m->cap * sizeof(long));
+        }
+        m->bws[m->num] = bw;
+        m->whens[m->num] = msm->last_seen;
+        m->num++;
+    }
+}
+
+/**
+ * Write a v3bw file from the results of several runs, each in one of the
+ * num_in msm_out files in_fnames (along with any files it was rotated into).
+ * Each run is read and boiled down to one result per relay before the next
+ * is read, so memory use depends on the number of relays, not the amount of
+ * results. Each relay's result is the newest one that had enough seconds
+ * with v3bw_newest. With v3bw_decay it is an average of its results weighted
+ * by half for every half_life seconds it is older than the newest result of
+ * any relay. Relays without any such result get MIN_BW. Like
+ * v3bw_generate(), waits for any segments still being compressed first.
+ */
+int
+v3bw_merge(
+        const char *const in_fnames[], const size_t num_in, const char *out_fname,
+        const enum v3bw_policy policy, const unsigned half_life) {
+    GHashTableIter iter;
+    gpointer k, v;
+    struct rotate_fd *out_rfd;
+    long newest = 0;
+    GHashTable *merged = g_hash_table_new_full(
+        g_str_hash, g_str_equal, free, (GDestroyNotify)v3bw_merged_free);
+    rfd_gz_wait();
+    for (size_t i = 0; i < num_in; i++) {
+        struct v3bw_read rd;
+        v3bw_read_init(&rd);
+        if (rfd_for_each_segment(in_fnames[i], read_segment_to_ht, &rd) < 0) {
+            v3bw_read_free(&rd);
+            g_hash_table_destroy(merged);
+            return -1;
+        }
+        v3bw_read_finish(&rd);
+        LOG("Merging %u relays from %s\n", g_hash_table_size(rd.ht), in_fnames[i]);
+        v3bw_merge_run(merged, rd.ht, policy, &newest);
+        v3bw_read_free(&rd);
+    }
+    if (!(out_rfd = rfd_open(out_fname))) {
+        perror("Unable to open out file for v3bw merge");
+        g_hash_table_destroy(merged);
+        return -2;
+    }
+    LOG("Writing %u relays from %lu runs to %s\n", g_hash_table_size(merged), num_in, out_rfd->fname);
+    fprintf(out_rfd->fd, "%lu\n", time(NULL));
+    g_hash_table_iter_init(&iter, merged);
+    while (g_hash_table_iter_next(&iter, &k, &v)) {
+        struct v3bw_merged *m = v;
+        long bw = m->bw;
+        if (policy == v3bw_decay && m->any_valid) {
+            double sum = 0, weights = 0;
+            for (size_t j = 0; j < m->num; j++) {
+                const double w = half_life ? exp2(-(double)(newest - m->whens[j]) / half_life) : 1;
+                sum += w * m->bws[j];
+                weights += w;
+            }
+            bw = weights > 0 ? lround(sum / weights) : MIN_BW;
+        }
+        fprintf(out_rfd->fd, "node_id=$%s\tbw=%ld\n", (char *)k, bw);
+    }
+    g_hash_table_destroy(merged);
+    rfd_close(out_rfd);
+    return 0;
+}
@@ -1,5 +1,17 @@
 #ifndef FF_V3BW_H
 #define FF_V3BW_H
 #include <stdio.h>
+// seconds of results a relay needs for its bw to count, unless its
+// measurement converged
+#define SECS_REQUIRED 25
+enum v3bw_policy {
+    // each relay's newest result with enough seconds
+    v3bw_newest = 0,
+    // each relay's results averaged, older ones counting for less
+    v3bw_decay,
+};
 int v3bw_generate(const char *in_fname, const char *out_fname);
+int v3bw_merge(
+    const char *const in_fnames[], const size_t num_in, const char *out_fname,
+    const enum v3bw_policy policy, const unsigned half_life);
 #endif /* !defined(FF_V3BW_H) */